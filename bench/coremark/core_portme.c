@@ -0,0 +1,144 @@
+#include "bench.h"
+#include "coremark.h"
+#include <stdarg.h>
+
+#if VALIDATION_RUN
+volatile ee_s32 seed1_volatile = 0x3415;
+volatile ee_s32 seed2_volatile = 0x3415;
+volatile ee_s32 seed3_volatile = 0x66;
+#endif
+#if PERFORMANCE_RUN
+volatile ee_s32 seed1_volatile = 0x0;
+volatile ee_s32 seed2_volatile = 0x0;
+volatile ee_s32 seed3_volatile = 0x66;
+#endif
+#if PROFILE_RUN
+volatile ee_s32 seed1_volatile = 0x8;
+volatile ee_s32 seed2_volatile = 0x8;
+volatile ee_s32 seed3_volatile = 0x8;
+#endif
+volatile ee_s32 seed4_volatile = ITERATIONS;
+volatile ee_s32 seed5_volatile = 0;
+
+// The CLINT frequency rve reports to guests.
+#define EE_TICKS_PER_SEC 10000000
+
+ee_u32 default_num_contexts = 1;
+
+CORE_TICKS start_time_val;
+CORE_TICKS stop_time_val;
+
+void start_time(void) {
+    start_time_val = *CLINT_MTIME;
+}
+
+void stop_time(void) {
+    stop_time_val = *CLINT_MTIME;
+}
+
+CORE_TICKS get_time(void) {
+    return stop_time_val - start_time_val;
+}
+
+secs_ret time_in_secs(CORE_TICKS ticks) {
+    return (secs_ret)(ticks / EE_TICKS_PER_SEC);
+}
+
+void portable_init(core_portable *p, int *argc, char *argv[]) {
+    if (sizeof(ee_ptr_int) != sizeof(ee_u8 *) || sizeof(ee_u32) != 4) {
+        ee_printf("ERROR! Please define ee_ptr_int and ee_u32 correctly!\n");
+    }
+    p->portable_id = 1;
+}
+
+void portable_fini(core_portable *p) {
+    p->portable_id = 0;
+}
+
+void PutPadded(const char *digits, int len, int width, char pad) {
+    for (int i = len; i < width; i++) {
+        PutChar(pad);
+    }
+    for (int i = 0; i < len; i++) {
+        PutChar(digits[i]);
+    }
+}
+
+// The subset of printf that CoreMark uses: %d, %u, %x, %s and %c with
+// an optional zero flag, width and l modifier.
+int ee_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            PutChar(*fmt);
+            continue;
+        }
+        fmt++;
+        char pad = ' ';
+        if (*fmt == '0') {
+            pad = '0';
+            fmt++;
+        }
+        int width = 0;
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + *fmt++ - '0';
+        }
+        int is_long = 0;
+        while (*fmt == 'l') {
+            is_long = 1;
+            fmt++;
+        }
+        char buf[24];
+        int len = 0;
+        uint64_t n;
+        switch (*fmt) {
+        case 'd': {
+            int64_t v = is_long ? va_arg(ap, long) : va_arg(ap, int);
+            if (v < 0) {
+                PutChar('-');
+                v = -v;
+            }
+            n = v;
+            do {
+                buf[len++] = '0' + n % 10;
+                n /= 10;
+            } while (n != 0);
+            break;
+        }
+        case 'u':
+        case 'x':
+            n = is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+            do {
+                int base = *fmt == 'x' ? 16 : 10;
+                buf[len++] = "0123456789abcdef"[n % base];
+                n /= base;
+            } while (n != 0);
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            PutString(s != NULL ? s : "(null)");
+            continue;
+        }
+        case 'c':
+            PutChar(va_arg(ap, int));
+            continue;
+        case '%':
+            PutChar('%');
+            continue;
+        default:
+            PutChar('%');
+            PutChar(*fmt);
+            continue;
+        }
+        // The digits are in reverse.
+        for (int i = 0; i < len / 2; i++) {
+            char t = buf[i];
+            buf[i] = buf[len - 1 - i];
+            buf[len - 1 - i] = t;
+        }
+        PutPadded(buf, len, width, pad);
+    }
+    va_end(ap);
+    return 0;
+}
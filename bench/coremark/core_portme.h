@@ -0,0 +1,66 @@
+#ifndef CORE_PORTME_H
+#define CORE_PORTME_H
+
+// CoreMark port for rve: bare metal on the bench runtime, timed with the
+// CLINT mtime, which counts instructions with the default timebase.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HAS_FLOAT 0
+#define HAS_TIME_H 0
+#define USE_CLOCK 0
+#define HAS_STDIO 0
+#define HAS_PRINTF 0
+
+typedef uint64_t CORE_TICKS;
+
+#ifndef COMPILER_VERSION
+#define COMPILER_VERSION "GCC" __VERSION__
+#endif
+#ifndef COMPILER_FLAGS
+#define COMPILER_FLAGS FLAGS_STR
+#endif
+#ifndef MEM_LOCATION
+#define MEM_LOCATION "STACK"
+#endif
+
+typedef int16_t ee_s16;
+typedef uint16_t ee_u16;
+typedef int32_t ee_s32;
+typedef double ee_f32;
+typedef uint8_t ee_u8;
+typedef uint32_t ee_u32;
+typedef uintptr_t ee_ptr_int;
+typedef size_t ee_size_t;
+
+#define align_mem(x) (void *)(4 + (((ee_ptr_int)(x)-1) & ~3))
+
+#define SEED_METHOD SEED_VOLATILE
+#define MEM_METHOD MEM_STACK
+#define MULTITHREAD 1
+#define MAIN_HAS_NOARGC 1
+#define MAIN_HAS_NORETURN 0
+
+extern ee_u32 default_num_contexts;
+
+typedef struct CORE_PORTABLE_S {
+    ee_u8 portable_id;
+} core_portable;
+
+void portable_init(core_portable *p, int *argc, char *argv[]);
+void portable_fini(core_portable *p);
+
+#if !defined(PROFILE_RUN) && !defined(PERFORMANCE_RUN) && !defined(VALIDATION_RUN)
+#if (TOTAL_DATA_SIZE == 1200)
+#define PROFILE_RUN 1
+#elif (TOTAL_DATA_SIZE == 2000)
+#define PERFORMANCE_RUN 1
+#else
+#define VALIDATION_RUN 1
+#endif
+#endif
+
+int ee_printf(const char *fmt, ...);
+
+#endif
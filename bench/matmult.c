@@ -0,0 +1,51 @@
+#include "bench.h"
+
+// Integer matrix multiplication: multiplies and dependent loads in nested
+// loops.
+
+#define MAT_SIZE 64
+#define MAT_ROUNDS 10
+
+int32_t mat_a[MAT_SIZE][MAT_SIZE];
+int32_t mat_b[MAT_SIZE][MAT_SIZE];
+int32_t mat_c[MAT_SIZE][MAT_SIZE];
+
+void Multiply() {
+    for (int i = 0; i < MAT_SIZE; i++) {
+        for (int j = 0; j < MAT_SIZE; j++) {
+            int32_t sum = 0;
+            for (int k = 0; k < MAT_SIZE; k++) {
+                sum += mat_a[i][k] * mat_b[k][j];
+            }
+            mat_c[i][j] = sum;
+        }
+    }
+}
+
+int main() {
+    uint32_t seed = 1;
+    for (int i = 0; i < MAT_SIZE; i++) {
+        for (int j = 0; j < MAT_SIZE; j++) {
+            mat_a[i][j] = (int32_t)(Random(&seed) >> 20) - 2048;
+            mat_b[i][j] = (int32_t)(Random(&seed) >> 20) - 2048;
+        }
+    }
+    for (int i = 0; i < MAT_ROUNDS; i++) {
+        Multiply();
+    }
+    // The sum of all of C is the dot product of the column sums of A and
+    // the row sums of B.
+    int64_t sum = 0;
+    int64_t check = 0;
+    for (int k = 0; k < MAT_SIZE; k++) {
+        int64_t col = 0;
+        int64_t row = 0;
+        for (int i = 0; i < MAT_SIZE; i++) {
+            col += mat_a[i][k];
+            row += mat_b[k][i];
+            sum += mat_c[k][i];
+        }
+        check += col * row;
+    }
+    return Report("matmult", sum == check);
+}
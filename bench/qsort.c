@@ -0,0 +1,68 @@
+#include "bench.h"
+
+// Recursive quicksort of pseudo-random integers: data-dependent branches,
+// calls and stores.
+
+#define SORT_LEN 20000
+#define SORT_ROUNDS 5
+
+uint32_t sort_buf[SORT_LEN];
+
+void Sort(uint32_t *v, int len) {
+    while (len > 16) {
+        uint32_t pivot = v[len / 2];
+        int i = 0;
+        int j = len - 1;
+        while (i <= j) {
+            while (v[i] < pivot) {
+                i++;
+            }
+            while (v[j] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                uint32_t t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
+            }
+        }
+        // Recurse into the smaller half to bound the stack.
+        if (j + 1 < len - i) {
+            Sort(v, j + 1);
+            v += i;
+            len -= i;
+        } else {
+            Sort(v + i, len - i);
+            len = j + 1;
+        }
+    }
+    for (int i = 1; i < len; i++) {
+        uint32_t t = v[i];
+        int j = i;
+        for (; j > 0 && v[j - 1] > t; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = t;
+    }
+}
+
+int main() {
+    uint32_t seed = 1;
+    int ok = 1;
+    for (int round = 0; round < SORT_ROUNDS; round++) {
+        uint64_t sum = 0;
+        for (int i = 0; i < SORT_LEN; i++) {
+            sort_buf[i] = Random(&seed);
+            sum += sort_buf[i];
+        }
+        Sort(sort_buf, SORT_LEN);
+        for (int i = 0; i < SORT_LEN; i++) {
+            if (i > 0 && sort_buf[i - 1] > sort_buf[i]) {
+                ok = 0;
+            }
+            sum -= sort_buf[i];
+        }
+        ok &= sum == 0;
+    }
+    return Report("qsort", ok);
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Run every workload in bench/build under rve and collect the statistics of
+# each run into bench/results.json (or the file given as $1).
+#
+# XV6_KERNEL and XV6_FS add a boot of xv6, cut off after XV6_INSTRET
+# instructions so that every run does the same work.
+
+cd "$(dirname "$0")/.."
+make &> /dev/null
+
+out=${1:-bench/results.json}
+stats=$(mktemp)
+trap 'rm -f "$stats"' EXIT
+runs=()
+
+run_bench() {
+    name=$1
+    shift
+    ./bin/rve "$@" --headless --console /dev/null --stats "$stats" > /dev/null
+    code="$?"
+    if [ ! -s "$stats" ]; then
+        echo "$name: rve failed with $code"
+        return
+    fi
+    echo "$name: exit $code, $(cat "$stats")"
+    runs+=("{\"name\": \"$name\", \"exit\": $code, \"stats\": $(cat "$stats")}")
+    : > "$stats"
+}
+
+for bin in bench/build/*; do
+    [ -f "$bin" ] && run_bench "$(basename "$bin")" "$bin"
+done
+if [ -n "$XV6_KERNEL" ]; then
+    run_bench xv6-boot "$XV6_KERNEL" --disk "$XV6_FS" --virtio-legacy \
+        --max-instret "${XV6_INSTRET:-200000000}" --smp "${XV6_HARTS:-1}"
+fi
+
+if [ "${#runs[*]}" = "0" ]; then
+    echo "Nothing to run: build the workloads with make -C bench."
+    exit 1
+fi
+(
+    echo "["
+    for i in "${!runs[@]}"; do
+        sep=","
+        [ "$i" = "$((${#runs[*]} - 1))" ] && sep=""
+        echo "  ${runs[$i]}$sep"
+    done
+    echo "]"
+) > "$out"
+echo "Wrote $out"
@@ -0,0 +1,27 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A minimal bare-metal runtime for the workloads: crt0.s calls main() and
+// stops the machine, whose exit status is the return value of main().
+
+#define UART_THR ((volatile uint8_t *)0x10000000)
+#define UART_LSR ((volatile uint8_t *)0x10000005)
+#define CLINT_MTIME ((volatile uint64_t *)0x200bff8)
+
+void PutChar(char c);
+void PutString(const char *s);
+void PutNumber(uint64_t n);
+// Print "name: ok" or "name: failed" and return the exit status for it.
+int Report(const char *name, int ok);
+
+// Deterministic pseudo-random numbers for the inputs.
+uint32_t Random(uint32_t *seed);
+
+// gcc may emit calls to these even in freestanding code.
+void *memset(void *dst, int c, size_t n);
+void *memcpy(void *dst, const void *src, size_t n);
+
+#endif
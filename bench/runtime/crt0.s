@@ -0,0 +1,17 @@
+.section .text.init,"ax"
+
+.global _start
+_start:
+    la sp, stack_top
+    jal ra, main
+    # With every interrupt disabled, wfi stops rve, which exits with a0.
+    csrw mie, zero
+    csrw sie, zero
+1:
+    wfi
+    j 1b
+
+.section .bss
+.align 4
+    .space 65536
+stack_top:
@@ -0,0 +1,53 @@
+#include "bench.h"
+
+void PutChar(char c) {
+    while ((*UART_LSR & 0x20) == 0) {
+    }
+    *UART_THR = c;
+}
+
+void PutString(const char *s) {
+    while (*s != '\0') {
+        PutChar(*s++);
+    }
+}
+
+void PutNumber(uint64_t n) {
+    char buf[20];
+    int len = 0;
+    do {
+        buf[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (len > 0) {
+        PutChar(buf[--len]);
+    }
+}
+
+int Report(const char *name, int ok) {
+    PutString(name);
+    PutString(ok ? ": ok\n" : ": failed\n");
+    return ok ? 0 : 1;
+}
+
+uint32_t Random(uint32_t *seed) {
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed;
+}
+
+void *memset(void *dst, int c, size_t n) {
+    uint8_t *d = dst;
+    while (n-- > 0) {
+        *d++ = c;
+    }
+    return dst;
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    while (n-- > 0) {
+        *d++ = *s++;
+    }
+    return dst;
+}
@@ -0,0 +1,33 @@
+#include "bench.h"
+
+// Sieve of Eratosthenes over 1 MiB: strided byte stores across many pages.
+
+#define SIEVE_LEN (1 << 20)
+#define SIEVE_ROUNDS 4
+// The number of primes below 2^20.
+#define SIEVE_PRIMES 82025
+
+uint8_t composite[SIEVE_LEN];
+
+int CountPrimes() {
+    memset(composite, 0, sizeof(composite));
+    int count = 0;
+    for (int i = 2; i < SIEVE_LEN; i++) {
+        if (composite[i]) {
+            continue;
+        }
+        count++;
+        for (int j = 2 * i; j < SIEVE_LEN; j += i) {
+            composite[j] = 1;
+        }
+    }
+    return count;
+}
+
+int main() {
+    int ok = 1;
+    for (int i = 0; i < SIEVE_ROUNDS; i++) {
+        ok &= CountPrimes() == SIEVE_PRIMES;
+    }
+    return Report("sieve", ok);
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#ifdef RVE_CURSES
+#include <curses.h>
+#endif
+
+// The host side of the UART.
+//
+// The headless backend needs no terminal: output goes through a fully
+// buffered stdio stream to stdout or a file and is flushed on a newline or
+// when the buffer fills up. The curses backend is only available when rve is
+// built with RVE_CURSES; it refreshes the screen at the same points, so that
+// output doesn't sit in stdscr.
+//
+// Input of both backends is read from `in_fd` (stdin for rve) by a dedicated
+// thread into a single-producer single-consumer ring, so the CPU loop never
+// makes a system call to look for input. A console without an input fd has no
+// thread; whoever calls PushInput is then the only producer. CloseConsole
+// stops and joins the thread through `stop_fd`.
+
+bool PushInput(InputRing *ring, uint8_t ch) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == INPUT_RING_SIZE) {
+        return false;
+    }
+    ring->buf[tail % INPUT_RING_SIZE] = ch;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int PopInput(InputRing *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return -1;
+    }
+    uint8_t ch = ring->buf[head % INPUT_RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return ch;
+}
+
+void *InputThread(void *arg) {
+    Console *console = arg;
+    uint8_t buf[256];
+    for (;;) {
+        struct pollfd fds[2] = {{.fd = console->in_fd, .events = POLLIN},
+                                {.fd = console->stop_fd, .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            return NULL;
+        }
+        if (fds[1].revents) {
+            return NULL;
+        }
+        if (fds[0].revents == 0) {
+            continue;
+        }
+        ssize_t n = read(console->in_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return NULL;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            // Wait for the guest to drain the ring rather than drop input.
+            while (!PushInput(&console->input, buf[i])) {
+                if (poll(&fds[1], 1, 1) > 0) {
+                    return NULL;
+                }
+            }
+        }
+        // Wake up a hart parked in WFI.
+        int wake_fd = __atomic_load_n(&console->wake_fd, __ATOMIC_ACQUIRE);
+        if (wake_fd >= 0) {
+            uint64_t one = 1;
+            write(wake_fd, &one, sizeof(one));
+        }
+    }
+}
+
+void StartInputThread(Console *console) {
+    if (console->in_fd < 0) {
+        return;
+    }
+    console->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (console->stop_fd < 0 ||
+        pthread_create(&console->input_thread, NULL, InputThread, console) != 0) {
+        Error("Can't start the console input thread.");
+    }
+    console->has_input_thread = true;
+}
+
+void StopInputThread(Console *console) {
+    if (!console->has_input_thread) {
+        return;
+    }
+    uint64_t one = 1;
+    write(console->stop_fd, &one, sizeof(one));
+    pthread_join(console->input_thread, NULL);
+    close(console->stop_fd);
+    console->has_input_thread = false;
+}
+
+// Open a console that reads input from `in_fd`, or takes none if it is -1.
+Console *NewConsole(uint8_t backend, const char *out_name, int in_fd) {
+    Console *console = calloc(1, sizeof(Console));
+    console->backend = backend;
+    console->in_fd = in_fd;
+    console->stop_fd = -1;
+    console->wake_fd = -1;
+
+    console->out = stdout;
+    if (out_name != NULL) {
+        console->out = fopen(out_name, "wb");
+        if (console->out == NULL) {
+            Error("Can't open the console output: %s.", out_name);
+        }
+    }
+
+    if (backend == ConsoleCurses) {
+#ifdef RVE_CURSES
+        if (newterm(NULL, console->out, stdin) == NULL) {
+            Error("Can't start curses on the terminal.");
+        }
+        cbreak();
+        nodelay(stdscr, true);
+        noecho();
+        scrollok(stdscr, true);
+        StartInputThread(console);
+        return console;
+#else
+        Error("rve is built without curses; use the headless console.");
+#endif
+    }
+
+    setvbuf(console->out, NULL, _IOFBF, CONSOLE_BUF_SIZE);
+    StartInputThread(console);
+    return console;
+}
+
+// Pick curses when it's built in and stdout is a terminal.
+uint8_t DefaultConsoleBackend() {
+#ifdef RVE_CURSES
+    if (isatty(STDOUT_FILENO)) {
+        return ConsoleCurses;
+    }
+#endif
+    return ConsoleHeadless;
+}
+
+void ConsolePutc(Console *console, uint8_t ch) {
+#ifdef RVE_CURSES
+    if (console->backend == ConsoleCurses) {
+        addch(ch);
+        if (ch == '\n') {
+            refresh();
+        }
+        return;
+    }
+#endif
+    putc_unlocked(ch, console->out);
+    if (ch == '\n') {
+        fflush(console->out);
+    }
+}
+
+// Signal `fd` (an eventfd) whenever input arrives.
+void SetConsoleWakeFd(Console *console, int fd) {
+    __atomic_store_n(&console->wake_fd, fd, __ATOMIC_RELEASE);
+}
+
+// Return the next input byte, or -1 if there's none.
+int ConsoleGetc(Console *console) {
+    return PopInput(&console->input);
+}
+
+// Write a whole buffer with a single system call, after the bytes buffered
+// by ConsolePutc.
+void ConsoleWrite(Console *console, const uint8_t *buf, size_t len) {
+#ifdef RVE_CURSES
+    if (console->backend == ConsoleCurses) {
+        for (size_t i = 0; i < len; i++) {
+            addch(buf[i]);
+        }
+        refresh();
+        return;
+    }
+#endif
+    fflush(console->out);
+    while (len > 0) {
+        ssize_t n = write(fileno(console->out), buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void ConsoleFlush(Console *console) {
+    if (console == NULL) {
+        return;
+    }
+#ifdef RVE_CURSES
+    if (console->backend == ConsoleCurses) {
+        refresh();
+        return;
+    }
+#endif
+    if (console->out != NULL) {
+        fflush(console->out);
+    }
+}
+
+void CloseConsole(Console *console) {
+    if (console == NULL) {
+        return;
+    }
+    StopInputThread(console);
+    ConsoleFlush(console);
+#ifdef RVE_CURSES
+    if (console->backend == ConsoleCurses) {
+        endwin();
+        fflush(console->out);
+    }
+#endif
+    if (console->out != stdout) {
+        fclose(console->out);
+    }
+}
@@ -1,7 +1,7 @@
 #include "rve.h"
 #include <stdint.h>
 #include <stdio.h>
-#include <curses.h>
+#include <unistd.h>
 
 // Set N-bit(s).
 int64_t SetNBits(int32_t n) {
@@ -25,6 +25,8 @@ uint64_t GetRange(uint64_t v, uint64_t start, uint64_t end) {
 
 void HandleTrap(State *state, uint64_t instr_addr) {
     uint8_t prev_mode = state->mode;
+    state->reserved = false;
+    state->waiting = false;
     uint64_t cause = state->exception_code;
     // printf("Trap: addr: 0x%llx, cause: 0x%llx\n", instr_addr, cause);
     uint64_t mdeleg = MEDELEG;
@@ -40,7 +42,7 @@ void HandleTrap(State *state, uint64_t instr_addr) {
         }
         state->pc = (state->csr[STVEC] & ~1) + vector;
         state->csr[SCAUSE] = cause;
-        state->csr[STVAL] = 0;
+        state->csr[STVAL] = state->exception_value;
         WriteCSR(state, SSTATUS, 5, 5, ReadCSR(state, SSTATUS, 1, 1));
         WriteCSR(state, SSTATUS, 1, 1, 0);
         if (prev_mode == USER) {
@@ -57,13 +59,17 @@ void HandleTrap(State *state, uint64_t instr_addr) {
         }
         state->pc = (state->csr[MTVEC] & ~1) + vector;
         state->csr[MCAUSE] = cause;
-        state->csr[MTVAL] = 0;
+        state->csr[MTVAL] = state->exception_value;
         // Save current Mode into CSRs[mstatus].MPP.
         WriteCSR(state, MSTATUS, 11, 12, prev_mode);
     }
+    state->exception_value = 0;
 }
 
 bool HandleInterrupt(State *state, uint64_t instr_addr) {
+    // Machine level interrupts that aren't delegated are always enabled
+    // below M-mode.
+    uint16_t machine = ReadCSR(state, MIP, 0, 15) & ReadCSR(state, MIE, 0, 15) & ~state->csr[MIDELEG];
     uint16_t mint = 0;
     if (state->mode == MACHINE) {
         if (ReadCSR(state, MSTATUS, 3, 3) == 0) {
@@ -72,13 +78,12 @@ bool HandleInterrupt(State *state, uint64_t instr_addr) {
 
         mint = ReadCSR(state, MIP, 0, 15) & ReadCSR(state, MIE, 0, 15);
     } else if (state->mode == SUPERVISOR) {
-        if (ReadCSR(state, SSTATUS, 1, 1) == 0) {
-            return false;
+        mint = machine;
+        if (ReadCSR(state, SSTATUS, 1, 1) == 1) {
+            mint |= ReadCSR(state, SIP, 0, 15) & ReadCSR(state, SIE, 0, 15);
         }
-
-        mint = ReadCSR(state, SIP, 0, 15) & ReadCSR(state, SIE, 0, 15);
     } else if (state->mode == USER) {
-        mint = ReadCSR(state, SIP, 0, 15) & ReadCSR(state, SIE, 0, 15);
+        mint = machine | (ReadCSR(state, SIP, 0, 15) & ReadCSR(state, SIE, 0, 15));
     }
     if (mint == 0) {
         return false;
@@ -111,7 +116,10 @@ bool HandleInterrupt(State *state, uint64_t instr_addr) {
         state->excepted = true;
         state->exception_code = exception_code;
         HandleTrap(state, instr_addr);
-        if (state->mode == MACHINE) {
+        uint64_t code = exception_code & 0xffff;
+        if (code == 3 || code == 7) {
+            // MSIP and MTIP follow the CLINT registers until software clears them there.
+        } else if (state->mode == MACHINE) {
             WriteCSR(state, MIP, exception_code & 0xffff, exception_code & 0xffff, 0);
         } else if (state->mode == SUPERVISOR) {
             WriteCSR(state, SIP, exception_code & 0xffff, exception_code & 0xffff, 0);
@@ -124,78 +132,223 @@ bool HandleInterrupt(State *state, uint64_t instr_addr) {
     return false;
 }
 
+uint8_t UartFifoDepth(Uart *uart) {
+    return (uart->fcr & 0x01) ? UART_FIFO_SIZE : 1;
+}
+
+// The number of received bytes that raises the receive data interrupt.
+uint8_t UartRxTrigger(Uart *uart) {
+    static const uint8_t triggers[4] = {1, 4, 8, 14};
+    return (uart->fcr & 0x01) ? triggers[uart->fcr >> 6 & 3] : 1;
+}
+
 void UartTick(State *state) {
-    if (state->uart->rbr == 0) {
-        int8_t val = getch();
-        if (val != ERR && val != 0) {
-            state->uart->rbr = val;
-            state->uart->lsr |= 0x01;
+    Uart *uart = state->uart;
+    if (state->console == NULL) {
+        return;
+    }
+    // Once the guest drives a virtio-console, its input goes there alone.
+    Virtio *console = state->virtio_slots[VIRTIO_CONSOLE_SLOT];
+    bool virtio_input = console != NULL && (console->status & VIRTIO_STATUS_DRIVER_OK);
+    while (!virtio_input && uart->rx_count < UartFifoDepth(uart)) {
+        int val = ConsoleGetc(state->console);
+        if (val < 0) {
+            break;
         }
+        uart->rx_fifo[(uart->rx_head + uart->rx_count) % UART_FIFO_SIZE] = val;
+        uart->rx_count++;
+        uart->rx_time = state->clock;
+    }
+    if (uart->tx_count != 0) {
+        // Drain the whole FIFO at once; the guest gets a single THRE interrupt for it.
+        for (int i = 0; i < uart->tx_count; i++) {
+            ConsolePutc(state->console, uart->tx_fifo[i]);
+        }
+        uart->tx_count = 0;
+        uart->thre_pending = true;
     }
-    if (state->uart->thr != 0) {
-        addch(state->uart->thr);
-        state->uart->thr = 0;
-        state->uart->lsr |= 0x20;
+    uart->lsr = (uart->lsr & ~0x61) | (uart->rx_count ? 0x01 : 0) | (uart->tx_count ? 0 : 0x60);
+}
+
+// Run the notified queues and the periodic work of every virtio device, and
+// return the pending interrupt lines of the devices.
+uint64_t VirtioTick(State *state) {
+    uint64_t pending = 0;
+    for (int i = 0; i < VIRTIO_SLOTS; i++) {
+        Virtio *virtio = state->virtio_slots[i];
+        if (virtio == NULL) {
+            continue;
+        }
+        if (virtio->queue_notify != VIRTIO_NOTIFY) {
+            // printf("virtio enabled: pc: %llx\n", state->pc);
+            uint32_t queue = virtio->queue_notify;
+            virtio->queue_notify = VIRTIO_NOTIFY;
+            virtio->notify(state, virtio, queue);
+        }
+        if (virtio->poll != NULL) {
+            virtio->poll(state, virtio);
+        }
+        if (IsVirtioInterrupting(virtio)) {
+            pending |= SetOneBit(VIRTIO_IRQ + i);
+        }
     }
+    return pending;
+}
+
+// Called when the branch at `branch_pc` jumps back to `state->pc`.
+//
+// An iteration that stores nothing and reads no MMIO but mtime can only
+// behave differently once time passes or an interrupt arrives:
+//
+// - If it also ends with the same registers as the previous iteration, the
+//   loop spins on unchanging memory, and the clock jumps straight to the next
+//   event.
+// - If it reads mtime, the loop waits for time to pass. The clock is moved
+//   ahead by growing steps, never past the next event, so the loop sees the
+//   time it waits for after a few iterations.
+//
+// Only the instret timebase is affected; with the host timebase time passes
+// on its own.
+void LoopBackEdge(State *state, uint64_t branch_pc) {
+    LoopDetector *loop = &state->loop;
+    bool idle = !loop->dirty && loop->head == state->pc && loop->branch == branch_pc;
+    bool same = idle && !loop->mtime && !memcmp(loop->x, state->x, sizeof(state->x));
+    idle = idle && (loop->mtime || same);
+    uint64_t length = state->clock - loop->start_clock;
+    loop->dirty = false;
+    loop->start_clock = state->clock;
+    if (!idle) {
+        loop->head = state->pc;
+        loop->branch = branch_pc;
+        loop->count = 0;
+        loop->skip = 0;
+        if (!loop->mtime) {
+            memcpy(loop->x, state->x, sizeof(state->x));
+        }
+        loop->mtime = false;
+        return;
+    }
+    loop->mtime = false;
+    if (++loop->count < IDLE_LOOP_THRESHOLD || state->clint->timebase != TimebaseInstret ||
+        IsThreadedSmp(state)) {
+        return;
+    }
+
+    uint64_t next = state->scheduler->next;
+    if (next <= state->clock) {
+        return;
+    }
+    if (same) {
+        if (next != UINT64_MAX) {
+            state->clock = next - 1;
+        }
+        return;
+    }
+    loop->skip = loop->skip ? loop->skip * 2 : length;
+    if (loop->skip > IDLE_SKIP_MAX) {
+        loop->skip = IDLE_SKIP_MAX;
+    }
+    state->clock = next - state->clock > loop->skip ? state->clock + loop->skip : next - 1;
+}
+
+State *HartById(State *state, uint32_t id) {
+    return state->harts != NULL ? state->harts[id] : state;
+}
+
+int NumHarts(State *state) {
+    return state->harts != NULL ? state->nharts : 1;
 }
 
-void ClintTick(State *state) {
-    state->clint->mtime++;
+// Whether the harts run on threads of their own. Hart 0's clock is then the
+// time of harts that are still running, so it must not jump ahead.
+bool IsThreadedSmp(State *state) {
+    return NumHarts(state) > 1 && state->quantum == 0;
+}
 
-    WriteCSR(state, MIP, 3, 3, 0);
-    if ((state->clint->msip & 1) != 0) {
-        WriteCSR(state, MIP, 3, 3, 1);
+void LockDevices(State *state) {
+    if (state->device_lock != NULL) {
+        pthread_mutex_lock(state->device_lock);
     }
+}
 
-    WriteCSR(state, MIP, 7, 7, 0);
-    if (state->clint->mtimecmp > 0 && state->clint->mtime >= state->clint->mtimecmp) {
-        // state->clint->mtime = 0;
-        // WriteCSR(state, MIP, 7, 7, 1);
+void UnlockDevices(State *state) {
+    if (state->device_lock != NULL) {
+        pthread_mutex_unlock(state->device_lock);
     }
 }
 
-void PlicTick(State *state, bool virtio_int, bool uart_int) {
-    uint32_t virtio_irq = VIRTIO_IRQ;
-    uint32_t uart_irq = UART_IRQ;
-    uint32_t virtio_priority = state->plic->priority[virtio_irq];
-    uint32_t uart_priority = state->plic->priority[uart_irq];
-    bool virtio_enable = state->plic->enable_bits >> virtio_irq & 1;
-    bool uart_enable = state->plic->enable_bits >> uart_irq & 1;
+// Wake `hart` up if it is parked in WFI.
+void WakeHart(State *hart) {
+    if (__atomic_load_n(&hart->parked, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        write(hart->wake_fd, &one, sizeof(one));
+    }
+}
 
-    bool ints[2] = {virtio_int, uart_int};
-    uint32_t irqs[2] = {virtio_irq, uart_irq};
-    uint32_t priorities[2] = {virtio_priority, uart_priority};
-    bool enables[2] = {virtio_enable, uart_enable};
+// Drive the device interrupt `bit` of `hart`'s MIP or SIP. Any hart may call
+// this; the target picks the level up in MergeIrq.
+void SetIrq(State *hart, uint16_t csr, int bit, bool level) {
+    uint64_t *irq = csr == MIP ? &hart->irq_mip : &hart->irq_sip;
+    uint64_t mask = SetOneBit(bit);
+    if (((__atomic_load_n(irq, __ATOMIC_RELAXED) & mask) != 0) == level) {
+        return;
+    }
+    if (level) {
+        __atomic_fetch_or(irq, mask, __ATOMIC_SEQ_CST);
+        WakeHart(hart);
+    } else {
+        __atomic_fetch_and(irq, ~mask, __ATOMIC_SEQ_CST);
+    }
+}
 
-    int priority = 0;
-    int irq = 0;
-    for (int i = 0; i < 2; i++) {
-        // if (ints[i])
-        //     printf("irqs[i]: %x, ints[i]: %d, enables[i]: %d, priorities[i]: %d, priority: %d, threshold: %d\n", irqs[i], ints[i], enables[i], priorities[i], priority, state->plic->threshold);
-        if (ints[i] && enables[i] && priorities[i] > priority && priorities[i] > state->plic->threshold) {
-            irq = irqs[i];
-            priority = priorities[i];
+void MergeIrq(State *state) {
+    state->csr[MIP] = (state->csr[MIP] & ~IRQ_MIP_MASK) | __atomic_load_n(&state->irq_mip, __ATOMIC_ACQUIRE);
+    state->csr[SIP] = (state->csr[SIP] & ~IRQ_SIP_MASK) | __atomic_load_n(&state->irq_sip, __ATOMIC_ACQUIRE);
+}
+
+// End the reservations of the other harts on the 8-byte granule of `addr`,
+// which this hart stores to.
+void InvalidateReservations(State *state, uint64_t addr) {
+    for (int i = 0; i < state->nharts; i++) {
+        State *hart = state->harts[i];
+        if (hart != state && __atomic_load_n(&hart->reserved, __ATOMIC_RELAXED) &&
+            ((hart->reserve_addr ^ addr) & ~(uint64_t)7) == 0) {
+            __atomic_store_n(&hart->reserved, false, __ATOMIC_RELAXED);
         }
     }
+}
 
-    if (irq != 0) {
-        // printf("Interrupted: irq: %d, virtio_int: %d\n", irq, virtio_int);
-        state->plic->irq = irq;
-        if (state->mode == MACHINE) {
-            WriteCSR(state, MIP, 9, 9, 1);
-        } else if (state->mode == SUPERVISOR) {
-            WriteCSR(state, SIP, 9, 9, 1);
-        }
+// The instruction count that time and events are measured in: hart 0's.
+uint64_t MachineClock(State *state) {
+    if (state->hart_id == 0) {
+        return state->clock;
     }
+    return __atomic_load_n(&state->harts[0]->clock, __ATOMIC_RELAXED);
 }
 
-void VirtioTick(State *state) {
-    if (state->virtio->queue_notify != 0x1234) {
-        // printf("virtio enabled: pc: %llx\n", state->pc);
-        state->virtio->interrupt_status |= 1;
-        DiskAccess(state);
-        state->virtio->queue_notify = 0x1234;
+// Advance the devices by one tick and route their interrupts through the PLIC.
+// Only hart 0 ticks the devices.
+void TickDevices(State *state) {
+    if (state->hart_id != 0) {
+        return;
+    }
+    LockDevices(state);
+    UartTick(state);
+    uint64_t pending = VirtioTick(state);
+    if (state->clock >= state->scheduler->next) {
+        RunEvents(state);
+    }
+    if (IsUartInterrupting(state)) {
+        pending |= SetOneBit(UART_IRQ);
+    }
+    if (state->shmem != NULL) {
+        ShmemTick(state);
+        if (IsShmemInterrupting(state->shmem)) {
+            pending |= SetOneBit(SHMEM_IRQ);
+        }
     }
+    PlicTick(state, pending);
+    UnlockDevices(state);
 }
 
 void Tick(State *state) {
@@ -204,20 +357,25 @@ void Tick(State *state) {
     uint64_t b_sepc = state->csr[SEPC];
     uint64_t pc = state->pc;
     uint32_t instr = Fetch32(state, state->pc);
-    
-    ExecInstruction(state, instr);
+    // A fetch fault traps before the instruction runs.
+    if (!state->excepted) {
+        ExecInstruction(state, instr);
+    }
     state->x[0] = 0;
+    if (!state->excepted) {
+        state->instret++;
+    }
 
     if (state->excepted) {
         HandleTrap(state, pc);
         state->excepted = false;
         state->exception_code = 0;
+    } else if (state->pc < pc && pc - state->pc <= IDLE_LOOP_SIZE && state->idle_skip) {
+        LoopBackEdge(state, pc);
     }
 
-    UartTick(state);
-    VirtioTick(state);
-    ClintTick(state);
-    PlicTick(state, IsVirtioInterrupting(state), IsUartInterrupting(state));
+    TickDevices(state);
+    MergeIrq(state);
     bool interrupted = HandleInterrupt(state, state->pc);
     if (interrupted && state->excepted) {
         state->excepted = false;
@@ -233,284 +391,715 @@ void Tick(State *state) {
 }
 
 uint64_t WriteRange8(uint64_t dest, uint8_t val, uint64_t start) {
-    uint8_t mask = dest & (SetNBits(8) << (start * 8));
-    dest ^= mask;
-    dest |= val << (start * 8);
+    uint64_t mask = (uint64_t)SetNBits(8) << (start * 8);
+    dest &= ~mask;
+    dest |= (uint64_t)val << (start * 8);
     return dest;
 }
 
 uint8_t ReadRange8(uint64_t src, uint64_t start) {
-    return (src & (SetNBits(8) << (start * 8))) >> (start * 8);
+    return (src & ((uint64_t)SetNBits(8) << (start * 8))) >> (start * 8);
 }
 
 void UartWrite(State *state, uint64_t offset, uint8_t val) {
-    // if (offset == 0) {
-    //     state->uart->uart_mem[offset] = ch;
-    //     if (state->uart->uart_mem[3] & SetOneBit(7)) {
-    //         return;
-    //     }
-    //     putc(ch, stdout);
-    //     fflush(stdout);
-    // } else {
-    //     state->uart->uart_mem[offset] = ch;
-    // }
-
-    uint8_t dlab = state->uart->lcr >> 7 & 1;
+    Uart *uart = state->uart;
+    uint8_t dlab = uart->lcr >> 7 & 1;
     if (offset == UART_THR && dlab == 0) {
-        state->uart->thr = val;
-        // Set THRE to 0.
-        // THRE indicate that whether the thr register is zero.
-        state->uart->lsr &= ~0x20;
+        if (uart->tx_count < UartFifoDepth(uart)) {
+            uart->tx_fifo[uart->tx_count++] = val;
+        }
+        uart->thre_pending = false;
+        // THRE and TEMT indicate that the transmitter is empty.
+        uart->lsr &= ~0x60;
     } else if (offset == UART_IER && dlab == 0) {
-        state->uart->ier = val;
+        // Enabling the THRE interrupt while the transmitter is empty raises it.
+        if ((val & 0x2) != 0 && (uart->ier & 0x2) == 0 && uart->tx_count == 0) {
+            uart->thre_pending = true;
+        }
+        uart->ier = val;
+    } else if (offset == UART_FCR) {
+        if ((val & 0x01) != (uart->fcr & 0x01) || (val & 0x02) != 0) {
+            uart->rx_head = 0;
+            uart->rx_count = 0;
+        }
+        if ((val & 0x01) != (uart->fcr & 0x01) || (val & 0x04) != 0) {
+            uart->tx_count = 0;
+        }
+        uart->fcr = val & 0xc1;
     } else if (offset == UART_LCR) {
-        state->uart->lcr = val;
+        uart->lcr = val;
     } else if (offset == UART_MCR) {
-        state->uart->mcr = val;
+        uart->mcr = val;
     } else if (offset == UART_SCR) {
-        state->uart->scr = val;
+        uart->scr = val;
     }
 }
 
 uint8_t UartRead(State *state, uint64_t offset) {
-    // if (offset == 0) {
-    //     if (state->uart->uart_mem[3] & SetOneBit(7)) {
-    //         return state->uart->uart_mem[offset];
-    //     }
-    //     uint8_t ch = getc(stdin);
-    //     state->uart->uart_mem[offset] = ch;
-    //     return ch;
-    // } else {
-    //     return state->uart->uart_mem[offset];
-    // }
-
-    uint8_t dlab = state->uart->lcr >> 7 & 1;
+    Uart *uart = state->uart;
+    uint8_t dlab = uart->lcr >> 7 & 1;
     if (offset == UART_RBR && dlab == 0) {
-        uint8_t rbr = state->uart->rbr;
-        state->uart->rbr = 0;
-        state->uart->lsr &= ~0x01;
+        if (uart->rx_count == 0) {
+            return 0;
+        }
+        uint8_t rbr = uart->rx_fifo[uart->rx_head];
+        uart->rx_head = (uart->rx_head + 1) % UART_FIFO_SIZE;
+        uart->rx_count--;
+        uart->rx_time = state->clock;
+        if (uart->rx_count == 0) {
+            uart->lsr &= ~0x01;
+        }
         return rbr;
     } else if (offset == UART_IER && dlab == 0) {
-        return state->uart->ier;
+        return uart->ier;
     } else if (offset == UART_IIR) {
-        return state->uart->iir;
+        IsUartInterrupting(state);
+        if ((uart->iir & 0x0f) == 0x02) {
+            uart->thre_pending = false;
+        }
+        // Bits 6 and 7 report that the FIFOs are enabled.
+        return uart->iir | ((uart->fcr & 0x01) ? 0xc0 : 0);
     } else if (offset == UART_LCR) {
-        return state->uart->lcr;
+        return uart->lcr;
     } else if (offset == UART_MCR) {
-        return state->uart->mcr;
+        return uart->mcr;
     } else if (offset == UART_LSR) {
-        return state->uart->lsr;
+        return uart->lsr;
     } else if (offset == UART_MSR) {
-        return state->uart->msr;
+        return uart->msr;
     } else if (offset == UART_SCR) {
-        return state->uart->scr;
+        return uart->scr;
     } else {
         return 0;
     }
 }
 
+// The current mtime.
+uint64_t ClintTime(State *state) {
+    Clint *clint = state->clint;
+    if (clint->timebase == TimebaseHost) {
+        uint64_t ns = HostNanos() - clint->host_start;
+        return clint->mtime_offset + ns / 1000000000 * clint->freq + ns % 1000000000 * clint->freq / 1000000000;
+    }
+    return clint->mtime_offset + MachineClock(state) / clint->divisor;
+}
+
+// Drive the MTIP of `hart` from mtime >= its mtimecmp and schedule the event
+// that raises it at the deadline.
+void UpdateTimer(State *state, uint32_t hart) {
+    Clint *clint = state->clint;
+    uint64_t mtime = ClintTime(state);
+    int kind = EventTimer + hart;
+    if (mtime >= clint->mtimecmp[hart]) {
+        SetIrq(HartById(state, hart), MIP, 7, true);
+        CancelEvent(state->scheduler, kind);
+        return;
+    }
+    SetIrq(HartById(state, hart), MIP, 7, false);
+    if (clint->timebase == TimebaseHost) {
+        // The host clock doesn't advance with ticks; check it periodically.
+        ScheduleEvent(state->scheduler, kind, MachineClock(state) + CLINT_HOST_POLL);
+        return;
+    }
+    uint64_t ticks = clint->mtimecmp[hart] - clint->mtime_offset;
+    if (ticks > UINT64_MAX / clint->divisor) {
+        // Too far away to ever happen.
+        CancelEvent(state->scheduler, kind);
+        return;
+    }
+    ScheduleEvent(state->scheduler, kind, ticks * clint->divisor);
+}
+
+// The earliest mtimecmp of all harts.
+uint64_t ClintDeadline(State *state) {
+    uint64_t deadline = UINT64_MAX;
+    for (int i = 0; i < NumHarts(state); i++) {
+        if (state->clint->mtimecmp[i] < deadline) {
+            deadline = state->clint->mtimecmp[i];
+        }
+    }
+    return deadline;
+}
+
+void UpdateTimers(State *state) {
+    for (int i = 0; i < NumHarts(state); i++) {
+        UpdateTimer(state, i);
+    }
+}
+
+// The handler of the timer events.
+void TimerEvent(State *state, int kind) {
+    UpdateTimer(state, kind - EventTimer);
+}
+
+// spec: instret[:N] (mtime advances every N instructions, default 1) or
+// host[:HZ] (the host monotonic clock at HZ, default 10 MHz).
+void SetTimebase(Clint *clint, const char *spec) {
+    const char *arg = strchr(spec, ':');
+    uint64_t val = arg != NULL ? strtoull(arg + 1, NULL, 0) : 0;
+    if (!strncmp(spec, "instret", 7) && (spec[7] == '\0' || spec[7] == ':')) {
+        clint->timebase = TimebaseInstret;
+        clint->divisor = arg != NULL ? val : 1;
+    } else if (!strncmp(spec, "host", 4) && (spec[4] == '\0' || spec[4] == ':')) {
+        clint->timebase = TimebaseHost;
+        clint->freq = arg != NULL ? val : 10000000;
+        clint->host_start = HostNanos();
+    } else {
+        Error("Unknown timer: %s", spec);
+    }
+    if (clint->divisor == 0 || clint->freq == 0) {
+        Error("Invalid timer rate: %s", spec);
+    }
+}
+
 void ClintWrite(State *state, uint64_t offset, uint8_t val) {
+    Clint *clint = state->clint;
     if (offset >= CLINT_MSIP_BASE && offset < CLINT_MSIP_BASE + CLINT_MSIP_SIZE) {
-        state->clint->msip = WriteRange8(state->clint->msip, val, offset - CLINT_MSIP_BASE);
+        uint32_t hart = (offset - CLINT_MSIP_BASE) / 4;
+        if (hart >= NumHarts(state)) {
+            return;
+        }
+        clint->msip[hart] = WriteRange8(clint->msip[hart], val, (offset - CLINT_MSIP_BASE) % 4);
+        // An IPI: raising MSIP wakes the target up right away if it is parked.
+        SetIrq(HartById(state, hart), MIP, 3, clint->msip[hart] & 1);
     } else if (offset >= CLINT_MTIMECMP_BASE && offset < CLINT_MTIMECMP_BASE + CLINT_MTIMECMP_SIZE) {
-        state->clint->mtimecmp = WriteRange8(state->clint->mtimecmp, val, offset - CLINT_MTIMECMP_BASE);
+        uint32_t hart = (offset - CLINT_MTIMECMP_BASE) / 8;
+        if (hart >= NumHarts(state)) {
+            return;
+        }
+        clint->mtimecmp[hart] = WriteRange8(clint->mtimecmp[hart], val, (offset - CLINT_MTIMECMP_BASE) % 8);
+        UpdateTimer(state, hart);
+        // Hart 0 may sleep toward the old deadline.
+        WakeHart(HartById(state, 0));
     } else if (offset >= CLINT_MTIME_BASE && offset < CLINT_MTIME_BASE + CLINT_MTIME_SIZE) {
-        state->clint->mtime = WriteRange8(state->clint->mtime, val, offset - CLINT_MTIME_BASE);
+        uint64_t mtime = ClintTime(state);
+        clint->mtime_offset += WriteRange8(mtime, val, offset - CLINT_MTIME_BASE) - mtime;
+        UpdateTimers(state);
     } else {
         // Do nothing.
     }
 }
 
 uint8_t ClintRead(State *state, uint64_t offset) {
+    Clint *clint = state->clint;
     if (offset >= CLINT_MSIP_BASE && offset < CLINT_MSIP_BASE + CLINT_MSIP_SIZE) {
-        return ReadRange8(state->clint->msip, offset - CLINT_MSIP_BASE);
+        return ReadRange8(clint->msip[(offset - CLINT_MSIP_BASE) / 4], (offset - CLINT_MSIP_BASE) % 4);
     } else if (offset >= CLINT_MTIMECMP_BASE && offset < CLINT_MTIMECMP_BASE + CLINT_MTIMECMP_SIZE) {
-        return ReadRange8(state->clint->mtimecmp, offset - CLINT_MTIMECMP_BASE);
+        return ReadRange8(clint->mtimecmp[(offset - CLINT_MTIMECMP_BASE) / 8], (offset - CLINT_MTIMECMP_BASE) % 8);
     } else if (offset >= CLINT_MTIME_BASE && offset < CLINT_MTIME_BASE + CLINT_MTIME_SIZE) {
-        return ReadRange8(state->clint->mtime, offset - CLINT_MTIME_BASE);
+        // LoadByte latched mtime at the first byte of the load.
+        return ReadRange8(clint->mtime_latch, offset - CLINT_MTIME_BASE);
     } else {
         return 0;
     }
 }
 
-void PlicWrite(State *state, uint64_t offset, uint8_t val) {
-    if (offset >= PLIC_PRIORITY_BASE && offset < PLIC_PRIORITY_BASE + PLIC_PRIORITY_SIZE) {
-        state->plic->priority[(offset - PLIC_PRIORITY_BASE + 4) / 4] = WriteRange8(state->plic->priority[(offset - PLIC_PRIORITY_BASE + 4) / 4], val, (offset - PLIC_PRIORITY_BASE + 4) % 4);
-    } else if (offset >= PLIC_ENABLE_BASE && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_SIZE) {
-        state->plic->enable_bits = WriteRange8(state->plic->enable_bits, val, offset - PLIC_ENABLE_BASE);
-    } else if (offset >= PLIC_THRESHOLD_BASE && offset < PLIC_THRESHOLD_BASE + PLIC_THRESHOLD_SIZE) {
-        state->plic->threshold = WriteRange8(state->plic->threshold, val, offset - PLIC_THRESHOLD_BASE);
-    } else if (offset >= PLIC_IRQ_BASE && offset < PLIC_IRQ_BASE + PLIC_IRQ_SIZE) {
-        state->plic->irq = WriteRange8(state->plic->irq, val, offset - PLIC_IRQ_BASE);
+// Update IIR with the highest priority pending interrupt.
+bool IsUartInterrupting(State *state) {
+    Uart *uart = state->uart;
+    if ((uart->ier & 0x1) != 0 && uart->rx_count != 0) {
+        if (uart->rx_count >= UartRxTrigger(uart)) {
+            uart->iir = 0x04;
+            return true;
+        }
+        // Character timeout: data sits below the trigger level with no activity.
+        if (state->clock - uart->rx_time >= UART_RX_TIMEOUT) {
+            uart->iir = 0x0c;
+            return true;
+        }
     }
+
+    if ((uart->ier & 0x2) != 0 && uart->thre_pending) {
+        uart->iir = 0x02;
+        return true;
+    }
+
+    uart->iir = 0x01;
+    return false;
 }
 
-uint8_t PlicRead(State *state, uint64_t offset) {
-    if (offset >= PLIC_PRIORITY_BASE && offset < PLIC_PRIORITY_BASE + PLIC_PRIORITY_SIZE) {
-        return ReadRange8(state->plic->priority[(offset - PLIC_PRIORITY_BASE) / 4], (offset - PLIC_PRIORITY_BASE) % 4);
-    } else if (offset >= PLIC_ENABLE_BASE && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_SIZE) {
-        return ReadRange8(state->plic->enable_bits, offset - PLIC_ENABLE_BASE);
-    } else if (offset >= PLIC_THRESHOLD_BASE && offset < PLIC_THRESHOLD_BASE + PLIC_THRESHOLD_SIZE) {
-        return ReadRange8(state->plic->threshold, offset - PLIC_THRESHOLD_BASE);
-    } else if (offset >= PLIC_IRQ_BASE && offset < PLIC_IRQ_BASE + PLIC_IRQ_SIZE) {
-        return ReadRange8(state->plic->irq, offset - PLIC_IRQ_BASE);
+bool IsVirtioInterrupting(Virtio *virtio) {
+    if ((virtio->interrupt_status & 1) == 1) {
+        return true;
+    }
+    return false;
+}
+
+// Return a host pointer to `len` bytes of RAM at the physical address `addr`,
+// or NULL if the range isn't backed by RAM.
+uint8_t *GuestRam(State *state, uint64_t addr, uint64_t len) {
+    Shmem *shmem = state->shmem;
+    if (shmem != NULL && addr >= SHMEM_BASE && addr - SHMEM_BASE < shmem->size) {
+        return len <= shmem->size - (addr - SHMEM_BASE) ? shmem->mem + (addr - SHMEM_BASE) : NULL;
+    }
+    if (addr < DRAM_BASE || addr - DRAM_BASE > state->mem_size ||
+        len > state->mem_size - (addr - DRAM_BASE)) {
+        return NULL;
+    }
+    return state->mem + (addr - DRAM_BASE);
+}
+
+// Account for a device having written `len` bytes of RAM at `addr` through a
+// GuestRam pointer, as a store by the CPU would: drop cached code there and
+// log the store for the lockstep checker.
+void DeviceWroteRam(State *state, uint64_t addr, uint64_t len) {
+    InvalidateCode(state, addr, len);
+    if (state->store_log != NULL) {
+        LogStore(state, addr, len);
+    }
+}
+
+// Compute the guest physical addresses of the descriptor table, the available
+// (driver) ring and the used (device) ring of `vq`.
+void VirtqueueAddrs(Virtio *virtio, VirtQueue *vq, uint64_t *desc,
+                    uint64_t *avail, uint64_t *used) {
+    if (virtio->version == 1) {
+        uint64_t align = vq->align ? vq->align : PAGESIZE;
+        *desc = (uint64_t)vq->pfn * (uint64_t)virtio->guest_page_size;
+        *avail = *desc + (uint64_t)vq->num * VRING_DESC_SIZE;
+        *used = (*avail + 6 + 2 * (uint64_t)vq->num + align - 1) & ~(align - 1);
     } else {
-        return 0;
+        *desc = vq->desc_addr;
+        *avail = vq->driver_addr;
+        *used = vq->device_addr;
     }
 }
 
-bool IsUartInterrupting(State *state) {
-    if ((state->uart->ier & 0x1) != 0) {
-        if (state->uart->rbr != 0) {
-            state->uart->iir = 0x04;
-            return true;
+bool IsRingPacked(Virtio *virtio) {
+    return virtio->guest_features >> VIRTIO_F_RING_PACKED & 1;
+}
+
+// Stop the device after a driver error it can't report in a request. The
+// driver sees DEVICE_NEEDS_RESET with a configuration change interrupt.
+void FailVirtio(Virtio *virtio) {
+    virtio->status |= VIRTIO_STATUS_DEVICE_NEEDS_RESET;
+    virtio->interrupt_status |= 2;
+}
+
+bool PopSplit(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain) {
+    uint64_t desc_addr, avail_addr, used_addr;
+    VirtqueueAddrs(virtio, vq, &desc_addr, &avail_addr, &used_addr);
+
+    uint16_t avail_idx = MemRead16(state, avail_addr + 2);
+    if (avail_idx == vq->last_avail_idx) {
+        return false;
+    }
+
+    uint16_t index = MemRead16(state, avail_addr + 4 + 2 * (vq->last_avail_idx % vq->num));
+    vq->last_avail_idx++;
+    chain->id = index;
+    chain->num = 0;
+    for (;;) {
+        if (chain->num == VIRTQ_CHAIN_MAX) {
+            FailVirtio(virtio);
+            return false;
         }
+        uint64_t addr = desc_addr + VRING_DESC_SIZE * (index % vq->num);
+        VirtqDesc *desc = &chain->desc[chain->num++];
+        desc->addr = MemRead64(state, addr);
+        desc->len = MemRead32(state, addr + 8);
+        desc->flags = MemRead16(state, addr + 12);
+        if ((desc->flags & VRING_DESC_F_NEXT) == 0) {
+            break;
+        }
+        index = MemRead16(state, addr + 14);
     }
+    return true;
+}
 
-    if ((state->uart->ier & 0x2) != 0) {
-        if (state->uart->thr == 0) {
-            state->uart->iir = 0x02;
-            return true;
+bool PopPacked(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain) {
+    uint64_t addr = vq->desc_addr + VRING_DESC_SIZE * vq->last_avail_idx;
+    uint16_t flags = MemRead16(state, addr + 14);
+    bool avail = flags >> VRING_PACKED_DESC_F_AVAIL & 1;
+    bool used = flags >> VRING_PACKED_DESC_F_USED & 1;
+    if (avail != vq->avail_wrap || used == vq->avail_wrap) {
+        return false;
+    }
+
+    chain->num = 0;
+    for (;;) {
+        if (chain->num == VIRTQ_CHAIN_MAX) {
+            FailVirtio(virtio);
+            return false;
+        }
+        addr = vq->desc_addr + VRING_DESC_SIZE * vq->last_avail_idx;
+        VirtqDesc *desc = &chain->desc[chain->num++];
+        desc->addr = MemRead64(state, addr);
+        desc->len = MemRead32(state, addr + 8);
+        desc->flags = MemRead16(state, addr + 14);
+        // The buffer id is taken from the last descriptor of the chain.
+        chain->id = MemRead16(state, addr + 12);
+        if (++vq->last_avail_idx >= vq->num) {
+            vq->last_avail_idx = 0;
+            vq->avail_wrap = !vq->avail_wrap;
+        }
+        if ((desc->flags & VRING_DESC_F_NEXT) == 0) {
+            break;
         }
     }
+    return true;
+}
 
-    state->uart->iir = 0xf;
-    return false;
+// Whether the driver has set up `vq`: a legacy queue has a page frame and a
+// modern one is marked ready.
+bool IsQueueReady(Virtio *virtio, VirtQueue *vq) {
+    if (vq->num == 0 || virtio->status & VIRTIO_STATUS_DEVICE_NEEDS_RESET) {
+        return false;
+    }
+    return virtio->version == 1 ? vq->pfn != 0 : vq->ready != 0;
 }
 
-bool IsVirtioInterrupting(State *state) {
-    if ((state->virtio->interrupt_status & 1) == 1) {
-        return true;
+// Take the next descriptor chain made available by the driver.
+// Return false if the ring is empty or not ready.
+bool VirtqueuePop(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain) {
+    if (!IsQueueReady(virtio, vq)) {
+        return false;
     }
-    return false;
+    if (IsRingPacked(virtio)) {
+        return PopPacked(state, virtio, vq, chain);
+    }
+    return PopSplit(state, virtio, vq, chain);
+}
+
+// Return `chain` to the driver with `len` bytes written into its buffers and
+// raise the used buffer interrupt.
+void VirtqueuePush(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain, uint32_t len) {
+    virtio->interrupt_status |= 1;
+    if (IsRingPacked(virtio)) {
+        uint64_t addr = vq->desc_addr + VRING_DESC_SIZE * vq->used_idx;
+        uint16_t flags = vq->used_wrap << VRING_PACKED_DESC_F_AVAIL |
+                         vq->used_wrap << VRING_PACKED_DESC_F_USED;
+        MemWrite16(state, addr + 12, chain->id);
+        MemWrite32(state, addr + 8, len);
+        // Flags must be written last since they hand the slot over to the driver.
+        MemWrite16(state, addr + 14, flags);
+        vq->used_idx += chain->num;
+        if (vq->used_idx >= vq->num) {
+            vq->used_idx -= vq->num;
+            vq->used_wrap = !vq->used_wrap;
+        }
+        return;
+    }
+
+    uint64_t desc_addr, avail_addr, used_addr;
+    VirtqueueAddrs(virtio, vq, &desc_addr, &avail_addr, &used_addr);
+    uint64_t elem_addr = used_addr + 4 + 8 * (vq->used_idx % vq->num);
+    MemWrite32(state, elem_addr, chain->id);
+    MemWrite32(state, elem_addr + 4, len);
+    vq->used_idx++;
+    MemWrite16(state, used_addr + 2, vq->used_idx);
+}
+
+// Copy `len` bytes at `offset` of the buffers of `chain` into `buf`, with the
+// device-readable descriptors only if `writable` is false and the writable
+// ones otherwise. Return the number of bytes copied.
+uint64_t CopyChain(State *state, VirtqChain *chain, bool writable, uint64_t offset,
+                   uint8_t *buf, uint64_t len, bool to_guest) {
+    uint64_t done = 0;
+    for (int i = 0; i < chain->num && done < len; i++) {
+        VirtqDesc *desc = &chain->desc[i];
+        if (((desc->flags & VRING_DESC_F_WRITE) != 0) != writable) {
+            continue;
+        }
+        if (offset >= desc->len) {
+            offset -= desc->len;
+            continue;
+        }
+        uint64_t n = desc->len - offset < len - done ? desc->len - offset : len - done;
+        uint8_t *ram = GuestRam(state, desc->addr + offset, n);
+        if (ram != NULL && to_guest) {
+            memcpy(ram, buf + done, n);
+            DeviceWroteRam(state, desc->addr + offset, n);
+        } else if (ram != NULL) {
+            memcpy(buf + done, ram, n);
+        } else {
+            for (uint64_t j = 0; j < n; j++) {
+                if (to_guest) {
+                    MemWrite8(state, desc->addr + offset + j, buf[done + j]);
+                } else {
+                    buf[done + j] = MemRead8(state, desc->addr + offset + j);
+                }
+            }
+        }
+        done += n;
+        offset = 0;
+    }
+    return done;
 }
 
-uint64_t GetNewId(State *state) {
-    state->virtio->id += 1;
-    return state->virtio->id;
+// Read from the device-readable buffers of `chain`.
+uint64_t ReadChain(State *state, VirtqChain *chain, uint64_t offset, void *buf, uint64_t len) {
+    return CopyChain(state, chain, false, offset, buf, len, false);
 }
 
-uint64_t DescAddr(State *state) {
-    return (uint64_t)state->virtio->queue_pfn * (uint64_t)state->virtio->guest_page_size;
+// Write into the device-writable buffers of `chain`.
+uint64_t WriteChain(State *state, VirtqChain *chain, uint64_t offset, const void *buf, uint64_t len) {
+    return CopyChain(state, chain, true, offset, (uint8_t *)buf, len, true);
 }
 
-uint8_t ReadDisk(State *state, uint64_t addr) {
-    return state->virtio->disk[addr];
+// Fill `iov` with host pointers to the RAM of the buffers of `chain` from
+// `offset`, skipping descriptors of the other direction. Return the number
+// of entries; the walk stops at the first buffer outside of RAM.
+int ChainIovec(State *state, VirtqChain *chain, bool writable, uint64_t offset,
+               struct iovec *iov, int iov_max) {
+    int n = 0;
+    for (int i = 0; i < chain->num && n < iov_max; i++) {
+        VirtqDesc *desc = &chain->desc[i];
+        if (((desc->flags & VRING_DESC_F_WRITE) != 0) != writable) {
+            continue;
+        }
+        if (offset >= desc->len) {
+            offset -= desc->len;
+            continue;
+        }
+        uint8_t *ram = GuestRam(state, desc->addr + offset, desc->len - offset);
+        if (ram == NULL) {
+            break;
+        }
+        if (writable) {
+            DeviceWroteRam(state, desc->addr + offset, desc->len - offset);
+        }
+        iov[n].iov_base = ram;
+        iov[n].iov_len = desc->len - offset;
+        n++;
+        offset = 0;
+    }
+    return n;
 }
 
-void WriteDisk(State *state, uint64_t addr, uint8_t value) {
-    state->virtio->disk[addr] = value;
+void ResetVirtqueue(VirtQueue *vq) {
+    memset(vq, 0, sizeof(VirtQueue));
+    vq->align = PAGESIZE;
+    vq->avail_wrap = true;
+    vq->used_wrap = true;
 }
 
-void DiskAccess(State *state) {
-    // printf("Disk Access\n");
-    uint64_t desc_addr = DescAddr(state);
-    // printf("rve: desc: %lld\n", (int64_t)desc_addr);
-    uint64_t avail_addr = DescAddr(state) + 8 * 16;
-    // printf("rve: avail: %lld\n", (int64_t)avail_addr);
-    uint64_t used_addr = DescAddr(state) + 4096;
-    // printf("rve: used: %lld\n", (int64_t)used_addr);
-
-    uint32_t queue_size = state->virtio->queue_num;
-    uint16_t offset = Read16(state, avail_addr);
-    uint16_t index = Read16(state, avail_addr + 2);
-    uint64_t index_addr = avail_addr + 4 + (uint64_t)state->virtio->id * 2 /*desc_addr + VRING_DESC_SIZE * index*/;
-    uint64_t head_index = Read16(state, index_addr) % queue_size;
-    uint64_t desc_addr0 = desc_addr + VRING_DESC_SIZE * head_index;
-    uint64_t addr0 = Read64(state, desc_addr0);
-    uint16_t next0 = Read16(state, desc_addr0 + 14);
-    uint64_t desc_addr1 = desc_addr + VRING_DESC_SIZE * next0;
-    uint64_t addr1 = Read64(state, desc_addr1);
-    uint32_t len1 = Read32(state, desc_addr1 + 8);
-    uint16_t flags1 = Read16(state, desc_addr1 + 12);
-    uint16_t next1 = Read64(state, desc_addr1 + 14);
-    uint64_t desc_addr2 = desc_addr + VRING_DESC_SIZE * next1;
-    uint64_t addr2 = Read64(state, desc_addr2);
-    uint32_t len2 = Read32(state, desc_addr2 + 8);
-    uint16_t flags2 = Read16(state, desc_addr2 + 12);
-
-    uint64_t blk_sector = Read64(state, addr0 + 8);
-
-    if ((flags1 & 2) == 0) {
-        for (uint64_t i = 0; i < len1; i++) {
-            uint8_t data = Read8(state, addr1 + i);
-            WriteDisk(state, blk_sector * 512 + i, data);
+void ResetVirtio(Virtio *virtio) {
+    virtio->guest_features = 0;
+    virtio->host_features_sel = 0;
+    virtio->guest_features_sel = 0;
+    virtio->queue_sel = 0;
+    virtio->queue_notify = VIRTIO_NOTIFY;
+    virtio->interrupt_status = 0;
+    virtio->interrupt_ack = 0;
+    virtio->status = 0;
+    for (int i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        ResetVirtqueue(&virtio->queue[i]);
+    }
+}
+
+// Select the legacy (1) or the modern (2) virtio-mmio register layout.
+void SetVirtioVersion(Virtio *virtio, uint32_t version) {
+    virtio->version = version;
+    virtio->host_features &= ~(SetOneBit(VIRTIO_F_VERSION_1) | SetOneBit(VIRTIO_F_RING_PACKED));
+    if (version != 1) {
+        virtio->host_features |= SetOneBit(VIRTIO_F_VERSION_1) | SetOneBit(VIRTIO_F_RING_PACKED);
+    }
+}
+
+uint64_t DescAddr(State *state) {
+    uint64_t desc_addr, avail_addr, used_addr;
+    VirtqueueAddrs(state->virtio, &state->virtio->queue[0], &desc_addr, &avail_addr, &used_addr);
+    return desc_addr;
+}
+
+// Copy the buffer of `desc` from or into the disk at `disk_addr`.
+void DiskTransfer(State *state, VirtqDesc *desc, uint64_t disk_addr, bool is_read) {
+    uint8_t *buf = GuestRam(state, desc->addr, desc->len);
+    if (buf != NULL) {
+        if (is_read) {
+            DiskRead(state->virtio->disk, disk_addr, buf, desc->len);
+            DeviceWroteRam(state, desc->addr, desc->len);
+        } else {
+            DiskWrite(state->virtio->disk, disk_addr, buf, desc->len);
         }
-    } else {
-        for (uint64_t i = 0; i < len1; i++) {
-            uint8_t data = ReadDisk(state, blk_sector * 512 + i);
-            Write8(state, addr1 + i, data);
-            // printf("DiskRead disk_addr: %llx, addr: %llx, %c\n", blk_sector * 512 + i, addr1 + i, data);
+        return;
+    }
+
+    // Not in RAM: go through a bounce buffer, so that the disk still sees
+    // whole blocks rather than a call per byte.
+    uint8_t bounce[PAGESIZE];
+    for (uint64_t done = 0; done < desc->len; done += PAGESIZE) {
+        uint64_t n = desc->len - done < PAGESIZE ? desc->len - done : PAGESIZE;
+        if (is_read) {
+            DiskRead(state->virtio->disk, disk_addr + done, bounce, n);
+            for (uint64_t i = 0; i < n; i++) {
+                MemWrite8(state, desc->addr + done + i, bounce[i]);
+            }
+        } else {
+            for (uint64_t i = 0; i < n; i++) {
+                bounce[i] = MemRead8(state, desc->addr + done + i);
+            }
+            DiskWrite(state->virtio->disk, disk_addr + done, bounce, n);
         }
     }
+}
 
-    if (flags2 & 2) {
-        Write8(state, addr2, 0);
-    } else {
-        Error("Third descriptor must be write mode");
+// Serve all the requests on the block device queue.
+// A request is a chain of a header, data buffers and a status byte.
+void DiskAccess(State *state) {
+    VirtQueue *vq = &state->virtio->queue[0];
+    VirtqChain chain;
+    Disk *disk = state->virtio->disk;
+    while (VirtqueuePop(state, state->virtio, vq, &chain)) {
+        VirtqDesc *status_desc = &chain.desc[chain.num - 1];
+        if ((status_desc->flags & VRING_DESC_F_WRITE) == 0 || status_desc->len == 0) {
+            // There is no status byte to report the error in.
+            FailVirtio(state->virtio);
+            return;
+        }
+        uint32_t type = MemRead32(state, chain.desc[0].addr);
+        uint64_t sector = MemRead64(state, chain.desc[0].addr + 8);
+        uint64_t disk_addr = 0;
+        uint8_t status = VIRTIO_BLK_S_OK;
+        uint32_t written = 0;
+
+        if (chain.num < 2 || chain.desc[0].len < 16) {
+            status = VIRTIO_BLK_S_IOERR;
+        } else if (type == VIRTIO_BLK_T_FLUSH) {
+            DiskFlush(disk);
+        } else if (type != VIRTIO_BLK_T_IN && type != VIRTIO_BLK_T_OUT) {
+            status = VIRTIO_BLK_S_UNSUPP;
+        } else if (disk == NULL || sector > disk->size / SECTOR_SIZE) {
+            status = VIRTIO_BLK_S_IOERR;
+        } else {
+            disk_addr = sector * SECTOR_SIZE;
+        }
+        for (int i = 1; i < chain.num - 1 && type != VIRTIO_BLK_T_FLUSH; i++) {
+            VirtqDesc *desc = &chain.desc[i];
+            if (status != VIRTIO_BLK_S_OK) {
+                break;
+            }
+            if (desc->len > disk->size - disk_addr) {
+                status = VIRTIO_BLK_S_IOERR;
+                break;
+            }
+            DiskTransfer(state, desc, disk_addr, type == VIRTIO_BLK_T_IN);
+            disk_addr += desc->len;
+            if (type == VIRTIO_BLK_T_IN) {
+                written += desc->len;
+            }
+        }
+
+        MemWrite8(state, status_desc->addr, status);
+        VirtqueuePush(state, state->virtio, vq, &chain, written + 1);
     }
+}
 
-    uint64_t new_id = GetNewId(state) % queue_size;
-    Write16(state, used_addr + 2, new_id % 8);
+void BlockNotify(State *state, Virtio *virtio, uint32_t queue) {
+    DiskAccess(state);
 }
 
-void VirtioWrite(State *state, uint64_t offset, uint8_t val) {
-    if (offset >= VIRTIO_GUEST_FEATURES_BASE && offset < VIRTIO_GUEST_FEATURES_BASE + 4) {
-        state->virtio->guest_features = WriteRange8(state->virtio->guest_features, val, offset - VIRTIO_GUEST_FEATURES_BASE);
+void VirtioWrite(State *state, Virtio *virtio, uint64_t offset, uint8_t val) {
+    // A queue_sel past the last queue selects a queue that doesn't exist: the
+    // writes to its registers go to a scratch copy and are dropped.
+    VirtQueue absent = {0};
+    VirtQueue *vq = virtio->queue_sel < VIRTIO_QUEUE_MAX ? &virtio->queue[virtio->queue_sel] : &absent;
+    if (offset >= VIRTIO_HOST_FEATURES_SEL_BASE && offset < VIRTIO_HOST_FEATURES_SEL_BASE + 4) {
+        virtio->host_features_sel = WriteRange8(virtio->host_features_sel, val, offset - VIRTIO_HOST_FEATURES_SEL_BASE);
+        return;
+    } else if (offset >= VIRTIO_GUEST_FEATURES_BASE && offset < VIRTIO_GUEST_FEATURES_BASE + 4) {
+        // Only the two words of the 64 feature bits can be selected.
+        if (virtio->guest_features_sel <= 1) {
+            uint64_t start = offset - VIRTIO_GUEST_FEATURES_BASE + 4 * virtio->guest_features_sel;
+            virtio->guest_features = WriteRange8(virtio->guest_features, val, start);
+        }
+        return;
+    } else if (offset >= VIRTIO_GUEST_FEATURES_SEL_BASE && offset < VIRTIO_GUEST_FEATURES_SEL_BASE + 4) {
+        virtio->guest_features_sel = WriteRange8(virtio->guest_features_sel, val, offset - VIRTIO_GUEST_FEATURES_SEL_BASE);
         return;
     } else if (offset >= VIRTIO_GUEST_PAGE_SIZE_BASE && offset < VIRTIO_GUEST_PAGE_SIZE_BASE + 4) {
-        state->virtio->guest_page_size = WriteRange8(state->virtio->guest_page_size, val, offset - VIRTIO_GUEST_PAGE_SIZE_BASE);
+        virtio->guest_page_size = WriteRange8(virtio->guest_page_size, val, offset - VIRTIO_GUEST_PAGE_SIZE_BASE);
+        return;
+    } else if (offset >= VIRTIO_QUEUE_SEL_BASE && offset < VIRTIO_QUEUE_SEL_BASE + 4) {
+        virtio->queue_sel = WriteRange8(virtio->queue_sel, val, offset - VIRTIO_QUEUE_SEL_BASE);
         return;
     } else if (offset >= VIRTIO_QUEUE_NUM_BASE && offset < VIRTIO_QUEUE_NUM_BASE + 4) {
-        state->virtio->queue_num = WriteRange8(state->virtio->queue_num, val, offset - VIRTIO_QUEUE_NUM_BASE);
+        vq->num = WriteRange8(vq->num, val, offset - VIRTIO_QUEUE_NUM_BASE);
         return;
     } else if (offset >= VIRTIO_QUEUE_ALIGN_BASE && offset < VIRTIO_QUEUE_ALIGN_BASE + 4) {
-        state->virtio->queue_align = WriteRange8(state->virtio->queue_align, val, offset - VIRTIO_QUEUE_ALIGN_BASE);
+        vq->align = WriteRange8(vq->align, val, offset - VIRTIO_QUEUE_ALIGN_BASE);
         return;
     } else if (offset >= VIRTIO_QUEUE_PFN_BASE && offset < VIRTIO_QUEUE_PFN_BASE + 4) {
-        state->virtio->queue_pfn = WriteRange8(state->virtio->queue_pfn, val, offset - VIRTIO_QUEUE_PFN_BASE);
+        vq->pfn = WriteRange8(vq->pfn, val, offset - VIRTIO_QUEUE_PFN_BASE);
+        return;
+    } else if (offset >= VIRTIO_QUEUE_READY_BASE && offset < VIRTIO_QUEUE_READY_BASE + 4) {
+        vq->ready = WriteRange8(vq->ready, val, offset - VIRTIO_QUEUE_READY_BASE);
         return;
     } else if (offset >= VIRTIO_QUEUE_NOTIFY_BASE && offset < VIRTIO_QUEUE_NOTIFY_BASE + 4) {
-        state->virtio->queue_notify = WriteRange8(state->virtio->queue_notify, val, offset - VIRTIO_QUEUE_NOTIFY_BASE);
+        virtio->queue_notify = WriteRange8(virtio->queue_notify, val, offset - VIRTIO_QUEUE_NOTIFY_BASE);
         return;
     } else if (offset >= VIRTIO_INTERRUPT_ACK_BASE && offset < VIRTIO_INTERRUPT_ACK_BASE + 4) {
-        if ((val & 1) == 1) {
-            state->virtio->interrupt_status &= ~1;
-            // printf("virtio disabled: pc: %llx, interrupt_status: %d\n", state->pc, state->virtio->interrupt_status);
-        }
-        state->virtio->interrupt_ack = WriteRange8(state->virtio->interrupt_ack, val, offset - VIRTIO_INTERRUPT_ACK_BASE);
+        virtio->interrupt_status &= ~((uint32_t)val << ((offset - VIRTIO_INTERRUPT_ACK_BASE) * 8));
+        virtio->interrupt_ack = WriteRange8(virtio->interrupt_ack, val, offset - VIRTIO_INTERRUPT_ACK_BASE);
         return;
     } else if (offset >= VIRTIO_STATUS_BASE && offset < VIRTIO_STATUS_BASE + 4) {
-        state->virtio->status = WriteRange8(state->virtio->status, val, offset - VIRTIO_STATUS_BASE);
+        virtio->status = WriteRange8(virtio->status, val, offset - VIRTIO_STATUS_BASE);
+        // Writing zero resets the device.
+        if (virtio->status == 0) {
+            ResetVirtio(virtio);
+        }
+        return;
+    } else if (offset >= VIRTIO_QUEUE_DESC_BASE && offset < VIRTIO_QUEUE_DESC_BASE + 8) {
+        vq->desc_addr = WriteRange8(vq->desc_addr, val, offset - VIRTIO_QUEUE_DESC_BASE);
+        return;
+    } else if (offset >= VIRTIO_QUEUE_DRIVER_BASE && offset < VIRTIO_QUEUE_DRIVER_BASE + 8) {
+        vq->driver_addr = WriteRange8(vq->driver_addr, val, offset - VIRTIO_QUEUE_DRIVER_BASE);
+        return;
+    } else if (offset >= VIRTIO_QUEUE_DEVICE_BASE && offset < VIRTIO_QUEUE_DEVICE_BASE + 8) {
+        vq->device_addr = WriteRange8(vq->device_addr, val, offset - VIRTIO_QUEUE_DEVICE_BASE);
+        return;
+    } else if (offset >= VIRTIO_CONFIG_BASE && offset < VIRTIO_CONFIG_BASE + VIRTIO_CONFIG_SIZE) {
+        virtio->config[offset - VIRTIO_CONFIG_BASE] = val;
         return;
     }
 }
 
-uint8_t VirtioRead(State *state, uint64_t offset) {
+uint8_t VirtioRead(State *state, Virtio *virtio, uint64_t offset) {
+    // The registers of a queue that doesn't exist, QueueNumMax included, read as 0.
+    bool exists = virtio->queue_sel < VIRTIO_QUEUE_MAX;
+    VirtQueue absent = {0};
+    VirtQueue *vq = exists ? &virtio->queue[virtio->queue_sel] : &absent;
     if (offset >= VIRTIO_MAGIC_VALUE_BASE && offset < VIRTIO_MAGIC_VALUE_BASE + 4) {
         return ReadRange8(0x74726976, offset - VIRTIO_MAGIC_VALUE_BASE);
     } else if (offset >= VIRTIO_DEVICE_VERSION_BASE && offset < VIRTIO_DEVICE_VERSION_BASE + 4) {
-        return ReadRange8(0x01, offset - VIRTIO_DEVICE_VERSION_BASE);
+        return ReadRange8(virtio->version, offset - VIRTIO_DEVICE_VERSION_BASE);
     } else if (offset >= VIRTIO_DEVICE_ID_BASE && offset < VIRTIO_DEVICE_ID_BASE + 4) {
-        return ReadRange8(0x02, offset - VIRTIO_DEVICE_ID_BASE);
+        return ReadRange8(virtio->device_id, offset - VIRTIO_DEVICE_ID_BASE);
     } else if (offset >= VIRTIO_VENDOR_ID_BASE && offset < VIRTIO_VENDOR_ID_BASE + 4) {
         return ReadRange8(0x554d4551, offset - VIRTIO_VENDOR_ID_BASE);
     } else if (offset >= VIRTIO_HOST_FEATURES_BASE && offset < VIRTIO_HOST_FEATURES_BASE + 4) {
-        return ReadRange8(state->virtio->host_features, offset - VIRTIO_HOST_FEATURES_BASE);
+        if (virtio->host_features_sel > 1) {
+            return 0;
+        }
+        uint64_t start = offset - VIRTIO_HOST_FEATURES_BASE + 4 * virtio->host_features_sel;
+        return ReadRange8(virtio->host_features, start);
     } else if (offset >= VIRTIO_QUEUE_NUM_MAX_BASE && offset < VIRTIO_QUEUE_NUM_MAX_BASE + 4) {
-        return ReadRange8(0x2000, offset - VIRTIO_QUEUE_NUM_MAX_BASE);
+        return ReadRange8(exists ? VIRTIO_QUEUE_NUM_MAX : 0, offset - VIRTIO_QUEUE_NUM_MAX_BASE);
     } else if (offset >= VIRTIO_QUEUE_PFN_BASE && offset < VIRTIO_QUEUE_PFN_BASE + 4) {
-        return ReadRange8(state->virtio->queue_pfn, offset - VIRTIO_QUEUE_PFN_BASE);
+        return ReadRange8(vq->pfn, offset - VIRTIO_QUEUE_PFN_BASE);
+    } else if (offset >= VIRTIO_QUEUE_READY_BASE && offset < VIRTIO_QUEUE_READY_BASE + 4) {
+        return ReadRange8(vq->ready, offset - VIRTIO_QUEUE_READY_BASE);
     } else if (offset >= VIRTIO_INTERRUPT_STATUS_BASE && offset < VIRTIO_INTERRUPT_STATUS_BASE + 4) {
-        return ReadRange8(state->virtio->interrupt_status, offset - VIRTIO_INTERRUPT_STATUS_BASE);
+        return ReadRange8(virtio->interrupt_status, offset - VIRTIO_INTERRUPT_STATUS_BASE);
     } else if (offset >= VIRTIO_STATUS_BASE && offset < VIRTIO_STATUS_BASE + 4) {
-        return ReadRange8(state->virtio->status, offset - VIRTIO_STATUS_BASE);
+        return ReadRange8(virtio->status, offset - VIRTIO_STATUS_BASE);
+    } else if (offset >= VIRTIO_QUEUE_DESC_BASE && offset < VIRTIO_QUEUE_DESC_BASE + 8) {
+        return ReadRange8(vq->desc_addr, offset - VIRTIO_QUEUE_DESC_BASE);
+    } else if (offset >= VIRTIO_QUEUE_DRIVER_BASE && offset < VIRTIO_QUEUE_DRIVER_BASE + 8) {
+        return ReadRange8(vq->driver_addr, offset - VIRTIO_QUEUE_DRIVER_BASE);
+    } else if (offset >= VIRTIO_QUEUE_DEVICE_BASE && offset < VIRTIO_QUEUE_DEVICE_BASE + 8) {
+        return ReadRange8(vq->device_addr, offset - VIRTIO_QUEUE_DEVICE_BASE);
+    } else if (offset >= VIRTIO_CONFIG_GENERATION_BASE && offset < VIRTIO_CONFIG_GENERATION_BASE + 4) {
+        return ReadRange8(virtio->config_generation, offset - VIRTIO_CONFIG_GENERATION_BASE);
+    } else if (offset >= VIRTIO_CONFIG_BASE && offset < VIRTIO_CONFIG_BASE + VIRTIO_CONFIG_SIZE) {
+        return virtio->config[offset - VIRTIO_CONFIG_BASE];
     } else {
         return 0;
     }
 }
 
-void MemWrite8(State *state, uint64_t addr, uint8_t val) {
+void DeviceWrite8(State *state, uint64_t addr, uint8_t val) {
     if (addr >= UART_BASE && addr < (UART_BASE + UART_SIZE)) {
         UartWrite(state, addr - UART_BASE, val);
         return;
@@ -520,10 +1109,20 @@ void MemWrite8(State *state, uint64_t addr, uint8_t val) {
     } else if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
         PlicWrite(state, addr - PLIC_BASE, val);
         return;
-    } else if (addr >= VIRTIO_BASE && addr < (VIRTIO_BASE + VIRTIO_SIZE)) {
-        VirtioWrite(state, addr - VIRTIO_BASE, val);
+    } else if (addr >= VIRTIO_BASE && addr < (VIRTIO_BASE + VIRTIO_SIZE * VIRTIO_SLOTS)) {
+        Virtio *virtio = state->virtio_slots[(addr - VIRTIO_BASE) / VIRTIO_SIZE];
+        if (virtio != NULL) {
+            VirtioWrite(state, virtio, (addr - VIRTIO_BASE) % VIRTIO_SIZE, val);
+        }
+        return;
+    } else if (addr >= SHMEM_REG_BASE && addr < (SHMEM_REG_BASE + SHMEM_REG_SIZE) && state->shmem != NULL) {
+        ShmemWrite(state, addr - SHMEM_REG_BASE, val);
         return;
-    } else if (addr >= DRAM_BASE) {
+    } else if (addr >= SHMEM_BASE && addr < DRAM_BASE && state->shmem != NULL &&
+               addr - SHMEM_BASE < state->shmem->size) {
+        state->shmem->mem[addr - SHMEM_BASE] = val;
+        return;
+    } else if (addr >= DRAM_BASE && addr - DRAM_BASE < state->mem_size) {
         *(uint8_t *)(state->mem + (addr - DRAM_BASE)) = val;
         return;
     }
@@ -532,56 +1131,98 @@ void MemWrite8(State *state, uint64_t addr, uint8_t val) {
     return;
 }
 
+// Whether the `len` bytes at `addr`, for a power of two `len` up to 8, are
+// naturally aligned and in RAM. Such an access is a single host load or
+// store, so that other harts see all of it or nothing, as RISC-V requires.
+bool IsAlignedRam(State *state, uint64_t addr, uint64_t len) {
+    return addr % len == 0 && addr >= DRAM_BASE && addr - DRAM_BASE < state->mem_size &&
+           len <= state->mem_size - (addr - DRAM_BASE);
+}
+
+// Drop the cached code of, log and end the reservations on an aligned store
+// of `len` bytes to RAM, which is within a page and an 8-byte granule.
+void RamStored(State *state, uint64_t addr, uint64_t len) {
+    state->loop.dirty = true;
+    if (__atomic_load_n(&state->code_gen[(addr - DRAM_BASE) / PAGESIZE], __ATOMIC_RELAXED) & 1) {
+        InvalidateCode(state, addr, len);
+    }
+    if (state->store_log != NULL) {
+        LogStore(state, addr, len);
+    }
+    if (state->harts != NULL) {
+        InvalidateReservations(state, addr);
+    }
+}
+
+void MemWrite8(State *state, uint64_t addr, uint8_t val) {
+    if (IsAlignedRam(state, addr, 1)) {
+        __atomic_store_n(state->mem + (addr - DRAM_BASE), val, __ATOMIC_RELAXED);
+        RamStored(state, addr, 1);
+        return;
+    }
+    state->loop.dirty = true;
+    LockDevices(state);
+    DeviceWrite8(state, addr, val);
+    UnlockDevices(state);
+    if (state->hart_id != 0) {
+        // Only hart 0 runs the devices, e.g. a queue notify, and it may be
+        // parked in WFI.
+        WakeHart(HartById(state, 0));
+    }
+}
+
 void MemWrite16(State *state, uint64_t addr, uint16_t val) {
-    // if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return;
-    // } else if (addr >= DRAM_BASE) {
-    //     *(uint16_t *)(state->mem + (addr - DRAM_BASE)) = val;
-    //     return;
-    // }
+    if (IsAlignedRam(state, addr, 2)) {
+        __atomic_store_n((uint16_t *)(state->mem + (addr - DRAM_BASE)), val, __ATOMIC_RELAXED);
+        RamStored(state, addr, 2);
+        return;
+    }
     for (int i = 0; i < 2; i++) {
         MemWrite8(state, addr + i, (uint8_t)(val >> (i * 8) & SetNBits(8)));
     }
 }
 
 void MemWrite32(State *state, uint64_t addr, uint32_t val) {
-    // if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return;
-    // } else if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
-    //     return;
-    // } else if (addr >= DRAM_BASE) {
-    //     *(uint32_t *)(state->mem + (addr - DRAM_BASE)) = val;
-    //     return;
-    // }
+    if (IsAlignedRam(state, addr, 4)) {
+        __atomic_store_n((uint32_t *)(state->mem + (addr - DRAM_BASE)), val, __ATOMIC_RELAXED);
+        RamStored(state, addr, 4);
+        return;
+    }
     for (int i = 0; i < 4; i++) {
         MemWrite8(state, addr + i, (uint8_t)(val >> (i * 8) & SetNBits(8)));
     }
 }
 
 void MemWrite64(State *state, uint64_t addr, uint64_t val) {
-    // if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return;
-    // } else if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
-    //     return;
-    // } else if (addr >= DRAM_BASE) {
-    //     *(uint64_t *)(state->mem + (addr - DRAM_BASE)) = val;
-    //     return;
-    // }
+    if (IsAlignedRam(state, addr, 8)) {
+        __atomic_store_n((uint64_t *)(state->mem + (addr - DRAM_BASE)), val, __ATOMIC_RELAXED);
+        RamStored(state, addr, 8);
+        return;
+    }
     for (int i = 0; i < 8; i++) {
         MemWrite8(state, addr + i, (uint8_t)(val >> (i * 8) & SetNBits(8)));
     }
 }
 
-uint8_t MemRead8(State *state, uint64_t addr) {
+uint8_t DeviceRead8(State *state, uint64_t addr) {
     if (addr >= UART_BASE && addr < (UART_BASE + UART_SIZE)) {
         return UartRead(state, addr - UART_BASE);
     } else if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
         return ClintRead(state, addr - CLINT_BASE);
     } else if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
         return PlicRead(state, addr - PLIC_BASE);
-    } else if (addr >= VIRTIO_BASE && addr < (VIRTIO_BASE + VIRTIO_SIZE)) {
-        return VirtioRead(state, addr - VIRTIO_BASE);
-    } else if (addr >= DRAM_BASE) {
+    } else if (addr >= VIRTIO_BASE && addr < (VIRTIO_BASE + VIRTIO_SIZE * VIRTIO_SLOTS)) {
+        Virtio *virtio = state->virtio_slots[(addr - VIRTIO_BASE) / VIRTIO_SIZE];
+        if (virtio == NULL) {
+            return 0;
+        }
+        return VirtioRead(state, virtio, (addr - VIRTIO_BASE) % VIRTIO_SIZE);
+    } else if (addr >= SHMEM_REG_BASE && addr < (SHMEM_REG_BASE + SHMEM_REG_SIZE) && state->shmem != NULL) {
+        return ShmemRead(state, addr - SHMEM_REG_BASE);
+    } else if (addr >= SHMEM_BASE && addr < DRAM_BASE && state->shmem != NULL &&
+               addr - SHMEM_BASE < state->shmem->size) {
+        return state->shmem->mem[addr - SHMEM_BASE];
+    } else if (addr >= DRAM_BASE && addr - DRAM_BASE < state->mem_size) {
         return *(uint8_t *)(state->mem + (addr - DRAM_BASE));
     }
     state->excepted = true;
@@ -589,45 +1230,60 @@ uint8_t MemRead8(State *state, uint64_t addr) {
     return 0;
 }
 
+// Read the byte at `addr` of a load. The first byte of a load latches mtime,
+// so that every byte of it, at whatever offset it starts, sees the same time.
+uint8_t LoadByte(State *state, uint64_t addr, bool first) {
+    if (IsAlignedRam(state, addr, 1)) {
+        return __atomic_load_n(state->mem + (addr - DRAM_BASE), __ATOMIC_RELAXED);
+    }
+    bool is_mtime = addr >= CLINT_BASE + CLINT_MTIME_BASE && addr < CLINT_BASE + CLINT_MTIME_BASE + CLINT_MTIME_SIZE;
+    if (is_mtime) {
+        state->loop.mtime = true;
+    } else {
+        state->loop.dirty = true;
+    }
+    LockDevices(state);
+    if (is_mtime && first) {
+        state->clint->mtime_latch = ClintTime(state);
+    }
+    uint8_t val = DeviceRead8(state, addr);
+    UnlockDevices(state);
+    return val;
+}
+
+uint8_t MemRead8(State *state, uint64_t addr) {
+    return LoadByte(state, addr, true);
+}
+
 uint16_t MemRead16(State *state, uint64_t addr) {
-    // if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return 0;
-    // } else if (addr >= DRAM_BASE) {
-    //     return *(uint16_t *)(state->mem + (addr - DRAM_BASE));
-    // }
+    if (IsAlignedRam(state, addr, 2)) {
+        return __atomic_load_n((uint16_t *)(state->mem + (addr - DRAM_BASE)), __ATOMIC_RELAXED);
+    }
     uint16_t val = 0;
     for (int i = 0; i < 2; i++) {
-        val |= (uint16_t)(MemRead8(state, addr + i)) << (i * 8);
+        val |= (uint16_t)(LoadByte(state, addr + i, i == 0)) << (i * 8);
     }
     return val;
 }
 
 uint32_t MemRead32(State *state, uint64_t addr) {
-    // if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
-    //     return 0;
-    // } else if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return 0;
-    // } else if (addr >= DRAM_BASE) {
-    //     return *(uint32_t *)(state->mem + (addr - DRAM_BASE));
-    // }
+    if (IsAlignedRam(state, addr, 4)) {
+        return __atomic_load_n((uint32_t *)(state->mem + (addr - DRAM_BASE)), __ATOMIC_RELAXED);
+    }
     uint32_t val = 0;
     for (int i = 0; i < 4; i++) {
-        val |= (uint32_t)(MemRead8(state, addr + i)) << (i * 8);
+        val |= (uint32_t)(LoadByte(state, addr + i, i == 0)) << (i * 8);
     }
     return val;
 }
 
 uint64_t MemRead64(State *state, uint64_t addr) {
-    // if (addr >= PLIC_BASE && addr < (PLIC_BASE + PLIC_SIZE)) {
-    //     return 0;
-    // } else if (addr >= CLINT_BASE && addr < (CLINT_BASE + CLINT_SIZE)) {
-    //     return 0;
-    // } else if (addr >= DRAM_BASE) {
-    //     return *(uint64_t *)(state->mem + (addr - DRAM_BASE));
-    // }
+    if (IsAlignedRam(state, addr, 8)) {
+        return __atomic_load_n((uint64_t *)(state->mem + (addr - DRAM_BASE)), __ATOMIC_RELAXED);
+    }
     uint64_t val = 0;
     for (int i = 0; i < 8; i++) {
-        val |= (uint64_t)(MemRead8(state, addr + i)) << (i * 8);
+        val |= (uint64_t)(LoadByte(state, addr + i, i == 0)) << (i * 8);
     }
     return val;
 }
@@ -650,8 +1306,9 @@ void AccessFault(State *state, uint8_t access_type) {
     }
 }
 
-void PageFault(State *state, uint8_t access_type) {
+void PageFault(State *state, uint8_t access_type, uint64_t v_addr) {
     state->excepted = true;
+    state->exception_value = v_addr;
     switch (access_type) {
     case AccessInstruction:
         state->exception_code = InstructionPageFault;
@@ -668,6 +1325,11 @@ void PageFault(State *state, uint8_t access_type) {
     }
 }
 
+void FlushTlb(State *state) {
+    memset(state->tlb, 0, sizeof(state->tlb));
+    state->tlb_satp = state->csr[SATP];
+}
+
 // Translate a virtual address to a physical address.
 uint64_t Translate(State *state, uint64_t v_addr, uint8_t access_type) {
     uint8_t MODE = ReadCSR(state, SATP, 60, 63);
@@ -678,6 +1340,13 @@ uint64_t Translate(State *state, uint64_t v_addr, uint8_t access_type) {
     if (MODE != Sv39) {
         Error("Unimplemented Translation Mode: %d", MODE);
     }
+    if (state->csr[SATP] != state->tlb_satp) {
+        FlushTlb(state);
+    }
+    TlbEntry *entry = &state->tlb[access_type][(v_addr >> 12) % TLB_SIZE];
+    if (entry->tag == ((v_addr & ~(uint64_t)0xfff) | 1) && !state->reference) {
+        return entry->page | (v_addr & 0xfff);
+    }
 
     uint64_t a;
     int64_t i;
@@ -710,7 +1379,7 @@ step1:
     }
     if (page_fault) {
         // printf("step1 page fault\n");
-        PageFault(state, access_type);
+        PageFault(state, access_type, v_addr);
         return v_addr;
     }
 
@@ -740,7 +1409,7 @@ step4:
     pte_rsw = pte >> 8 & SetNBits(2);
     if (pte_v == 0 || (pte_r == 0 && pte_w == 1)) {
         // printf("step4 page fault\n");
-        PageFault(state, access_type);
+        PageFault(state, access_type, v_addr);
         return v_addr;
     }
 
@@ -753,7 +1422,7 @@ step5:
         i--;
         if (i < 0) {
             // printf("step5 page fault\n");
-            PageFault(state, access_type);
+            PageFault(state, access_type, v_addr);
             return v_addr;
         } else {
             a =  pte_ppn * PAGESIZE;
@@ -770,14 +1439,14 @@ step6:
     // }
     if (access_type == AccessInstruction) {
         if (pte_x == 0) {
-            printf("AccessInstruction Page Fault\n");
+            // printf("AccessInstruction Page Fault\n");
             page_fault = true;
         }
     }
     if (access_type == AccessLoad) {
         // if (ReadCSR(state, MSTATUS, 19, 19) == 0) {
         if (pte_r == 0) {
-            printf("AccessLoad Page Fault\n");
+            // printf("AccessLoad Page Fault\n");
             page_fault = true;
         }
         // } else if (ReadCSR(state, MSTATUS, 19, 19) == 1) {
@@ -788,14 +1457,14 @@ step6:
     }
     if (access_type == AccessStore) {
         if (pte_w == 0) {
-            printf("AccessStore Page Fault\n");
+            // printf("AccessStore Page Fault\n");
             page_fault = true;
         }
     }
 
     if (page_fault) {
-        printf("step6 page fault\n");
-        PageFault(state, access_type);
+        // printf("step6 page fault\n");
+        PageFault(state, access_type, v_addr);
         return v_addr;
     }
 
@@ -807,8 +1476,8 @@ step7:
         }
     }
     if (page_fault) {
-        printf("step7 page fault\n");
-        PageFault(state, access_type);
+        // printf("step7 page fault\n");
+        PageFault(state, access_type, v_addr);
         return v_addr;
     }
 
@@ -828,6 +1497,8 @@ step9:
     }
     pa |= (pte_ppn & (SetNBits(44) ^ SetNBits(9 * i))) << 12;
     // printf("va: 0x%llx -> pa: 0x%llx\n", v_addr, pa);
+    entry->tag = (v_addr & ~(uint64_t)0xfff) | 1;
+    entry->page = pa & ~(uint64_t)0xfff;
     return pa;
 }
 
@@ -879,11 +1550,88 @@ uint64_t Read64(State *state, uint64_t v_addr) {
     return MemRead64(state, p_addr);
 }
 
+// Record a store of `len` bytes at `addr` for the lockstep checker, which
+// compares only the memory that changed. Past STORE_LOG_SIZE stores only
+// the count goes up, and the checker compares all of RAM.
+void LogStore(State *state, uint64_t addr, uint64_t len) {
+    StoreLog *log = state->store_log;
+    if (log->len < STORE_LOG_SIZE) {
+        log->addr[log->len] = addr;
+        log->size[log->len] = len;
+    }
+    log->len++;
+}
+
+// Self-modifying code.
+//
+// Fetch32 caches the instructions it reads from DRAM by physical address.
+// Every DRAM page has a generation in `code_gen`: a cached instruction is
+// valid only while the generation of its page is the one it was cached with.
+// Caching marks the page by making its generation odd, and a store to a
+// marked page makes it even again, which drops every cached instruction of
+// the page on every hart at once. Stores to pages without cached code only
+// pay for the check of the mark. Device DMA into guest memory goes through
+// InvalidateCode as well. Stores by other harts are seen right away; fence.i,
+// which RISC-V requires before running modified code, empties the cache of
+// the hart as well.
+void InvalidateCode(State *state, uint64_t addr, uint64_t len) {
+    if (len == 0 || addr < DRAM_BASE || addr - DRAM_BASE >= state->mem_size) {
+        return;
+    }
+    uint64_t last = addr - DRAM_BASE + len - 1;
+    if (last >= state->mem_size) {
+        last = state->mem_size - 1;
+    }
+    for (uint64_t page = (addr - DRAM_BASE) / PAGESIZE; page <= last / PAGESIZE; page++) {
+        uint32_t gen = __atomic_load_n(&state->code_gen[page], __ATOMIC_RELAXED);
+        if (gen & 1) {
+            __atomic_compare_exchange_n(&state->code_gen[page], &gen, gen + 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void FlushICache(State *state) {
+    memset(state->icache, 0, sizeof(state->icache));
+}
+
 uint32_t Fetch32(State *state, uint64_t v_addr) {
     uint64_t p_addr = Translate(state, v_addr, AccessInstruction);
     if (state->excepted) return 0;
     // printf("v_addr: %llx -> p_addr: %llx\n", v_addr, p_addr);
-    return MemRead32(state, p_addr);
+    if (p_addr % PAGESIZE == PAGESIZE - 2) {
+        // The upper half of an instruction that straddles a page is on the
+        // next virtual page, which may map anywhere or fault on its own.
+        // Such instructions aren't cached.
+        uint32_t low = MemRead16(state, p_addr);
+        if ((low & 3) != 3) {
+            return low;
+        }
+        uint64_t high_addr = Translate(state, v_addr + 2, AccessInstruction);
+        if (state->excepted) return 0;
+        return low | (uint32_t)MemRead16(state, high_addr) << 16;
+    }
+    if (p_addr < DRAM_BASE || p_addr - DRAM_BASE + 4 > state->mem_size || state->reference) {
+        return MemRead32(state, p_addr);
+    }
+    ICacheEntry *entry = &state->icache[(p_addr >> 1) % ICACHE_SIZE];
+    uint32_t *gen = &state->code_gen[(p_addr - DRAM_BASE) / PAGESIZE];
+    uint32_t g = __atomic_load_n(gen, __ATOMIC_RELAXED);
+    if (entry->addr == p_addr && entry->gen == g) {
+        return entry->instr;
+    }
+    if ((g & 1) == 0) {
+        // Mark the page before reading it, so that a store racing with the
+        // read moves the generation past the one cached here.
+        g++;
+        __atomic_store_n(gen, g, __ATOMIC_SEQ_CST);
+    }
+    uint32_t instr;
+    memcpy(&instr, state->mem + (p_addr - DRAM_BASE), sizeof(instr));
+    entry->addr = p_addr;
+    entry->instr = instr;
+    entry->gen = g;
+    return instr;
 }
 
 // CSRs[csr][start_bit:end_bit] = val
@@ -929,6 +1677,14 @@ bool Require(State *state, uint8_t mode) {
     return false;
 }
 
+// Raise `IllegalInstruction` for an encoding that rve doesn't implement. The
+// guest gets a trap with the instruction bits in xtval.
+void IllegalInstr(State *state, uint32_t instr) {
+    state->excepted = true;
+    state->exception_code = IllegalInstruction;
+    state->exception_value = instr;
+}
+
 // Sign-extend a value of `i` by supposing that its top bit is `top_bit`.
 int64_t Sext(int64_t i, int top_bit) {
     if (i & SetOneBit(top_bit)) {
@@ -1020,7 +1776,11 @@ void ExecOpImmInstr(State *state, uint32_t instr) {
         ExecAddi(state, instr);
         break;
     case 0x1:
-        ExecSlli(state, instr);
+        if (funct6 == 0x00) {
+            ExecSlli(state, instr);
+        } else {
+            IllegalInstr(state, instr);
+        }
         break;
     case 0x2:
         ExecSlti(state, instr);
@@ -1036,6 +1796,8 @@ void ExecOpImmInstr(State *state, uint32_t instr) {
             ExecSrli(state, instr);
         } else if (funct6 == 0x10) {
             ExecSrai(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x6:
@@ -1045,7 +1807,7 @@ void ExecOpImmInstr(State *state, uint32_t instr) {
         ExecAndi(state, instr);
         break;
     default:
-        Error("Unknown OP_IMM instruction: %2x", funct3);
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1092,7 +1854,7 @@ void ExecSll(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    state->x[rd] = state->x[rs1] << state->x[rs2];
+    state->x[rd] = state->x[rs1] << (state->x[rs2] & SetNBits(6));
 }
 
 void ExecMulh(State *state, uint32_t instr) {
@@ -1165,9 +1927,7 @@ void ExecSrl(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    // In RV64I, Use SetNBits(6).
-    state->x[rd] =
-        ((uint64_t)state->x[rs1]) >> ((uint64_t)(state->x[rs2] & SetNBits(5)));
+    state->x[rd] = ((uint64_t)state->x[rs1]) >> (state->x[rs2] & SetNBits(6));
 }
 
 void ExecDivu(State *state, uint32_t instr) {
@@ -1187,8 +1947,7 @@ void ExecSra(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    // In RV64I, Use SetNBits(6).
-    state->x[rd] = state->x[rs1] >> (state->x[rs2] & SetNBits(5));
+    state->x[rd] = state->x[rs1] >> (state->x[rs2] & SetNBits(6));
 }
 
 void ExecOr(State *state, uint32_t instr) {
@@ -1245,6 +2004,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecMul(state, instr);
         } else if (funct7 == 0x20) {
             ExecSub(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x1:
@@ -1252,6 +2013,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecSll(state, instr);
         } else if (funct7 == 0x01) {
             ExecMulh(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x2:
@@ -1259,6 +2022,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecSlt(state, instr);
         } else if (funct7 == 0x01) {
             ExecMulhsu(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x3:
@@ -1266,6 +2031,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecSltu(state, instr);
         } else if (funct7 == 0x01) {
             ExecMulhu(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x4:
@@ -1273,6 +2040,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecXor(state, instr);
         } else if (funct7 == 0x01) {
             ExecDiv(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x5:
@@ -1282,6 +2051,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecDivu(state, instr);
         } else if (funct7 == 0x20) {
             ExecSra(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x6:
@@ -1289,6 +2060,8 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecOr(state, instr);
         } else if (funct7 == 0x01) {
             ExecRem(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x7:
@@ -1296,8 +2069,12 @@ void ExecOpInstr(State *state, uint32_t instr) {
             ExecAnd(state, instr);
         } else if (funct7 == 0x01) {
             ExecRemu(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
+    default:
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1328,7 +2105,10 @@ void ExecLb(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Sext(Read8(state, state->x[rs1] + offset), 7);
+    uint64_t t = Sext(Read8(state, state->x[rs1] + offset), 7);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLh(State *state, uint32_t instr) {
@@ -1336,7 +2116,10 @@ void ExecLh(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Sext(Read16(state, state->x[rs1] + offset), 15);
+    uint64_t t = Sext(Read16(state, state->x[rs1] + offset), 15);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLw(State *state, uint32_t instr) {
@@ -1344,7 +2127,10 @@ void ExecLw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Sext(Read32(state, state->x[rs1] + offset), 31);
+    uint64_t t = Sext(Read32(state, state->x[rs1] + offset), 31);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLd(State *state, uint32_t instr) {
@@ -1352,7 +2138,10 @@ void ExecLd(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Read64(state, state->x[rs1] + offset);
+    uint64_t t = Read64(state, state->x[rs1] + offset);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLbu(State *state, uint32_t instr) {
@@ -1360,7 +2149,10 @@ void ExecLbu(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Read8(state, state->x[rs1] + offset);
+    uint64_t t = Read8(state, state->x[rs1] + offset);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLhu(State *state, uint32_t instr) {
@@ -1368,7 +2160,10 @@ void ExecLhu(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Read16(state, state->x[rs1] + offset);
+    uint64_t t = Read16(state, state->x[rs1] + offset);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLwu(State *state, uint32_t instr) {
@@ -1376,7 +2171,10 @@ void ExecLwu(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     int32_t offset = Sext(instr >> 20 & SetNBits(12), 11);
 
-    state->x[rd] = Read32(state, state->x[rs1] + offset);
+    uint64_t t = Read32(state, state->x[rs1] + offset);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLoadInstr(State *state, uint32_t instr) {
@@ -1405,7 +2203,7 @@ void ExecLoadInstr(State *state, uint32_t instr) {
         ExecLwu(state, instr);
         break;
     default:
-        Error("Unimplemented Load Instruction: funct3=0x%x", funct3);
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1465,7 +2263,7 @@ void ExecStoreInstr(State *state, uint32_t instr) {
         ExecSd(state, instr);
         break;
     default:
-        Error("Unimplemented Store Instruction: funct3=0x%x", funct3);
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1582,7 +2380,7 @@ void ExecBranchInstr(State *state, uint32_t instr) {
         ExecBgeu(state, instr);
         break;
     default:
-        Error("Unimplemented Branch Instruction: funct3=0x%x", funct3);
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1629,15 +2427,23 @@ void ExecOpImm32Instr(State *state, uint32_t instr) {
         ExecAddiw(state, instr);
         break;
     case 0x1:
-        ExecSlliw(state, instr);
+        if (funct7 == 0x00) {
+            ExecSlliw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
+        }
         break;
     case 0x5:
         if (funct7 == 0x00) {
             ExecSrliw(state, instr);
         } else if (funct7 == 0x20) {
             ExecSraiw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
+    default:
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1679,12 +2485,14 @@ void ExecDivw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    if (state->x[rs2] == 0) {
+    int32_t dividend = (int32_t)state->x[rs1];
+    int32_t divisor = (int32_t)state->x[rs2];
+    if (divisor == 0) {
         state->x[rd] = -1;
-    } else if ((int32_t)(state->x[rs1] & SetNBits(32)) == -((int32_t)1 << 31) && (int32_t)(state->x[rs2] & SetNBits(32)) == -1) {
-        state->x[rd] = -((int32_t)1 << 31);
+    } else if (dividend == INT32_MIN && divisor == -1) {
+        state->x[rd] = INT32_MIN;
     } else {
-        state->x[rd] = Sext(((int32_t)(state->x[rs1] & SetNBits(32)) / (int32_t)(state->x[rs2] & SetNBits(32))), 31);
+        state->x[rd] = dividend / divisor;
     }
 }
 
@@ -1693,7 +2501,7 @@ void ExecSrlw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    state->x[rd] = Sext((uint32_t)state->x[rs1] >> state->x[rs2], 31);
+    state->x[rd] = (int32_t)((uint32_t)state->x[rs1] >> (state->x[rs2] & SetNBits(5)));
 }
 
 void ExecDivuw(State *state, uint32_t instr) {
@@ -1701,12 +2509,12 @@ void ExecDivuw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    if (state->x[rs2] == 0) {
+    uint32_t dividend = (uint32_t)state->x[rs1];
+    uint32_t divisor = (uint32_t)state->x[rs2];
+    if (divisor == 0) {
         state->x[rd] = ~((uint64_t)0);
     } else {
-        state->x[rd] = Sext((state->x[rs1] & SetNBits(32)) /
-                                (state->x[rs2] & SetNBits(32)),
-                            31);
+        state->x[rd] = (int32_t)(dividend / divisor);
     }
 }
 
@@ -1724,10 +2532,14 @@ void ExecRemw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    if (state->x[rs2] == 0) {
-        state->x[rd] = state->x[rs1];
+    int32_t dividend = (int32_t)state->x[rs1];
+    int32_t divisor = (int32_t)state->x[rs2];
+    if (divisor == 0) {
+        state->x[rd] = dividend;
+    } else if (dividend == INT32_MIN && divisor == -1) {
+        state->x[rd] = 0;
     } else {
-        state->x[rd] = Sext((state->x[rs1] % state->x[rs2]) & SetNBits(32), 31);
+        state->x[rd] = dividend % divisor;
     }
 }
 
@@ -1736,12 +2548,12 @@ void ExecRemuw(State *state, uint32_t instr) {
     uint8_t rs1 = (instr >> 15) & SetNBits(5);
     uint8_t rs2 = (instr >> 20) & SetNBits(5);
 
-    if (state->x[rs2] == 0) {
-        state->x[rd] = state->x[rs1];
+    uint32_t dividend = (uint32_t)state->x[rs1];
+    uint32_t divisor = (uint32_t)state->x[rs2];
+    if (divisor == 0) {
+        state->x[rd] = (int32_t)dividend;
     } else {
-        state->x[rd] = Sext((state->x[rs1] & SetNBits(32)) %
-                                (state->x[rs2] & SetNBits(32)),
-                            31);
+        state->x[rd] = (int32_t)(dividend % divisor);
     }
 }
 
@@ -1755,16 +2567,24 @@ void ExecOp32Instr(State *state, uint32_t instr) {
             ExecAddw(state, instr);
         } else if (funct7 == 0x01) {
             ExecMulw(state, instr);
-        } else {
+        } else if (funct7 == 0x20) {
             ExecSubw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x1:
-        ExecSllw(state, instr);
+        if (funct7 == 0x00) {
+            ExecSllw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
+        }
         break;
     case 0x4:
         if (funct7 == 0x01) {
             ExecDivw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x5:
@@ -1774,17 +2594,26 @@ void ExecOp32Instr(State *state, uint32_t instr) {
             ExecDivuw(state, instr);
         } else if (funct7 == 0x20) {
             ExecSraw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x6:
         if (funct7 == 0x01) {
             ExecRemw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
         break;
     case 0x7:
         if (funct7 == 0x01) {
             ExecRemuw(state, instr);
+        } else {
+            IllegalInstr(state, instr);
         }
+        break;
+    default:
+        IllegalInstr(state, instr);
     }
 }
 
@@ -1804,7 +2633,10 @@ void ExecCLw(State *state, uint16_t instr) {
     uint8_t rs1 = (instr >> 7) & SetNBits(3);
     uint8_t rd = (instr >> 2) & SetNBits(3);
 
-    state->x[8 + rd] = Sext(Read32(state, state->x[8 + rs1] + uimm) & SetNBits(32), 31);
+    uint64_t t = Sext(Read32(state, state->x[8 + rs1] + uimm) & SetNBits(32), 31);
+    if (!state->excepted) {
+        state->x[8 + rd] = t;
+    }
 }
 
 void ExecCLd(State *state, uint32_t instr) {
@@ -1813,7 +2645,10 @@ void ExecCLd(State *state, uint32_t instr) {
     uint8_t rs1 = instr >> 7 & SetNBits(3);
     uint8_t rd = instr >> 2 & SetNBits(3);
 
-    state->x[8 + rd] = Read64(state, state->x[8 + rs1] + uimm);
+    uint64_t t = Read64(state, state->x[8 + rs1] + uimm);
+    if (!state->excepted) {
+        state->x[8 + rd] = t;
+    }
 }
 
 void ExecCSw(State *state, uint16_t instr) {
@@ -1839,9 +2674,6 @@ void ExecCAddi(State *state, uint16_t instr) {
     int32_t imm = Sext(
         ((instr >> 12 & SetNBits(1)) << 5) | (instr >> 2 & SetNBits(5)), 5);
 
-    if (imm == 0) {
-        Error("Invalid c.addi immediate");
-    }
     uint8_t rd = instr >> 7 & SetNBits(5);
 
     state->x[rd] = state->x[rd] + imm;
@@ -1880,8 +2712,10 @@ void ExecCLui(State *state, uint16_t instr) {
                        17);
     uint8_t rd = (instr >> 7) & SetNBits(5);
 
-    if (imm == 0)
-        Error("Invalid c.lui operand");
+    if (imm == 0) {
+        IllegalInstr(state, instr);
+        return;
+    }
 
     state->x[rd] = imm;
 }
@@ -2014,7 +2848,10 @@ void ExecCLwsp(State *state, uint16_t instr) {
                     ((instr >> 12 & SetNBits(1)) << 5) |
                     ((instr >> 4 & SetNBits(3)) << 2);
 
-    state->x[rd] = Sext(Read32(state, state->x[2] + uimm) & SetNBits(32), 31);
+    uint64_t t = Sext(Read32(state, state->x[2] + uimm) & SetNBits(32), 31);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecCLdsp(State *state, uint32_t instr) {
@@ -2023,7 +2860,10 @@ void ExecCLdsp(State *state, uint32_t instr) {
                     (instr >> 12 & SetNBits(1)) << 5 |
                     (instr >> 5 & SetNBits(2)) << 3;
 
-    state->x[rd] = Read64(state, state->x[2] + uimm);
+    uint64_t t = Read64(state, state->x[2] + uimm);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecCJr(State *state, uint16_t instr) {
@@ -2072,9 +2912,7 @@ void ExecCSdsp(State *state, uint32_t instr) {
 
 void ExecCompressedInstr(State *state, uint16_t instr) {
     if (instr == 0) {
-        state->excepted = true;
-        printf("Compressed Instr Illegal\n");
-        state->exception_code = IllegalInstruction;
+        IllegalInstr(state, instr);
         return;
     }
     uint8_t opcode = instr & SetNBits(2);
@@ -2089,9 +2927,6 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             ExecCAddi4spn(state, instr);
             if (state->excepted) return;
             state->pc += 2;
-        } else if (funct3 == 0x1) {
-            // TODO: Implement c.fld.
-            state->pc += 2;
         } else if (funct3 == 0x2) {
             ExecCLw(state, instr);
             if (state->excepted) return;
@@ -2100,9 +2935,6 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             ExecCLd(state, instr);
             if (state->excepted) return;
             state->pc += 2;
-        } else if (funct3 == 0x5) {
-            // TODO: Implement c.fsd.
-            state->pc += 2;
         } else if (funct3 == 0x6) {
             ExecCSw(state, instr);
             if (state->excepted) return;
@@ -2112,7 +2944,7 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             if (state->excepted) return;
             state->pc += 2;
         } else {
-            Error("Invalid instruction: funct3=%d", funct3);
+            IllegalInstr(state, instr);
         }
     } break;
     case 0x1: {
@@ -2195,7 +3027,7 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             ExecCBnez(state, instr);
             if (state->excepted) return;
         } else {
-            Error("Invalid instruction");
+            IllegalInstr(state, instr);
         }
     } break;
     case 0x2: {
@@ -2205,15 +3037,12 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
         uint8_t f_12 = (instr >> 12) & SetNBits(1);
 
         if (funct3 == 0x0 && f_12 == 0 && f_2_6 == 0 && f_7_11 != 0) {
-            printf("c.slli64\n");
+            // c.slli with a zero shift amount is a hint.
             state->pc += 2;
-            // TODO: Understand c.slli64.
         } else if (funct3 == 0x0 && f_7_11 != 0) {
             ExecCSlli(state, instr);
             if (state->excepted) return;
             state->pc += 2;
-        } else if (funct3 == 0x1) {
-            // TODO: Implement c.fldsp.
         } else if (funct3 == 0x2 && f_7_11 != 0) {
             ExecCLwsp(state, instr);
             if (state->excepted) return;
@@ -2239,9 +3068,6 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             ExecCAdd(state, instr);
             if (state->excepted) return;
             state->pc += 2;
-        } else if (funct3 == 0x5) {
-            // TODO: Implement c.fsdsp.
-            state->pc += 2;
         } else if (funct3 == 0x6) {
             ExecCSwsp(state, instr);
             if (state->excepted) return;
@@ -2251,7 +3077,7 @@ void ExecCompressedInstr(State *state, uint16_t instr) {
             if (state->excepted) return;
             state->pc += 2;
         } else {
-            Error("Invalid instruction");
+            IllegalInstr(state, instr);
         }
     } break;
     }
@@ -2278,22 +3104,134 @@ void ExecEcall(State *state, uint32_t instr) {
 
 void ExecEbreak(State *state, uint32_t instr) {
     // TODO: Implement break point exception.
-    printf("Break\n");
+    // printf("Break\n");
 }
 
 void ExecSfencevma(State *state, uint32_t instr) {
-    // Do nothing currently.
+    FlushTlb(state);
+}
+
+bool IsInterruptPending(State *state) {
+    return (ReadCSR(state, MIP, 0, 15) & ReadCSR(state, MIE, 0, 15)) != 0 ||
+           (ReadCSR(state, SIP, 0, 15) & ReadCSR(state, SIE, 0, 15)) != 0;
+}
+
+// True if some device has to poll host sockets while the hart sleeps.
+bool HasPolledDevices(State *state) {
+    for (int i = 0; i < VIRTIO_SLOTS; i++) {
+        if (state->virtio_slots[i] != NULL && state->virtio_slots[i]->poll != NULL) {
+            return true;
+        }
+    }
+    return state->shmem != NULL;
+}
+
+// Let time pass on hart 0 while there is nothing to run.
+//
+// With the instret timebase time only moves with instructions, so the idle
+// ones are skipped by jumping the clock to the next event. With the host
+// timebase the thread sleeps until the timer deadline. Either way, console
+// input wakes it right away, and devices that poll sockets get a look every
+// WFI_POLL_NS. When other harts run on threads of their own, the clock is
+// their time too and doesn't jump: hart 0 wakes every WFI_POLL_NS to move it
+// on by WFI_PARK_TICKS.
+//
+// With the instret timebase, no scheduled event and nothing polled, time
+// stands still and only console input can end the wait. Without console
+// input the machine halts, as nothing can ever wake it, and otherwise a
+// warning tells the user that the guest waits on them.
+void IdleMachine(State *state, bool polled) {
+    Scheduler *scheduler = state->scheduler;
+    Clint *clint = state->clint;
+    bool threaded = IsThreadedSmp(state);
+    if (clint->timebase == TimebaseInstret && scheduler->next != UINT64_MAX && !threaded) {
+        if (scheduler->next > state->clock) {
+            state->clock = scheduler->next;
+        }
+        TickDevices(state);
+        return;
+    }
+
+    int64_t timeout = -1;
+    uint64_t deadline = ClintDeadline(state);
+    if (clint->timebase == TimebaseHost && deadline != UINT64_MAX) {
+        uint64_t mtime = ClintTime(state);
+        uint64_t ticks = mtime < deadline ? deadline - mtime : 0;
+        // Cap the sleep at a second to keep the arithmetic in range.
+        timeout = ticks >= clint->freq ? 1000000000 : ticks * 1000000000 / clint->freq;
+    }
+    if ((polled || (threaded && clint->timebase == TimebaseInstret)) && (timeout < 0 || timeout > WFI_POLL_NS)) {
+        timeout = WFI_POLL_NS;
+    }
+    if (timeout < 0 && clint->timebase == TimebaseInstret) {
+        if (state->console == NULL || !state->console->has_input_thread) {
+            fprintf(stderr, "rve: halted in wfi at 0x%llx: no timer is armed and there is no input\n",
+                    (unsigned long long)state->pc);
+            state->halted = true;
+            return;
+        }
+        if (!scheduler->idle_warned) {
+            fprintf(stderr, "rve: waiting in wfi at 0x%llx for console input: no timer is armed\n",
+                    (unsigned long long)state->pc);
+            scheduler->idle_warned = true;
+        }
+    }
+    ConsoleFlush(state->console);
+    // Publish `parked` before the last look at the levels so that a SetIrq
+    // racing with it either is seen here or signals wake_fd.
+    __atomic_store_n(&state->parked, true, __ATOMIC_SEQ_CST);
+    MergeIrq(state);
+    if (!IsInterruptPending(state)) {
+        WaitForWake(state->wake_fd, timeout);
+    }
+    __atomic_store_n(&state->parked, false, __ATOMIC_SEQ_CST);
+    state->clock += WFI_PARK_TICKS;
+    TickDevices(state);
+}
+
+// Park the hart until an enabled interrupt is pending. Hart 0 lets time pass
+// meanwhile; the other harts just sleep until somebody raises one of their
+// interrupts.
+void WaitForInterrupt(State *state) {
+    bool polled = state->hart_id == 0 && HasPolledDevices(state);
+    MergeIrq(state);
+    while (!IsInterruptPending(state) && !state->halted) {
+        if (state->hart_id == 0) {
+            IdleMachine(state, polled);
+        } else {
+            // main stops the hart by setting `halted` and then waking it up,
+            // so look at `halted` again once `parked` is published.
+            __atomic_store_n(&state->parked, true, __ATOMIC_SEQ_CST);
+            MergeIrq(state);
+            if (!IsInterruptPending(state) && !__atomic_load_n(&state->halted, __ATOMIC_SEQ_CST)) {
+                WaitForWake(state->wake_fd, -1);
+            }
+            __atomic_store_n(&state->parked, false, __ATOMIC_SEQ_CST);
+        }
+        MergeIrq(state);
+    }
 }
 
 void ExecWfi(State *state, uint32_t instr) {
-    printf("wfi\n");
-    PrintRegisters(state, false);
-    exit(state->x[10]);
-    while (true);
+    if ((ReadCSR(state, MIE, 0, 15) | ReadCSR(state, SIE, 0, 15)) == 0) {
+        // No interrupt can ever wake the hart up: treat it as a halt, of the
+        // whole machine on hart 0.
+        state->halted = true;
+        return;
+    }
+    if (state->quantum != 0) {
+        // Harts take turns on one thread, so none may block it: RunQuanta
+        // skips the hart until an interrupt is pending.
+        state->waiting = true;
+        return;
+    }
+    WaitForInterrupt(state);
 }
 
 void ExecMret(State *state, uint32_t instr) {
-    Require(state, MACHINE);
+    if (!Require(state, MACHINE)) {
+        return;
+    }
     state->pc = state->csr[MEPC];
     state->mode = ReadCSR(state, MSTATUS, 11, 12);
     uint64_t mpie = ReadCSR(state, MSTATUS, 7, 7);
@@ -2315,8 +3253,6 @@ void ExecSret(State *state, uint32_t instr) {
     WriteCSR(state, SSTATUS, 8, 8, 0);
 }
 
-void ExecUret(State *state, uint32_t instr) { }
-
 void ExecCsrrw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
     uint8_t rs1 = instr >> 15 & SetNBits(5);
@@ -2379,6 +3315,7 @@ void ExecCsrrci(State *state, uint32_t instr) {
 void ExecSystemInstr(State *state, uint32_t instr) {
     uint8_t funct3 = instr >> 12 & SetNBits(3);
     bool is_pc_written = false;
+    uint64_t satp = state->csr[SATP];
 
     switch (funct3) {
     case 0x0: {
@@ -2400,11 +3337,8 @@ void ExecSystemInstr(State *state, uint32_t instr) {
             } else if (funct7 == 0x08) {
                 ExecSret(state, instr);
                 is_pc_written = true;
-            } else if (funct7 == 0x00 && funct5 == 0x2) {
-                ExecUret(state, instr);
-                is_pc_written = true;
             } else {
-                Error("Unknown instruction: System");
+                IllegalInstr(state, instr);
             }
         }
     } break;
@@ -2427,7 +3361,12 @@ void ExecSystemInstr(State *state, uint32_t instr) {
         ExecCsrrci(state, instr);
         break;
     default:
-        Error("Invalid instruction");
+        IllegalInstr(state, instr);
+    }
+    // satp is WARL: writing a translation mode that rve lacks has no effect.
+    uint8_t satp_mode = ReadCSR(state, SATP, 60, 63);
+    if (satp_mode != Bare && satp_mode != Sv39) {
+        state->csr[SATP] = satp;
     }
 
     if (!is_pc_written)
@@ -2436,7 +3375,9 @@ void ExecSystemInstr(State *state, uint32_t instr) {
 
 void ExecFence(State *state, uint32_t instr) {}
 
-void ExecFencei(State *state, uint32_t instr) {}
+void ExecFencei(State *state, uint32_t instr) {
+    FlushICache(state);
+}
 
 void ExecMiscMem(State *state, uint32_t instr) {
     uint8_t funct3 = instr >> 12 & SetNBits(3);
@@ -2445,32 +3386,244 @@ void ExecMiscMem(State *state, uint32_t instr) {
     } else if (funct3 == 0x1) {
         ExecFencei(state, instr);
     } else {
-        Error("Invalid instruction: MISC-MEM.");
+        IllegalInstr(state, instr);
     }
 }
 
-void ExecAmoaddw(State *state, uint32_t instr) {
-    uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
+// The host memory order for the aq and rl bits of an AMO.
+int AmoOrder(uint32_t instr) {
     uint8_t rl = instr >> 25 & SetNBits(1);
     uint8_t aq = instr >> 26 & SetNBits(1);
+    if (aq && rl) {
+        return __ATOMIC_SEQ_CST;
+    } else if (aq) {
+        return __ATOMIC_ACQUIRE;
+    } else if (rl) {
+        return __ATOMIC_RELEASE;
+    }
+    return __ATOMIC_RELAXED;
+}
+
+// The value an AMO stores over `old`, both `size` bytes wide.
+uint64_t AmoResult(int op, uint64_t old, uint64_t val, int size) {
+    int64_t sold = size == 4 ? (int32_t)old : (int64_t)old;
+    int64_t sval = size == 4 ? (int32_t)val : (int64_t)val;
+    if (size == 4) {
+        old = (uint32_t)old;
+        val = (uint32_t)val;
+    }
+    switch (op) {
+    case AmoAdd:
+        return old + val;
+    case AmoSwap:
+        return val;
+    case AmoXor:
+        return old ^ val;
+    case AmoOr:
+        return old | val;
+    case AmoAnd:
+        return old & val;
+    case AmoMin:
+        return sold < sval ? old : val;
+    case AmoMax:
+        return sold > sval ? old : val;
+    case AmoMinu:
+        return old < val ? old : val;
+    case AmoMaxu:
+        return old > val ? old : val;
+    default:
+        Error("Unknown AMO: %d", op);
+        return 0;
+    }
+}
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    Write32(state, state->x[rs1], (uint32_t)(t + state->x[rs2]));
-    state->x[rd] = t;
+uint32_t Amo32(uint32_t *p, uint32_t val, int op, int order) {
+    switch (op) {
+    case AmoAdd:
+        return __atomic_fetch_add(p, val, order);
+    case AmoSwap:
+        return __atomic_exchange_n(p, val, order);
+    case AmoXor:
+        return __atomic_fetch_xor(p, val, order);
+    case AmoOr:
+        return __atomic_fetch_or(p, val, order);
+    case AmoAnd:
+        return __atomic_fetch_and(p, val, order);
+    default: {
+        uint32_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, AmoResult(op, old, val, 4), true, order, __ATOMIC_RELAXED)) {
+        }
+        return old;
+    }
+    }
+}
+
+uint64_t Amo64(uint64_t *p, uint64_t val, int op, int order) {
+    switch (op) {
+    case AmoAdd:
+        return __atomic_fetch_add(p, val, order);
+    case AmoSwap:
+        return __atomic_exchange_n(p, val, order);
+    case AmoXor:
+        return __atomic_fetch_xor(p, val, order);
+    case AmoOr:
+        return __atomic_fetch_or(p, val, order);
+    case AmoAnd:
+        return __atomic_fetch_and(p, val, order);
+    default: {
+        uint64_t old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, AmoResult(op, old, val, 8), true, order, __ATOMIC_RELAXED)) {
+        }
+        return old;
+    }
+    }
 }
 
-void ExecAmoswapw(State *state, uint32_t instr) {
-    uint8_t rd = instr >> 7 & SetNBits(5);
+// Run the AMO `op` of `size` bytes on the address in rs1 with the value in
+// rs2, and return the old value sign-extended to 64 bits. On RAM the host
+// pointer is resolved once and the AMO is a single host atomic, so harts on
+// other threads see it whole. MMIO has no host atomics; there the device lock
+// keeps the read-modify-write together.
+int64_t Amo(State *state, uint32_t instr, int size, int op) {
     uint8_t rs1 = instr >> 15 & SetNBits(5);
     uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
+    uint64_t v_addr = state->x[rs1];
+    uint64_t val = state->x[rs2];
+    if (v_addr % size != 0) {
+        state->excepted = true;
+        state->exception_code = StoreAMOAddressMisaligned;
+        state->exception_value = v_addr;
+        return 0;
+    }
+    uint64_t p_addr = Translate(state, v_addr, AccessStore);
+    if (state->excepted) {
+        return 0;
+    }
+    uint8_t *host = GuestRam(state, p_addr, size);
+    uint64_t old;
+    if (host == NULL) {
+        LockDevices(state);
+        old = size == 4 ? MemRead32(state, p_addr) : MemRead64(state, p_addr);
+        if (!state->excepted && size == 4) {
+            MemWrite32(state, p_addr, AmoResult(op, old, val, size));
+        } else if (!state->excepted) {
+            MemWrite64(state, p_addr, AmoResult(op, old, val, size));
+        }
+        UnlockDevices(state);
+    } else if (size == 4) {
+        old = Amo32((uint32_t *)host, val, op, AmoOrder(instr));
+    } else {
+        old = Amo64((uint64_t *)host, val, op, AmoOrder(instr));
+    }
+    state->loop.dirty = true;
+    InvalidateCode(state, p_addr, size);
+    if (state->store_log != NULL) {
+        LogStore(state, p_addr, size);
+    }
+    if (state->harts != NULL) {
+        InvalidateReservations(state, p_addr);
+    }
+    return size == 4 ? (int32_t)old : (int64_t)old;
+}
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
-    state->x[rd] = t;
+void ExecAmoaddw(State *state, uint32_t instr) {
+    uint8_t rd = instr >> 7 & SetNBits(5);
+
+    int64_t t = Amo(state, instr, 4, AmoAdd);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
+}
+
+void ExecAmoswapw(State *state, uint32_t instr) {
+    uint8_t rd = instr >> 7 & SetNBits(5);
+
+    int64_t t = Amo(state, instr, 4, AmoSwap);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
+}
+
+// LR/SC.
+//
+// LR records the physical address and the value it loaded. SC stores with a
+// host compare-and-swap against that value, so it fails once any hart has
+// changed the word since the LR, without a lock shared between harts. The
+// reservation also ends with any SC, with a trap, and when another hart
+// stores to its 8-byte granule, which catches stores of the same value.
+uint64_t LoadReserved(State *state, uint64_t v_addr, int size) {
+    if (v_addr % size != 0) {
+        state->excepted = true;
+        state->exception_code = LoadAddressMisaligned;
+        state->exception_value = v_addr;
+        return 0;
+    }
+    uint64_t p_addr = Translate(state, v_addr, AccessLoad);
+    if (state->excepted) {
+        return 0;
+    }
+    uint8_t *host = GuestRam(state, p_addr, size);
+    uint64_t val;
+    if (host == NULL) {
+        val = size == 4 ? MemRead32(state, p_addr) : MemRead64(state, p_addr);
+    } else if (size == 4) {
+        val = __atomic_load_n((uint32_t *)host, __ATOMIC_SEQ_CST);
+    } else {
+        val = __atomic_load_n((uint64_t *)host, __ATOMIC_SEQ_CST);
+    }
+    state->reserve_addr = p_addr;
+    state->reserve_val = val;
+    __atomic_store_n(&state->reserved, true, __ATOMIC_RELAXED);
+    return val;
+}
+
+// Return what SC writes to rd: 0 if the store happened and 1 if not.
+uint64_t StoreConditional(State *state, uint64_t v_addr, uint64_t val, int size) {
+    if (v_addr % size != 0) {
+        state->excepted = true;
+        state->exception_code = StoreAMOAddressMisaligned;
+        state->exception_value = v_addr;
+        return 1;
+    }
+    uint64_t p_addr = Translate(state, v_addr, AccessStore);
+    if (state->excepted) {
+        return 1;
+    }
+    bool reserved = __atomic_load_n(&state->reserved, __ATOMIC_RELAXED) && state->reserve_addr == p_addr;
+    state->reserved = false;
+    if (!reserved) {
+        return 1;
+    }
+    uint8_t *host = GuestRam(state, p_addr, size);
+    if (host == NULL) {
+        if (size == 4) {
+            MemWrite32(state, p_addr, val);
+        } else {
+            MemWrite64(state, p_addr, val);
+        }
+        return state->excepted;
+    }
+    bool stored;
+    if (size == 4) {
+        uint32_t expected = state->reserve_val;
+        stored = __atomic_compare_exchange_n((uint32_t *)host, &expected, (uint32_t)val, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    } else {
+        uint64_t expected = state->reserve_val;
+        stored = __atomic_compare_exchange_n((uint64_t *)host, &expected, val, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    if (stored) {
+        state->loop.dirty = true;
+        InvalidateCode(state, p_addr, size);
+        if (state->store_log != NULL) {
+            LogStore(state, p_addr, size);
+        }
+        if (state->harts != NULL) {
+            InvalidateReservations(state, p_addr);
+        }
+    }
+    return !stored;
 }
 
 void ExecLrw(State *state, uint32_t instr) {
@@ -2479,7 +3632,10 @@ void ExecLrw(State *state, uint32_t instr) {
     uint8_t rl = instr >> 25 & SetNBits(1);
     uint8_t aq = instr >> 26 & SetNBits(1);
 
-    state->x[rd] = Sext(Read32(state, state->x[rs1]), 31);
+    int64_t t = Sext(LoadReserved(state, state->x[rs1], 4), 31);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecScw(State *state, uint32_t instr) {
@@ -2489,132 +3645,91 @@ void ExecScw(State *state, uint32_t instr) {
     uint8_t rl = instr >> 25 & SetNBits(1);
     uint8_t aq = instr >> 26 & SetNBits(1);
 
-    Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
-    state->x[rd] = 0;
+    uint64_t t = StoreConditional(state, state->x[rs1], (uint32_t)(state->x[rs2]), 4);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoxorw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    Write32(state, state->x[rs1], (uint32_t)(t ^ state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 4, AmoXor);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoorw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    Write32(state, state->x[rs1], (uint32_t)(t | state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 4, AmoOr);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoandw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    Write32(state, state->x[rs1], (uint32_t)(t & state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 4, AmoAnd);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmominw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    if (t < state->x[rs2]) {
-        Write32(state, state->x[rs1], (uint32_t)t);
-    } else {
-        Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 4, AmoMin);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmomaxw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    if (t > state->x[rs2]) {
-        Write32(state, state->x[rs1], (uint32_t)t);
-    } else {
-        Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 4, AmoMax);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmominuw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    if ((uint64_t)t < (uint64_t)(state->x[rs2])) {
-        Write32(state, state->x[rs1], (uint32_t)t);
-    } else {
-        Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 4, AmoMinu);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmomaxuw(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Sext(Read32(state, state->x[rs1]), 31);
-    if ((uint64_t)t > (uint64_t)(state->x[rs2])) {
-        Write32(state, state->x[rs1], (uint32_t)t);
-    } else {
-        Write32(state, state->x[rs1], (uint32_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 4, AmoMaxu);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmoaddd(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(t + state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 8, AmoAdd);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoswapd(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 8, AmoSwap);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecLrd(State *state, uint32_t instr) {
@@ -2623,8 +3738,10 @@ void ExecLrd(State *state, uint32_t instr) {
     uint8_t rl = instr >> 25 & SetNBits(1);
     uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    state->x[rd] = t;
+    int64_t t = LoadReserved(state, state->x[rs1], 8);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecScd(State *state, uint32_t instr) {
@@ -2634,109 +3751,73 @@ void ExecScd(State *state, uint32_t instr) {
     uint8_t rl = instr >> 25 & SetNBits(1);
     uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
-    state->x[rd] = 0;
+    uint64_t t = StoreConditional(state, state->x[rs1], state->x[rs2], 8);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoxord(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(t ^ state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 8, AmoXor);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoord(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(t | state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 8, AmoOr);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmoandd(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    Write64(state, state->x[rs1], (uint64_t)(t & state->x[rs2]));
-    state->x[rd] = t;
+    int64_t t = Amo(state, instr, 8, AmoAnd);
+    if (!state->excepted) {
+        state->x[rd] = t;
+    }
 }
 
 void ExecAmomind(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    if (t < state->x[rs2]) {
-        Write64(state, state->x[rs1], (uint64_t)t);
-    } else {
-        Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 8, AmoMin);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmomaxd(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    if (t > state->x[rs2]) {
-        Write64(state, state->x[rs1], (uint64_t)t);
-    } else {
-        Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 8, AmoMax);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmominud(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    if ((uint64_t)t < (uint64_t)(state->x[rs2])) {
-        Write64(state, state->x[rs1], (uint64_t)t);
-    } else {
-        Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 8, AmoMinu);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmomaxud(State *state, uint32_t instr) {
     uint8_t rd = instr >> 7 & SetNBits(5);
-    uint8_t rs1 = instr >> 15 & SetNBits(5);
-    uint8_t rs2 = instr >> 20 & SetNBits(5);
-    uint8_t rl = instr >> 25 & SetNBits(1);
-    uint8_t aq = instr >> 26 & SetNBits(1);
 
-    int64_t t = Read64(state, state->x[rs1]);
-    if ((uint64_t)t > (uint64_t)(state->x[rs2])) {
-        Write64(state, state->x[rs1], (uint64_t)t);
-    } else {
-        Write64(state, state->x[rs1], (uint64_t)(state->x[rs2]));
+    int64_t t = Amo(state, instr, 8, AmoMaxu);
+    if (!state->excepted) {
+        state->x[rd] = t;
     }
-    state->x[rd] = t;
 }
 
 void ExecAmo(State *state, uint32_t instr) {
@@ -2779,7 +3860,7 @@ void ExecAmo(State *state, uint32_t instr) {
             ExecAmomaxuw(state, instr);
             break;
         default:
-            Error("Unknown amo instruction: %.2x", funct5);
+            IllegalInstr(state, instr);
             break;
         }
     } else if (funct3 == 0x3) {
@@ -2818,9 +3899,11 @@ void ExecAmo(State *state, uint32_t instr) {
             ExecAmomaxud(state, instr);
             break;
         default:
-            Error("Unknown amo instruction: %.2x", funct5);
+            IllegalInstr(state, instr);
             break;
         }
+    } else {
+        IllegalInstr(state, instr);
     }
 }
 
@@ -2901,7 +3984,7 @@ void ExecInstruction(State *state, uint32_t instr) {
         state->pc += sizeof(instr);
         break;
     default:
-        Error("Unknown opcode: 0x%.2x.", opcode);
+        IllegalInstr(state, instr);
         break;
     }
 }
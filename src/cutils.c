@@ -41,3 +41,17 @@ void SetVec(Vec *v, int idx, void *item) {
     free(v->data[idx]);
     v->data[idx] = item;
 }
+
+// Write the `len` bytes of `str` as the contents of a JSON string.
+void WriteJsonString(FILE *fp, const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t ch = str[i];
+        if (ch == '"' || ch == '\\') {
+            fprintf(fp, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(fp, "\\u%04x", ch);
+        } else {
+            putc(ch, fp);
+        }
+    }
+}
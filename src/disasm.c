@@ -0,0 +1,349 @@
+#include "rve.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// A disassembler for what rve executes (RV64IMAC, Zicsr, Zifencei and the
+// privileged instructions), for diagnostics. The syntax follows objdump,
+// with ABI register names and absolute branch targets.
+
+const char *reg_names[32] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0",
+    "a1", "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5",
+    "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+const char *RegName(uint32_t reg) {
+    return reg_names[reg & 31];
+}
+
+int64_t SignExtend(uint64_t val, int bits) {
+    return (int64_t)(val << (64 - bits)) >> (64 - bits);
+}
+
+void DisassembleCompressed(uint64_t pc, uint16_t instr, char *buf, size_t size) {
+    uint32_t funct3 = instr >> 13 & 7;
+    uint32_t rd = instr >> 7 & 31;
+    uint32_t rs2 = instr >> 2 & 31;
+    // The 3-bit register fields name x8-x15.
+    uint32_t rd_c = 8 + (instr >> 2 & 7);
+    uint32_t rs1_c = 8 + (instr >> 7 & 7);
+    int64_t imm6 = SignExtend((instr >> 12 & 1) << 5 | (instr >> 2 & 31), 6);
+    uint32_t shamt = (instr >> 12 & 1) << 5 | (instr >> 2 & 31);
+
+    switch ((instr & 3) << 3 | funct3) {
+    case 000:
+        if (instr == 0) {
+            break;
+        }
+        snprintf(buf, size, "c.addi4spn %s,sp,%u", RegName(rd_c),
+                 (instr >> 6 & 1) << 2 | (instr >> 5 & 1) << 3 | (instr >> 11 & 3) << 4 |
+                     (instr >> 7 & 15) << 6);
+        return;
+    case 002:
+        snprintf(buf, size, "c.lw %s,%u(%s)", RegName(rd_c),
+                 (instr >> 6 & 1) << 2 | (instr >> 10 & 7) << 3 | (instr >> 5 & 1) << 6, RegName(rs1_c));
+        return;
+    case 003:
+        snprintf(buf, size, "c.ld %s,%u(%s)", RegName(rd_c), (instr >> 10 & 7) << 3 | (instr >> 5 & 3) << 6,
+                 RegName(rs1_c));
+        return;
+    case 006:
+        snprintf(buf, size, "c.sw %s,%u(%s)", RegName(rd_c),
+                 (instr >> 6 & 1) << 2 | (instr >> 10 & 7) << 3 | (instr >> 5 & 1) << 6, RegName(rs1_c));
+        return;
+    case 007:
+        snprintf(buf, size, "c.sd %s,%u(%s)", RegName(rd_c), (instr >> 10 & 7) << 3 | (instr >> 5 & 3) << 6,
+                 RegName(rs1_c));
+        return;
+    case 010:
+        if (rd == 0) {
+            snprintf(buf, size, "c.nop");
+        } else {
+            snprintf(buf, size, "c.addi %s,%lld", RegName(rd), (long long)imm6);
+        }
+        return;
+    case 011:
+        snprintf(buf, size, "c.addiw %s,%lld", RegName(rd), (long long)imm6);
+        return;
+    case 012:
+        snprintf(buf, size, "c.li %s,%lld", RegName(rd), (long long)imm6);
+        return;
+    case 013:
+        if (rd == 2) {
+            int64_t imm = SignExtend((instr >> 12 & 1) << 9 | (instr >> 6 & 1) << 4 | (instr >> 5 & 1) << 6 |
+                                         (instr >> 3 & 3) << 7 | (instr >> 2 & 1) << 5,
+                                     10);
+            snprintf(buf, size, "c.addi16sp sp,%lld", (long long)imm);
+        } else {
+            snprintf(buf, size, "c.lui %s,0x%llx", RegName(rd), (unsigned long long)(imm6 & 0xfffff));
+        }
+        return;
+    case 014: {
+        const char *ops[8] = {"c.sub", "c.xor", "c.or", "c.and", "c.subw", "c.addw", NULL, NULL};
+        switch (instr >> 10 & 3) {
+        case 0:
+            snprintf(buf, size, "c.srli %s,%u", RegName(rs1_c), shamt);
+            return;
+        case 1:
+            snprintf(buf, size, "c.srai %s,%u", RegName(rs1_c), shamt);
+            return;
+        case 2:
+            snprintf(buf, size, "c.andi %s,%lld", RegName(rs1_c), (long long)imm6);
+            return;
+        default: {
+            const char *op = ops[(instr >> 12 & 1) << 2 | (instr >> 5 & 3)];
+            if (op == NULL) {
+                break;
+            }
+            snprintf(buf, size, "%s %s,%s", op, RegName(rs1_c), RegName(rd_c));
+            return;
+        }
+        }
+        break;
+    }
+    case 015: {
+        int64_t imm = SignExtend((instr >> 12 & 1) << 11 | (instr >> 11 & 1) << 4 | (instr >> 9 & 3) << 8 |
+                                     (instr >> 8 & 1) << 10 | (instr >> 7 & 1) << 6 | (instr >> 6 & 1) << 7 |
+                                     (instr >> 3 & 7) << 1 | (instr >> 2 & 1) << 5,
+                                 12);
+        snprintf(buf, size, "c.j 0x%llx", (unsigned long long)(pc + imm));
+        return;
+    }
+    case 016:
+    case 017: {
+        int64_t imm = SignExtend((instr >> 12 & 1) << 8 | (instr >> 10 & 3) << 3 | (instr >> 5 & 3) << 6 |
+                                     (instr >> 3 & 3) << 1 | (instr >> 2 & 1) << 5,
+                                 9);
+        snprintf(buf, size, "%s %s,0x%llx", funct3 == 6 ? "c.beqz" : "c.bnez", RegName(rs1_c),
+                 (unsigned long long)(pc + imm));
+        return;
+    }
+    case 020:
+        snprintf(buf, size, "c.slli %s,%u", RegName(rd), shamt);
+        return;
+    case 022:
+        snprintf(buf, size, "c.lwsp %s,%u(sp)", RegName(rd),
+                 (instr >> 12 & 1) << 5 | (instr >> 4 & 7) << 2 | (instr >> 2 & 3) << 6);
+        return;
+    case 023:
+        snprintf(buf, size, "c.ldsp %s,%u(sp)", RegName(rd),
+                 (instr >> 12 & 1) << 5 | (instr >> 5 & 3) << 3 | (instr >> 2 & 7) << 6);
+        return;
+    case 024:
+        if ((instr >> 12 & 1) == 0) {
+            if (rs2 == 0) {
+                snprintf(buf, size, "c.jr %s", RegName(rd));
+            } else {
+                snprintf(buf, size, "c.mv %s,%s", RegName(rd), RegName(rs2));
+            }
+        } else if (rd == 0 && rs2 == 0) {
+            snprintf(buf, size, "c.ebreak");
+        } else if (rs2 == 0) {
+            snprintf(buf, size, "c.jalr %s", RegName(rd));
+        } else {
+            snprintf(buf, size, "c.add %s,%s", RegName(rd), RegName(rs2));
+        }
+        return;
+    case 026:
+        snprintf(buf, size, "c.swsp %s,%u(sp)", RegName(rs2), (instr >> 9 & 15) << 2 | (instr >> 7 & 3) << 6);
+        return;
+    case 027:
+        snprintf(buf, size, "c.sdsp %s,%u(sp)", RegName(rs2), (instr >> 10 & 7) << 3 | (instr >> 7 & 7) << 6);
+        return;
+    }
+    snprintf(buf, size, "unknown 0x%04x", instr);
+}
+
+const char *AmoName(uint32_t funct5) {
+    switch (funct5) {
+    case 0x00:
+        return "amoadd";
+    case 0x01:
+        return "amoswap";
+    case 0x02:
+        return "lr";
+    case 0x03:
+        return "sc";
+    case 0x04:
+        return "amoxor";
+    case 0x08:
+        return "amoor";
+    case 0x0c:
+        return "amoand";
+    case 0x10:
+        return "amomin";
+    case 0x14:
+        return "amomax";
+    case 0x18:
+        return "amominu";
+    case 0x1c:
+        return "amomaxu";
+    }
+    return NULL;
+}
+
+// Write the assembly of the instruction `instr` at `pc` into `buf`.
+// Compressed instructions are in the lower 16 bits.
+void Disassemble(uint64_t pc, uint32_t instr, char *buf, size_t size) {
+    if ((instr & 3) != 3) {
+        DisassembleCompressed(pc, instr, buf, size);
+        return;
+    }
+    uint32_t opcode = instr & 0x7f;
+    uint32_t rd = instr >> 7 & 31;
+    uint32_t funct3 = instr >> 12 & 7;
+    uint32_t rs1 = instr >> 15 & 31;
+    uint32_t rs2 = instr >> 20 & 31;
+    uint32_t funct7 = instr >> 25;
+    int64_t imm_i = SignExtend(instr >> 20, 12);
+    int64_t imm_s = SignExtend((instr >> 25) << 5 | rd, 12);
+    const char *name = NULL;
+
+    switch (opcode) {
+    case 0x37:
+    case 0x17:
+        snprintf(buf, size, "%s %s,0x%x", opcode == 0x37 ? "lui" : "auipc", RegName(rd), instr >> 12);
+        return;
+    case 0x6f: {
+        int64_t imm = SignExtend((instr >> 31) << 20 | (instr >> 12 & 0xff) << 12 | (instr >> 20 & 1) << 11 |
+                                     (instr >> 21 & 0x3ff) << 1,
+                                 21);
+        snprintf(buf, size, "jal %s,0x%llx", RegName(rd), (unsigned long long)(pc + imm));
+        return;
+    }
+    case 0x67:
+        if (funct3 != 0) {
+            break;
+        }
+        snprintf(buf, size, "jalr %s,%lld(%s)", RegName(rd), (long long)imm_i, RegName(rs1));
+        return;
+    case 0x63: {
+        const char *names[8] = {"beq", "bne", NULL, NULL, "blt", "bge", "bltu", "bgeu"};
+        int64_t imm = SignExtend((instr >> 31) << 12 | (instr >> 7 & 1) << 11 | (instr >> 25 & 0x3f) << 5 |
+                                     (instr >> 8 & 15) << 1,
+                                 13);
+        if (names[funct3] == NULL) {
+            break;
+        }
+        snprintf(buf, size, "%s %s,%s,0x%llx", names[funct3], RegName(rs1), RegName(rs2),
+                 (unsigned long long)(pc + imm));
+        return;
+    }
+    case 0x03: {
+        const char *names[8] = {"lb", "lh", "lw", "ld", "lbu", "lhu", "lwu", NULL};
+        if (names[funct3] == NULL) {
+            break;
+        }
+        snprintf(buf, size, "%s %s,%lld(%s)", names[funct3], RegName(rd), (long long)imm_i, RegName(rs1));
+        return;
+    }
+    case 0x23: {
+        const char *names[8] = {"sb", "sh", "sw", "sd", NULL, NULL, NULL, NULL};
+        if (names[funct3] == NULL) {
+            break;
+        }
+        snprintf(buf, size, "%s %s,%lld(%s)", names[funct3], RegName(rs2), (long long)imm_s, RegName(rs1));
+        return;
+    }
+    case 0x13:
+    case 0x1b: {
+        bool word = opcode == 0x1b;
+        const char *names[8] = {"addi", "slli", "slti", "sltiu", "xori", "srli", "ori", "andi"};
+        const char *word_names[8] = {"addiw", "slliw", NULL, NULL, NULL, "srliw", NULL, NULL};
+        name = word ? word_names[funct3] : names[funct3];
+        if (name == NULL) {
+            break;
+        }
+        if (funct3 == 1 || funct3 == 5) {
+            uint32_t shamt = instr >> 20 & (word ? 31 : 63);
+            uint32_t funct6 = instr >> 26;
+            if (funct3 == 5 && funct6 == 0x10) {
+                name = word ? "sraiw" : "srai";
+            } else if (funct6 != 0 || (word && (instr >> 25 & 1))) {
+                break;
+            }
+            snprintf(buf, size, "%s %s,%s,%u", name, RegName(rd), RegName(rs1), shamt);
+            return;
+        }
+        snprintf(buf, size, "%s %s,%s,%lld", name, RegName(rd), RegName(rs1), (long long)imm_i);
+        return;
+    }
+    case 0x33:
+    case 0x3b: {
+        bool word = opcode == 0x3b;
+        const char *base[8] = {"add", "sll", "slt", "sltu", "xor", "srl", "or", "and"};
+        const char *muldiv[8] = {"mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu"};
+        const char *base_w[8] = {"addw", "sllw", NULL, NULL, NULL, "srlw", NULL, NULL};
+        const char *muldiv_w[8] = {"mulw", NULL, NULL, NULL, "divw", "divuw", "remw", "remuw"};
+        if (funct7 == 0) {
+            name = word ? base_w[funct3] : base[funct3];
+        } else if (funct7 == 1) {
+            name = word ? muldiv_w[funct3] : muldiv[funct3];
+        } else if (funct7 == 0x20 && funct3 == 0) {
+            name = word ? "subw" : "sub";
+        } else if (funct7 == 0x20 && funct3 == 5) {
+            name = word ? "sraw" : "sra";
+        }
+        if (name == NULL) {
+            break;
+        }
+        snprintf(buf, size, "%s %s,%s,%s", name, RegName(rd), RegName(rs1), RegName(rs2));
+        return;
+    }
+    case 0x0f:
+        if (funct3 == 0) {
+            snprintf(buf, size, "fence");
+            return;
+        } else if (funct3 == 1) {
+            snprintf(buf, size, "fence.i");
+            return;
+        }
+        break;
+    case 0x73: {
+        const char *csr_names[8] = {NULL, "csrrw", "csrrs", "csrrc", NULL, "csrrwi", "csrrsi", "csrrci"};
+        if (funct3 == 0) {
+            if (instr == 0x00000073) {
+                snprintf(buf, size, "ecall");
+            } else if (instr == 0x00100073) {
+                snprintf(buf, size, "ebreak");
+            } else if (instr == 0x10200073) {
+                snprintf(buf, size, "sret");
+            } else if (instr == 0x30200073) {
+                snprintf(buf, size, "mret");
+            } else if (instr == 0x10500073) {
+                snprintf(buf, size, "wfi");
+            } else if (funct7 == 0x09 && rd == 0) {
+                snprintf(buf, size, "sfence.vma %s,%s", RegName(rs1), RegName(rs2));
+            } else {
+                break;
+            }
+            return;
+        }
+        if (csr_names[funct3] == NULL) {
+            break;
+        }
+        if (funct3 < 4) {
+            snprintf(buf, size, "%s %s,0x%x,%s", csr_names[funct3], RegName(rd), instr >> 20, RegName(rs1));
+        } else {
+            snprintf(buf, size, "%s %s,0x%x,%u", csr_names[funct3], RegName(rd), instr >> 20, rs1);
+        }
+        return;
+    }
+    case 0x2f: {
+        name = AmoName(instr >> 27);
+        if (name == NULL || (funct3 != 2 && funct3 != 3) || (instr >> 27 == 0x02 && rs2 != 0)) {
+            break;
+        }
+        const char *order[4] = {"", ".rl", ".aq", ".aqrl"};
+        const char *width = funct3 == 2 ? ".w" : ".d";
+        if (instr >> 27 == 0x02) {
+            snprintf(buf, size, "%s%s%s %s,(%s)", name, width, order[instr >> 25 & 3], RegName(rd), RegName(rs1));
+        } else {
+            snprintf(buf, size, "%s%s%s %s,%s,(%s)", name, width, order[instr >> 25 & 3], RegName(rd),
+                     RegName(rs2), RegName(rs1));
+        }
+        return;
+    }
+    }
+    snprintf(buf, size, "unknown 0x%08x", instr);
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Disk images.
+//
+// A plain image is mapped privately: the guest sees its own copy, writes are
+// never stored back, and the pages are shared with the page cache until they
+// are written.
+//
+// An overlay disk stacks a per-instance overlay file on a read-only base image
+// shared by all instances. The overlay file is laid out as
+//
+//   [header][allocation bitmap][cluster 0][cluster 1]...
+//
+// Cluster i lives at a fixed offset so the file stays sparse; the bitmap tells
+// whether a cluster has been copied up from the base image. A cluster's data
+// reaches the disk before its bit does, so that a crash never leaves a bit set
+// for a cluster that wasn't written.
+
+#define OVERLAY_MAGIC "RVEOVL1"
+#define OVERLAY_HEADER_SIZE 4096
+#define OVERLAY_CLUSTER_BITS 16
+// Clusters of 512 bytes to 2 MiB.
+#define OVERLAY_MIN_CLUSTER_BITS 9
+#define OVERLAY_MAX_CLUSTER_BITS 21
+
+typedef struct OverlayHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint64_t disk_size;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+} OverlayHeader;
+
+uint8_t *MapFile(const char *name, bool writable_copy, uint64_t *size) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        Error("Can't open the file: %s.", name);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        Error("Can't stat the file: %s.", name);
+    }
+    *size = st.st_size;
+
+    int prot = PROT_READ | (writable_copy ? PROT_WRITE : 0);
+    int flags = writable_copy ? MAP_PRIVATE : MAP_SHARED;
+    uint8_t *map = mmap(NULL, st.st_size ? st.st_size : 1, prot, flags, fd, 0);
+    if (map == MAP_FAILED) {
+        Error("Can't map the file: %s.", name);
+    }
+    close(fd);
+    return map;
+}
+
+void OpenOverlay(Disk *disk, const char *name) {
+    int fd = open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        Error("Can't open the overlay: %s.", name);
+    }
+
+    OverlayHeader header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    if (n == 0) {
+        // A new overlay: every cluster still comes from the base image.
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.cluster_bits = OVERLAY_CLUSTER_BITS;
+        header.disk_size = disk->size;
+        header.bitmap_offset = OVERLAY_HEADER_SIZE;
+        uint64_t clusters = (disk->size + SetOneBit(OVERLAY_CLUSTER_BITS) - 1) >> OVERLAY_CLUSTER_BITS;
+        uint64_t bitmap_size = (clusters + 7) / 8;
+        header.data_offset = (header.bitmap_offset + bitmap_size + PAGESIZE - 1) & ~(uint64_t)(PAGESIZE - 1);
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(fd, header.data_offset) < 0) {
+            Error("Can't initialize the overlay: %s.", name);
+        }
+    } else if (n != sizeof(header) || memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic))) {
+        Error("Not an overlay file: %s.", name);
+    } else if (header.disk_size != disk->size) {
+        Error("The overlay %s doesn't match the size of its base image.", name);
+    } else if (header.cluster_bits < OVERLAY_MIN_CLUSTER_BITS || header.cluster_bits > OVERLAY_MAX_CLUSTER_BITS) {
+        Error("Invalid cluster size in the overlay: %s.", name);
+    }
+
+    disk->overlay_fd = fd;
+    disk->cluster_bits = header.cluster_bits;
+    disk->bitmap_offset = header.bitmap_offset;
+    disk->data_offset = header.data_offset;
+    uint64_t clusters = (disk->size + SetOneBit(disk->cluster_bits) - 1) >> disk->cluster_bits;
+    disk->bitmap_size = (clusters + 7) / 8;
+    if (disk->bitmap_offset < sizeof(header) || disk->data_offset < disk->bitmap_offset ||
+        disk->data_offset - disk->bitmap_offset < disk->bitmap_size) {
+        Error("Invalid layout of the overlay: %s.", name);
+    }
+    disk->bitmap = calloc(1, disk->bitmap_size);
+    if (pread(fd, disk->bitmap, disk->bitmap_size, disk->bitmap_offset) < 0) {
+        Error("Can't read the overlay bitmap: %s.", name);
+    }
+}
+
+// Open the image `name`. If `overlay` isn't NULL, the image is used as the
+// read-only base of the overlay file `overlay`, which is created if missing.
+Disk *OpenDisk(const char *name, const char *overlay) {
+    Disk *disk = calloc(1, sizeof(Disk));
+    disk->overlay_fd = -1;
+    disk->base = MapFile(name, overlay == NULL, &disk->size);
+    if (overlay != NULL) {
+        OpenOverlay(disk, overlay);
+    }
+    return disk;
+}
+
+bool IsClusterAllocated(Disk *disk, uint64_t cluster) {
+    return disk->bitmap[cluster / 8] >> (cluster % 8) & 1;
+}
+
+uint64_t ClusterOffset(Disk *disk, uint64_t cluster) {
+    return disk->data_offset + (cluster << disk->cluster_bits);
+}
+
+void OverlayIo(Disk *disk, bool is_write, void *buf, uint64_t len, uint64_t offset) {
+    ssize_t n = is_write ? pwrite(disk->overlay_fd, buf, len, offset)
+                         : pread(disk->overlay_fd, buf, len, offset);
+    if (n < 0 || (uint64_t)n != len) {
+        // A read may be short if the end of the sparse file was never written.
+        if (!is_write && n >= 0) {
+            memset((uint8_t *)buf + n, 0, len - n);
+            return;
+        }
+        Error("Overlay I/O failed: %s", strerror(errno));
+    }
+}
+
+// Read `len` bytes at `offset` of the disk into `buf`.
+void DiskRead(Disk *disk, uint64_t offset, uint8_t *buf, uint64_t len) {
+    if (disk->overlay_fd < 0) {
+        memcpy(buf, disk->base + offset, len);
+        return;
+    }
+
+    uint64_t cluster_size = SetOneBit(disk->cluster_bits);
+    while (len > 0) {
+        uint64_t cluster = offset >> disk->cluster_bits;
+        uint64_t in_cluster = offset & (cluster_size - 1);
+        uint64_t n = cluster_size - in_cluster;
+        if (n > len) {
+            n = len;
+        }
+        if (IsClusterAllocated(disk, cluster)) {
+            OverlayIo(disk, false, buf, n, ClusterOffset(disk, cluster) + in_cluster);
+        } else {
+            memcpy(buf, disk->base + offset, n);
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+// Write `len` bytes of `buf` at `offset` of the disk.
+void DiskWrite(Disk *disk, uint64_t offset, uint8_t *buf, uint64_t len) {
+    if (disk->overlay_fd < 0) {
+        memcpy(disk->base + offset, buf, len);
+        return;
+    }
+
+    uint64_t cluster_size = SetOneBit(disk->cluster_bits);
+    while (len > 0) {
+        uint64_t cluster = offset >> disk->cluster_bits;
+        uint64_t in_cluster = offset & (cluster_size - 1);
+        uint64_t n = cluster_size - in_cluster;
+        if (n > len) {
+            n = len;
+        }
+        if (!IsClusterAllocated(disk, cluster) && n != cluster_size) {
+            // Copy the untouched part of the cluster up from the base image.
+            uint64_t base_offset = cluster << disk->cluster_bits;
+            uint64_t base_len = disk->size - base_offset < cluster_size ? disk->size - base_offset : cluster_size;
+            OverlayIo(disk, true, disk->base + base_offset, base_len, ClusterOffset(disk, cluster));
+        }
+        OverlayIo(disk, true, buf, n, ClusterOffset(disk, cluster) + in_cluster);
+        if (!IsClusterAllocated(disk, cluster)) {
+            // The bitmap is updated only after the cluster data is on disk.
+            if (fdatasync(disk->overlay_fd) < 0) {
+                Error("Overlay I/O failed: %s", strerror(errno));
+            }
+            disk->bitmap[cluster / 8] |= 1 << (cluster % 8);
+            OverlayIo(disk, true, &disk->bitmap[cluster / 8], 1, disk->bitmap_offset + cluster / 8);
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+void DiskFlush(Disk *disk) {
+    if (disk != NULL && disk->overlay_fd >= 0) {
+        fdatasync(disk->overlay_fd);
+    }
+}
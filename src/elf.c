@@ -1,7 +1,7 @@
 #include "elf.h"
 #include "rve.h"
 
-uint64_t LoadElf(State *state, size_t size, uint8_t *bin) {
+uint64_t LoadElf(State *state, size_t size, uint8_t *bin, bool verbose) {
     Elf64_Ehdr *ehdr = (Elf64_Ehdr *)bin;
 
     if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
@@ -28,7 +28,9 @@ uint64_t LoadElf(State *state, size_t size, uint8_t *bin) {
             uint8_t *text = (uint8_t *)(bin + shdr->sh_offset);
             size_t text_size = shdr->sh_size;
             char *name = (strtab + shdr->sh_name);
-            printf("%s: 0x%llx\n", name, virtual_addr);
+            if (verbose) {
+                printf("%s: 0x%llx\n", name, virtual_addr);
+            }
             if (!strcmp(name, ".text")) {
                 text_addr = virtual_addr;
             }
@@ -39,3 +41,26 @@ uint64_t LoadElf(State *state, size_t size, uint8_t *bin) {
 
     return ehdr->e_entry;
 }
+
+// The value of the symbol `name`, or 0 if the ELF file has no such symbol.
+uint64_t ElfSymbol(size_t size, uint8_t *bin, const char *name) {
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)bin;
+    if (size < sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+        ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+        return 0;
+    }
+    Elf64_Shdr *shdrs = (Elf64_Shdr *)(bin + ehdr->e_shoff);
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type != SHT_SYMTAB || shdrs[i].sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+        Elf64_Sym *syms = (Elf64_Sym *)(bin + shdrs[i].sh_offset);
+        char *strtab = (char *)(bin + shdrs[shdrs[i].sh_link].sh_offset);
+        for (uint64_t j = 0; j < shdrs[i].sh_size / sizeof(Elf64_Sym); j++) {
+            if (!strcmp(strtab + syms[j].st_name, name)) {
+                return syms[j].st_value;
+            }
+        }
+    }
+    return 0;
+}
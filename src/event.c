@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Event scheduler.
+//
+// Devices that need to act at a point in the future (the CLINT timer, ...)
+// schedule an event at a deadline on `state->clock` instead of checking
+// their condition on every tick. Each event kind has at most one pending
+// deadline, kept in a binary min-heap indexed by kind, so that Tick only
+// compares the clock with `next` and rescheduling is O(log n).
+
+Scheduler *NewScheduler() {
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    for (int i = 0; i < EVENT_MAX; i++) {
+        scheduler->pos[i] = -1;
+    }
+    scheduler->next = UINT64_MAX;
+    scheduler->wake_fd = NewWakeFd();
+    return scheduler;
+}
+
+void SetEventHandler(Scheduler *scheduler, int kind, void (*handler)(State *state, int kind)) {
+    scheduler->handler[kind] = handler;
+}
+
+void SwapEvents(Scheduler *scheduler, int i, int j) {
+    Event tmp = scheduler->heap[i];
+    scheduler->heap[i] = scheduler->heap[j];
+    scheduler->heap[j] = tmp;
+    scheduler->pos[scheduler->heap[i].kind] = i;
+    scheduler->pos[scheduler->heap[j].kind] = j;
+}
+
+void SiftUp(Scheduler *scheduler, int i) {
+    while (i > 0 && scheduler->heap[(i - 1) / 2].deadline > scheduler->heap[i].deadline) {
+        SwapEvents(scheduler, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void SiftDown(Scheduler *scheduler, int i) {
+    for (;;) {
+        int min = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        if (left < scheduler->len && scheduler->heap[left].deadline < scheduler->heap[min].deadline) {
+            min = left;
+        }
+        if (right < scheduler->len && scheduler->heap[right].deadline < scheduler->heap[min].deadline) {
+            min = right;
+        }
+        if (min == i) {
+            return;
+        }
+        SwapEvents(scheduler, i, min);
+        i = min;
+    }
+}
+
+void UpdateNextEvent(Scheduler *scheduler) {
+    scheduler->next = scheduler->len ? scheduler->heap[0].deadline : UINT64_MAX;
+}
+
+void CancelEvent(Scheduler *scheduler, int kind) {
+    int i = scheduler->pos[kind];
+    if (i < 0) {
+        return;
+    }
+    scheduler->len--;
+    if (i != scheduler->len) {
+        SwapEvents(scheduler, i, scheduler->len);
+        SiftUp(scheduler, i);
+        SiftDown(scheduler, i);
+    }
+    scheduler->pos[kind] = -1;
+    UpdateNextEvent(scheduler);
+}
+
+// Run the handler of `kind` once `state->clock` reaches `deadline`,
+// replacing any deadline that was pending for it.
+void ScheduleEvent(Scheduler *scheduler, int kind, uint64_t deadline) {
+    CancelEvent(scheduler, kind);
+    int i = scheduler->len++;
+    scheduler->heap[i].kind = kind;
+    scheduler->heap[i].deadline = deadline;
+    scheduler->pos[kind] = i;
+    SiftUp(scheduler, i);
+    UpdateNextEvent(scheduler);
+}
+
+// Fire every event whose deadline has passed. Handlers may schedule again.
+void RunEvents(State *state) {
+    Scheduler *scheduler = state->scheduler;
+    while (scheduler->len > 0 && scheduler->heap[0].deadline <= state->clock) {
+        int kind = scheduler->heap[0].kind;
+        CancelEvent(scheduler, kind);
+        scheduler->handler[kind](state, kind);
+    }
+}
+
+// Host monotonic time in nanoseconds.
+uint64_t HostNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// An eventfd that other threads signal to wake a hart up.
+int NewWakeFd() {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        Error("Can't create an eventfd: %s", strerror(errno));
+    }
+    return fd;
+}
+
+// Block until the wake eventfd `fd` is signaled or `timeout_ns` passes; a
+// negative timeout waits forever.
+void WaitForWake(int fd, int64_t timeout_ns) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    struct timespec ts = {.tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000};
+    if (ppoll(&pfd, 1, timeout_ns < 0 ? NULL : &ts, NULL) > 0) {
+        uint64_t count;
+        read(fd, &count, sizeof(count));
+    }
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+void Error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+Uart *NewUart() {
+    Uart *uart = calloc(1, sizeof(Uart));
+    uart->lsr |= 0x20;
+    return uart;
+}
+
+Clint *NewClint() {
+    Clint *clint = calloc(1, sizeof(Clint));
+    for (int i = 0; i < CLINT_HARTS; i++) {
+        clint->mtimecmp[i] = UINT64_MAX;
+    }
+    clint->timebase = TimebaseInstret;
+    clint->divisor = 1;
+    clint->freq = 10000000;
+    return clint;
+}
+
+Virtio *NewVirtio(uint32_t device_id) {
+    Virtio *virtio = calloc(1, sizeof(Virtio));
+    virtio->device_id = device_id;
+    ResetVirtio(virtio);
+    SetVirtioVersion(virtio, 2);
+    return virtio;
+}
+
+State *NewState(size_t mem_size) {
+    State *state = calloc(1, sizeof(State));
+    state->mem = calloc(1, mem_size);
+    state->mem_size = mem_size;
+    state->code_gen = calloc(mem_size / PAGESIZE + 1, sizeof(uint32_t));
+    return state;
+}
+
+void FreeState(State *state) {
+    close(state->scheduler->wake_fd);
+    free(state->scheduler);
+    free(state->uart);
+    free(state->clint);
+    free(state->plic);
+    free(state->virtio);
+    free(state->code_gen);
+    free(state->mem);
+    free(state);
+}
+
+void ResetState(State *state) {
+    memset(state->x, 0, sizeof(state->x));
+    state->pc = 0;
+    state->excepted = false;
+    state->exception_code = 0;
+    state->exception_value = 0;
+    memset(state->csr, 0, sizeof(state->csr));
+    state->mode = MACHINE;
+    state->uart = NewUart();
+    state->clint = NewClint();
+    state->plic = NewPlic();
+    state->scheduler = NewScheduler();
+    for (int i = 0; i < CLINT_HARTS; i++) {
+        SetEventHandler(state->scheduler, EventTimer + i, TimerEvent);
+    }
+    state->virtio = NewVirtio(VIRTIO_ID_BLOCK);
+    state->virtio->notify = BlockNotify;
+    memset(state->virtio_slots, 0, sizeof(state->virtio_slots));
+    state->virtio_slots[VIRTIO_BLOCK_SLOT] = state->virtio;
+    WriteCSR(state, SSTATUS, 32, 33, 2);
+    state->idle_skip = true;
+    state->hart_id = 0;
+    state->wake_fd = state->scheduler->wake_fd;
+    state->irq_mip = 0;
+    state->irq_sip = 0;
+    FlushTlb(state);
+    FlushICache(state);
+}
+
+// A hart that shares the memory and the devices of `boot`.
+State *NewHart(State *boot, uint32_t id) {
+    State *hart = malloc(sizeof(State));
+    *hart = *boot;
+    memset(hart->x, 0, sizeof(hart->x));
+    memset(hart->csr, 0, sizeof(hart->csr));
+    memset(&hart->loop, 0, sizeof(hart->loop));
+    hart->pc = 0;
+    hart->clock = 0;
+    hart->instret = 0;
+    hart->max_instret = 0;
+    hart->mode = MACHINE;
+    hart->excepted = false;
+    hart->exception_code = 0;
+    hart->exception_value = 0;
+    // Only hart 0 keeps the time, so only it may skip idle loops.
+    hart->idle_skip = false;
+    hart->hart_id = id;
+    hart->csr[MHARTID] = id;
+    WriteCSR(hart, SSTATUS, 32, 33, 2);
+    hart->irq_mip = 0;
+    hart->irq_sip = 0;
+    hart->wake_fd = NewWakeFd();
+    hart->parked = false;
+    hart->halted = false;
+    hart->waiting = false;
+    hart->store_log = NULL;
+    FlushTlb(hart);
+    FlushICache(hart);
+    return hart;
+}
+
+// Turn `state` into hart 0 of `nharts` harts. Called before the harts run.
+void StartHarts(State *state, int nharts) {
+    if (nharts < 1 || nharts > PLIC_HARTS) {
+        Error("Invalid number of harts: %d", nharts);
+    }
+    if (nharts == 1) {
+        return;
+    }
+    state->nharts = nharts;
+    state->harts = calloc(nharts, sizeof(State *));
+    state->harts[0] = state;
+    // Harts that take turns on one thread don't need the device lock.
+    if (state->quantum == 0) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        // Device handlers may access guest memory that turns out to be MMIO.
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        state->device_lock = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(state->device_lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    for (int i = 1; i < nharts; i++) {
+        state->harts[i] = NewHart(state, i);
+    }
+}
+
+void LoadBinaryIntoMemory(State *state, uint8_t *bin, size_t bin_size,
+                          uint64_t load_addr) {
+    memcpy(state->mem + load_addr, bin, bin_size);
+}
+
+size_t ReadBinaryFile(const char *name, uint8_t **buf) {
+    FILE *fp = fopen(name, "rb");
+    if (fp == NULL) {
+        Error("Can't open the file: %s.", name);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size_t size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *result = malloc(size);
+    fread(result, size, 1, fp);
+    *buf = result;
+    fclose(fp);
+    return size;
+}
+
+void CPUMain(State *state, uint64_t start_addr, size_t code_size,
+             bool is_debug) {
+    uint64_t count = 0;
+    state->pc = start_addr;
+    for (;;) {
+        uint64_t bpc = state->pc;
+        count++;
+        if (is_debug && count >= 10000)
+            return;
+        
+        // printf("pc: %llx\n", state->pc);
+        Tick(state);
+        if (state->halted || (state->max_instret != 0 && state->instret >= state->max_instret)) {
+            return;
+        }
+        if (state->pc == 0) {
+            // printf("pc: %llx -> 0, sp: %llx\n", Translate(state, bpc, AccessInstruction), state->x[2]);
+        }
+    }
+}
+
+// Run every hart on this thread, each for `quantum` instructions in turn in
+// the order of the hart ids. Nothing depends on the host scheduler, so runs
+// are repeatable. A smaller quantum interleaves the harts more finely.
+//
+// A hart in WFI is skipped until an interrupt is pending, and time keeps
+// passing on hart 0 as if it ran its whole quantum. When every hart waits,
+// hart 0 idles like a single hart in WFI.
+void RunQuanta(State *state, bool is_debug) {
+    uint64_t count = 0;
+    for (;;) {
+        bool idle = true;
+        for (int i = 0; i < NumHarts(state); i++) {
+            State *hart = HartById(state, i);
+            if (hart->halted) {
+                continue;
+            }
+            if (hart->waiting) {
+                MergeIrq(hart);
+                if (!IsInterruptPending(hart)) {
+                    if (i == 0) {
+                        hart->clock += state->quantum;
+                        TickDevices(hart);
+                    }
+                    continue;
+                }
+                hart->waiting = false;
+            }
+            idle = false;
+            uint64_t n = 0;
+            while (n < state->quantum && !hart->waiting && !hart->halted) {
+                Tick(hart);
+                n++;
+                if (i == 0 && (state->halted || (is_debug && ++count >= 10000) ||
+                               (state->max_instret != 0 && state->instret >= state->max_instret))) {
+                    return;
+                }
+            }
+            if (i == 0 && n < state->quantum) {
+                hart->clock += state->quantum - n;
+                TickDevices(hart);
+            }
+        }
+        if (idle) {
+            IdleMachine(state, HasPolledDevices(state));
+        }
+    }
+}
+
+// Write the statistics of a run that took `nanos` of host time to the file
+// `name` as a JSON object, for scripts that compare runs.
+void WriteStats(State *state, const char *name, const char *program, uint64_t nanos) {
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL) {
+        Error("Can't open the file: %s.", name);
+    }
+    uint64_t instret = 0;
+    for (int i = 0; i < NumHarts(state); i++) {
+        instret += __atomic_load_n(&HartById(state, i)->instret, __ATOMIC_RELAXED);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double seconds = nanos / 1e9;
+    fputs("{\"program\": \"", fp);
+    WriteJsonString(fp, program, strlen(program));
+    fprintf(fp, "\", \"harts\": %d, \"instret\": %llu, \"host_seconds\": %.6f, \"mips\": %.2f, "
+                "\"peak_rss_kb\": %ld}\n",
+            NumHarts(state), (unsigned long long)instret, seconds,
+            seconds > 0 ? instret / seconds / 1e6 : 0, usage.ru_maxrss);
+    fclose(fp);
+}
+
+void *RunHart(void *arg) {
+    State *hart = arg;
+    CPUMain(hart, hart->pc, 0, false);
+    return NULL;
+}
+
+void PrintRegisters(State *state, bool is_debug) {
+    for (int i = 0; i < 32; i++) {
+        printf("x%d:\t %lld\n", i, state->x[i]);
+    }
+    printf("pc: %llx\n", state->pc);
+}
+
+void SetDisk(State *state, Disk *disk) {
+    state->virtio->disk = disk;
+    // The capacity in 512-byte sectors is the first field of the config space.
+    uint64_t capacity = disk->size / SECTOR_SIZE;
+    memcpy(state->virtio->config, &capacity, sizeof(capacity));
+}
@@ -1,119 +1,10 @@
 #include "rve.h"
-#include <stdarg.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <curses.h>
-
-void Error(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    fprintf(stderr, "Error: ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    va_end(ap);
-    exit(1);
-}
-
-Uart *NewUart() {
-    Uart *uart = calloc(1, sizeof(Uart));
-    WINDOW *w = initscr();
-    cbreak();
-    nodelay(w, true);
-    noecho();
-    scrollok(w, true);
-    uart->lsr |= 0x20;
-    return uart;
-}
-
-Clint *NewClint() {
-    Clint *clint = calloc(1, sizeof(Clint));
-    return clint;
-}
-
-Plic *NewPlic() {
-    Plic *plic = calloc(1, sizeof(Plic));
-    return plic;
-}
-
-Virtio *NewVirtio() {
-    Virtio *virtio = calloc(1, sizeof(Virtio));
-    virtio->queue_align = 0x1000;
-    virtio->queue_notify = 0x1234;
-    return virtio;
-}
-
-State *NewState(size_t mem_size) {
-    State *state = calloc(1, sizeof(State));
-    state->mem = calloc(1, mem_size);
-    return state;
-}
-
-void ResetState(State *state) {
-    memset(state->x, 0, sizeof(state->x));
-    state->pc = 0;
-    state->excepted = false;
-    state->exception_code = 0;
-    memset(state->csr, 0, sizeof(state->csr));
-    state->mode = MACHINE;
-    state->uart = NewUart();
-    state->clint = NewClint();
-    state->plic = NewPlic();
-    state->virtio = NewVirtio();
-    WriteCSR(state, SSTATUS, 32, 33, 2);
-}
-
-void LoadBinaryIntoMemory(State *state, uint8_t *bin, size_t bin_size,
-                          uint64_t load_addr) {
-    memcpy(state->mem + load_addr, bin, bin_size);
-}
-
-size_t ReadBinaryFile(const char *name, uint8_t **buf) {
-    FILE *fp = fopen(name, "rb");
-    if (fp == NULL) {
-        Error("Can't open the file: %s.", name);
-    }
-
-    fseek(fp, 0, SEEK_END);
-    size_t size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    uint8_t *result = malloc(size);
-    fread(result, size, 1, fp);
-    *buf = result;
-    fclose(fp);
-    return size;
-}
-
-void CPUMain(State *state, uint64_t start_addr, size_t code_size,
-             bool is_debug) {
-    uint64_t count = 0;
-    state->pc = start_addr;
-    for (;;) {
-        uint64_t bpc = state->pc;
-        count++;
-        if (is_debug && count >= 10000)
-            return;
-        
-        // printf("pc: %llx\n", state->pc);
-        Tick(state);
-        if (state->pc == 0) {
-            // printf("pc: %llx -> 0, sp: %llx\n", Translate(state, bpc, AccessInstruction), state->x[2]);
-        }
-    }
-}
-
-void PrintRegisters(State *state, bool is_debug) {
-    for (int i = 0; i < 32; i++) {
-        printf("x%d:\t %lld\n", i, state->x[i]);
-    }
-    printf("pc: %llx\n", state->pc);
-}
-
-void SetDisk(State *state, uint8_t *disk) {
-    state->virtio->disk = disk;
-}
+#include <unistd.h>
 
 int main(int argc, char **argv) {
     if (argc < 2) {
@@ -131,23 +22,155 @@ int main(int argc, char **argv) {
     }
 
     uint8_t *bin;
+    char *prog_name = argv[prog_name_idx];
     size_t size = ReadBinaryFile(argv[prog_name_idx++], &bin);
     State *state = NewState(0x9000000/*0x7A12000*/);
     ResetState(state);
 
-    if (argc > prog_name_idx && !strcmp(argv[prog_name_idx], "--disk")) {
-        char *name = argv[++prog_name_idx];
-        uint8_t *data;
-        ReadBinaryFile(name, &data);
-        SetDisk(state, data);
-        prog_name_idx += 2;
+    char *disk_name = NULL;
+    char *overlay_name = NULL;
+    char *console_name = NULL;
+    uint8_t console_backend = DefaultConsoleBackend();
+    bool virtio_console = false;
+    char *net_backend = NULL;
+    char *vsock_path = NULL;
+    char *shmem_spec = NULL;
+    char *share_dir = NULL;
+    uint32_t virtio_version = 2;
+    int nharts = 1;
+    char *stats_name = NULL;
+    while (argc > prog_name_idx) {
+        char *arg = argv[prog_name_idx++];
+        if (!strcmp(arg, "--disk") && argc > prog_name_idx) {
+            disk_name = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--overlay") && argc > prog_name_idx) {
+            overlay_name = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--headless")) {
+            console_backend = ConsoleHeadless;
+        } else if (!strcmp(arg, "--console") && argc > prog_name_idx) {
+            // Write the UART output to a file instead of stdout.
+            console_name = argv[prog_name_idx++];
+            console_backend = ConsoleHeadless;
+        } else if (!strcmp(arg, "--virtio-legacy")) {
+            // Old guests (e.g. the original xv6) only speak virtio-mmio version 1.
+            virtio_version = 1;
+        } else if (!strcmp(arg, "--virtio-console")) {
+            virtio_console = true;
+        } else if (!strcmp(arg, "--net") && argc > prog_name_idx) {
+            net_backend = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--vsock") && argc > prog_name_idx) {
+            vsock_path = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--shmem") && argc > prog_name_idx) {
+            shmem_spec = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--timer") && argc > prog_name_idx) {
+            SetTimebase(state->clint, argv[prog_name_idx++]);
+        } else if (!strcmp(arg, "--no-idle-skip")) {
+            state->idle_skip = false;
+        } else if (!strcmp(arg, "--share") && argc > prog_name_idx) {
+            share_dir = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--smp") && argc > prog_name_idx) {
+            nharts = atoi(argv[prog_name_idx++]);
+        } else if (!strcmp(arg, "--quantum") && argc > prog_name_idx) {
+            state->quantum = strtoull(argv[prog_name_idx++], NULL, 0);
+            if (state->quantum == 0) {
+                Error("Invalid quantum: %s", argv[prog_name_idx - 1]);
+            }
+        } else if (!strcmp(arg, "--stats") && argc > prog_name_idx) {
+            stats_name = argv[prog_name_idx++];
+        } else if (!strcmp(arg, "--max-instret") && argc > prog_name_idx) {
+            state->max_instret = strtoull(argv[prog_name_idx++], NULL, 0);
+        } else {
+            Error("Unknown option: %s", arg);
+        }
+    }
+    if (disk_name != NULL) {
+        SetDisk(state, OpenDisk(disk_name, overlay_name));
+    } else if (overlay_name != NULL) {
+        Error("--overlay requires --disk");
     }
 
-    uint64_t addr = LoadElf(state, size, bin);
+    uint64_t addr = LoadElf(state, size, bin, true);
+    state->console = NewConsole(console_backend, console_name, STDIN_FILENO);
+    SetConsoleWakeFd(state->console, state->scheduler->wake_fd);
+    if (virtio_console) {
+        state->virtio_slots[VIRTIO_CONSOLE_SLOT] = NewVirtioConsole(state->console);
+    }
+    if (net_backend != NULL) {
+        state->virtio_slots[VIRTIO_NET_SLOT] = NewVirtioNet(net_backend);
+    }
+    if (vsock_path != NULL) {
+        // PATH[,CID]; the guest CID defaults to 3.
+        uint64_t guest_cid = 3;
+        char *comma = strchr(vsock_path, ',');
+        if (comma != NULL) {
+            *comma = '\0';
+            guest_cid = strtoull(comma + 1, NULL, 0);
+        }
+        if (guest_cid <= 2) {
+            Error("Invalid guest CID: %llu", (unsigned long long)guest_cid);
+        }
+        state->virtio_slots[VIRTIO_VSOCK_SLOT] = NewVirtioVsock(vsock_path, guest_cid);
+    }
+    if (share_dir != NULL) {
+        // DIR[,TAG]; the mount tag defaults to "rve".
+        char *tag = strchr(share_dir, ',');
+        if (tag != NULL) {
+            *tag++ = '\0';
+        }
+        state->virtio_slots[VIRTIO_9P_SLOT] = NewVirtio9p(share_dir, tag != NULL ? tag : "rve");
+    }
+    if (shmem_spec != NULL) {
+        state->shmem = NewShmem(shmem_spec);
+    }
+    for (int i = 0; i < VIRTIO_SLOTS; i++) {
+        if (state->virtio_slots[i] != NULL) {
+            SetVirtioVersion(state->virtio_slots[i], virtio_version);
+        }
+    }
 
+    if (state->quantum != 0 && state->clint->timebase != TimebaseInstret) {
+        Error("--quantum requires the instret timer");
+    }
+    StartHarts(state, nharts);
+    pthread_t *threads = calloc(nharts, sizeof(pthread_t));
     state->x[1] = (uint64_t)(-2);
+    for (int i = 1; i < nharts; i++) {
+        // Every hart enters the program with its id in a0, as on QEMU virt.
+        State *hart = state->harts[i];
+        hart->pc = addr;
+        hart->x[1] = (uint64_t)(-2);
+        hart->x[10] = i;
+        if (state->quantum != 0) {
+            continue;
+        }
+        if (pthread_create(&threads[i], NULL, RunHart, hart) != 0) {
+            Error("Can't start hart %d", i);
+        }
+    }
 
-    CPUMain(state, addr, size, is_debug);
+    uint64_t start = HostNanos();
+    if (state->quantum != 0) {
+        state->pc = addr;
+        RunQuanta(state, is_debug);
+    } else {
+        CPUMain(state, addr, size, is_debug);
+    }
+    uint64_t nanos = HostNanos() - start;
+    // Stop the other harts before anything they use goes away.
+    for (int i = 1; i < nharts && state->quantum == 0; i++) {
+        State *hart = state->harts[i];
+        __atomic_store_n(&hart->halted, true, __ATOMIC_SEQ_CST);
+        WakeHart(hart);
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    CloseConsole(state->console);
+    if (stats_name != NULL) {
+        WriteStats(state, stats_name, prog_name, nanos);
+    }
+    if (state->halted) {
+        printf("wfi\n");
+    }
 
     PrintRegisters(state, is_debug);
     int32_t result;
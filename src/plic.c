@@ -0,0 +1,156 @@
+#include "rve.h"
+
+// Platform-Level Interrupt Controller.
+//
+// The register layout is the standard one (as on QEMU virt and the SiFive
+// cores): 1023 sources with 3-bit priorities and two contexts per hart, M
+// (2 * hart) and S (2 * hart + 1).
+//
+// Sources are level triggered. A source is pending while its line is high and
+// it isn't claimed, so pending is computed from the `line` and `claimed`
+// bitmaps instead of being stored. Sources are also kept in one bitmap per
+// priority, and the best source for a context is found by scanning the
+// buckets from the highest priority down with a bit-scan over the few words
+// with raised lines. The cost stays the same however many sources and harts
+// there are.
+
+#define PLIC_CLAIM 0x04
+
+void PlicSetPriority(Plic *plic, uint32_t source, uint32_t priority) {
+    if (source == 0 || source >= PLIC_SOURCES) {
+        return;
+    }
+    if (priority > PLIC_PRIORITY_MAX) {
+        priority = PLIC_PRIORITY_MAX;
+    }
+    plic->bucket[plic->priority[source]][source / 64] &= ~SetOneBit(source % 64);
+    plic->bucket[priority][source / 64] |= SetOneBit(source % 64);
+    plic->priority[source] = priority;
+}
+
+Plic *NewPlic() {
+    Plic *plic = calloc(1, sizeof(Plic));
+    // Every source starts at priority 0, i.e. masked.
+    for (int i = 0; i < PLIC_WORDS; i++) {
+        plic->bucket[0][i] = ~(uint64_t)0;
+    }
+    return plic;
+}
+
+void PlicSetLine(Plic *plic, uint32_t source, bool level) {
+    uint64_t *word = &plic->line[source / 64];
+    if (level) {
+        *word |= SetOneBit(source % 64);
+    } else {
+        *word &= ~SetOneBit(source % 64);
+    }
+    plic->active = (plic->active & ~(1u << source / 64)) | (uint32_t)(*word != 0) << source / 64;
+}
+
+// The highest priority pending source enabled for `context` above its
+// threshold, the lowest id winning ties, or 0.
+uint32_t PlicBest(Plic *plic, int context) {
+    PlicContext *ctx = &plic->context[context];
+    if (plic->active == 0) {
+        return 0;
+    }
+    for (uint32_t priority = PLIC_PRIORITY_MAX; priority > ctx->threshold; priority--) {
+        for (uint32_t words = plic->active; words != 0; words &= words - 1) {
+            int i = __builtin_ctz(words);
+            uint64_t bits = plic->line[i] & ~plic->claimed[i] & ctx->enable[i] & plic->bucket[priority][i];
+            if (bits != 0) {
+                return i * 64 + __builtin_ctzll(bits);
+            }
+        }
+    }
+    return 0;
+}
+
+uint32_t PlicClaim(Plic *plic, int context) {
+    uint32_t source = PlicBest(plic, context);
+    if (source != 0) {
+        plic->claimed[source / 64] |= SetOneBit(source % 64);
+    }
+    return source;
+}
+
+void PlicComplete(Plic *plic, int context, uint32_t source) {
+    // Completions for sources the context can't see are ignored.
+    if (source == 0 || source >= PLIC_SOURCES ||
+        (plic->context[context].enable[source / 64] >> (source % 64) & 1) == 0) {
+        return;
+    }
+    plic->claimed[source / 64] &= ~SetOneBit(source % 64);
+}
+
+// Set the lines of the polled on-board devices (sources below 64) to `lines`
+// and drive the external interrupt bits of every hart. Lines below 64 that
+// PlicSetLine raised are kept.
+void PlicTick(State *state, uint64_t lines) {
+    Plic *plic = state->plic;
+    plic->line[0] = (plic->line[0] & ~plic->ticked) | lines;
+    plic->ticked = lines;
+    plic->active = (plic->active & ~1u) | (plic->line[0] != 0);
+    for (int hart = 0; hart < NumHarts(state); hart++) {
+        SetIrq(HartById(state, hart), MIP, 11, PlicBest(plic, 2 * hart) != 0);
+        SetIrq(HartById(state, hart), SIP, 9, PlicBest(plic, 2 * hart + 1) != 0);
+    }
+}
+
+void PlicWrite(State *state, uint64_t offset, uint8_t val) {
+    Plic *plic = state->plic;
+    if (offset < PLIC_PENDING_BASE) {
+        uint32_t source = offset / 4;
+        if (source < PLIC_SOURCES) {
+            PlicSetPriority(plic, source, WriteRange8(plic->priority[source], val, offset % 4));
+        }
+    } else if (offset >= PLIC_ENABLE_BASE && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS) {
+        PlicContext *ctx = &plic->context[(offset - PLIC_ENABLE_BASE) / PLIC_ENABLE_STRIDE];
+        uint64_t byte = (offset - PLIC_ENABLE_BASE) % PLIC_ENABLE_STRIDE;
+        ctx->enable[byte / 8] = WriteRange8(ctx->enable[byte / 8], val, byte % 8);
+        // Source 0 doesn't exist.
+        ctx->enable[0] &= ~(uint64_t)1;
+    } else if (offset >= PLIC_CONTEXT_BASE && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS) {
+        int context = (offset - PLIC_CONTEXT_BASE) / PLIC_CONTEXT_STRIDE;
+        PlicContext *ctx = &plic->context[context];
+        uint64_t reg = (offset - PLIC_CONTEXT_BASE) % PLIC_CONTEXT_STRIDE;
+        if (reg < 4) {
+            ctx->threshold = WriteRange8(ctx->threshold, val, reg) & PLIC_PRIORITY_MAX;
+        } else if (reg < PLIC_CLAIM + 4) {
+            ctx->complete = WriteRange8(ctx->complete, val, reg - PLIC_CLAIM);
+            // Complete once the whole word has been written.
+            if (reg == PLIC_CLAIM + 3) {
+                PlicComplete(plic, context, ctx->complete);
+            }
+        }
+    }
+}
+
+uint8_t PlicRead(State *state, uint64_t offset) {
+    Plic *plic = state->plic;
+    if (offset < PLIC_PENDING_BASE) {
+        uint32_t source = offset / 4;
+        return source < PLIC_SOURCES ? ReadRange8(plic->priority[source], offset % 4) : 0;
+    } else if (offset < PLIC_PENDING_BASE + PLIC_SOURCES / 8) {
+        uint64_t byte = offset - PLIC_PENDING_BASE;
+        return ReadRange8(plic->line[byte / 8] & ~plic->claimed[byte / 8], byte % 8);
+    } else if (offset >= PLIC_ENABLE_BASE && offset < PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS) {
+        PlicContext *ctx = &plic->context[(offset - PLIC_ENABLE_BASE) / PLIC_ENABLE_STRIDE];
+        uint64_t byte = (offset - PLIC_ENABLE_BASE) % PLIC_ENABLE_STRIDE;
+        return ReadRange8(ctx->enable[byte / 8], byte % 8);
+    } else if (offset >= PLIC_CONTEXT_BASE && offset < PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS) {
+        int context = (offset - PLIC_CONTEXT_BASE) / PLIC_CONTEXT_STRIDE;
+        PlicContext *ctx = &plic->context[context];
+        uint64_t reg = (offset - PLIC_CONTEXT_BASE) % PLIC_CONTEXT_STRIDE;
+        if (reg < 4) {
+            return ReadRange8(ctx->threshold, reg);
+        } else if (reg < PLIC_CLAIM + 4) {
+            // Claim on the first byte and return the rest of the same word.
+            if (reg == PLIC_CLAIM) {
+                ctx->claim = PlicClaim(plic, context);
+            }
+            return ReadRange8(ctx->claim, reg - PLIC_CLAIM);
+        }
+    }
+    return 0;
+}
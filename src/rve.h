@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #define XLEN 64
 
@@ -16,6 +18,7 @@
 #define UART_THR 0x00
 #define UART_IER 0x01
 #define UART_IIR 0x02
+#define UART_FCR 0x02
 #define UART_LCR 0x03
 #define UART_MCR 0x04
 #define UART_LSR 0x05
@@ -23,52 +26,141 @@
 #define UART_SCR 0x07
 #define UART_DLL 0x00
 #define UART_DLM 0x01
+#define UART_FIFO_SIZE 16
+// Receive timeout of the FIFO mode, in ticks without receive activity.
+#define UART_RX_TIMEOUT 4096
+
+#define CONSOLE_BUF_SIZE 4096
+#define INPUT_RING_SIZE 4096
 
 #define PLIC_BASE 0xc000000
 #define PLIC_SIZE 0x4000000
-#define PLIC_PRIORITY_BASE 0x04
-#define PLIC_PRIORITY_SIZE 0xff8
-#define PLIC_ENABLE_BASE 0x2080
-#define PLIC_ENABLE_SIZE 0x08
-#define PLIC_THRESHOLD_BASE 0x201000
-#define PLIC_THRESHOLD_SIZE 0x04
-#define PLIC_IRQ_BASE 0x201004
-#define PLIC_IRQ_SIZE 0x04
+#define PLIC_SOURCES 1024
+#define PLIC_WORDS (PLIC_SOURCES / 64)
+#define PLIC_PRIORITY_MAX 7
+#define PLIC_HARTS 8
+#define PLIC_CONTEXTS (2 * PLIC_HARTS)
+#define PLIC_PENDING_BASE 0x1000
+#define PLIC_ENABLE_BASE 0x2000
+#define PLIC_ENABLE_STRIDE 0x80
+#define PLIC_CONTEXT_BASE 0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
 
 #define CLINT_BASE 0x2000000
 #define CLINT_SIZE 0x10000
+// One msip word and one mtimecmp per hart.
+#define CLINT_HARTS 8
 #define CLINT_MSIP_BASE 0x00
-#define CLINT_MSIP_SIZE 0x04
+#define CLINT_MSIP_SIZE (0x04 * CLINT_HARTS)
 #define CLINT_MTIMECMP_BASE 0x4000
-#define CLINT_MTIMECMP_SIZE 0x08
+#define CLINT_MTIMECMP_SIZE (0x08 * CLINT_HARTS)
 #define CLINT_MTIME_BASE 0xBFF8
 #define CLINT_MTIME_SIZE 0x08
-
+// How often a host clock timer checks its deadline, in ticks.
+#define CLINT_HOST_POLL 4096
+
+// Ticks that pass on every wake-up of a hart parked in WFI, so that polled
+// devices and the UART receive timeout keep making progress.
+#define WFI_PARK_TICKS 4096
+// The longest a parked hart sleeps when devices must poll host sockets.
+#define WFI_POLL_NS 1000000
+
+// Loops of at most this many bytes are checked for busy waiting.
+#define IDLE_LOOP_SIZE 64
+// Idle iterations in a row before time is fast-forwarded.
+#define IDLE_LOOP_THRESHOLD 8
+// The largest time skip for one iteration of a loop polling mtime.
+#define IDLE_SKIP_MAX (1 << 20)
+
+// Instructions in the per-hart fetch cache.
+#define ICACHE_SIZE 4096
+
+// Entries of the per-hart TLB for each access type.
+#define TLB_SIZE 256
+// MIP and SIP bits that follow the device interrupt levels: MSIP, MTIP and
+// MEIP, and SEIP.
+#define IRQ_MIP_MASK ((1 << 3) | (1 << 7) | (1 << 11))
+#define IRQ_SIP_MASK (1 << 9)
+
+// Virtio-mmio devices occupy consecutive slots from VIRTIO_BASE and slot i
+// raises the interrupt VIRTIO_IRQ + i.
 #define VIRTIO_BASE 0x10001000
 #define VIRTIO_SIZE 0x1000
+#define VIRTIO_SLOTS 8
+#define VIRTIO_BLOCK_SLOT 0
+#define VIRTIO_CONSOLE_SLOT 1
+#define VIRTIO_NET_SLOT 2
+#define VIRTIO_VSOCK_SLOT 3
+#define VIRTIO_9P_SLOT 4
 #define VIRTIO_MAGIC_VALUE_BASE 0x00
 #define VIRTIO_DEVICE_VERSION_BASE 0x04
 #define VIRTIO_DEVICE_ID_BASE 0x08
 #define VIRTIO_VENDOR_ID_BASE 0x0c
 #define VIRTIO_HOST_FEATURES_BASE 0x10
+#define VIRTIO_HOST_FEATURES_SEL_BASE 0x14
 #define VIRTIO_GUEST_FEATURES_BASE 0x20
+#define VIRTIO_GUEST_FEATURES_SEL_BASE 0x24
 #define VIRTIO_GUEST_PAGE_SIZE_BASE 0x28
+#define VIRTIO_QUEUE_SEL_BASE 0x30
 #define VIRTIO_QUEUE_NUM_MAX_BASE 0x34
 #define VIRTIO_QUEUE_NUM_BASE 0x38
 #define VIRTIO_QUEUE_ALIGN_BASE 0x3c
 #define VIRTIO_QUEUE_PFN_BASE 0x40
+#define VIRTIO_QUEUE_READY_BASE 0x44
 #define VIRTIO_QUEUE_NOTIFY_BASE 0x50
 #define VIRTIO_INTERRUPT_STATUS_BASE 0x60
 #define VIRTIO_INTERRUPT_ACK_BASE 0x64
 #define VIRTIO_STATUS_BASE 0x70
+#define VIRTIO_QUEUE_DESC_BASE 0x80 // Low word at 0x80, high word at 0x84.
+#define VIRTIO_QUEUE_DRIVER_BASE 0x90
+#define VIRTIO_QUEUE_DEVICE_BASE 0xa0
+#define VIRTIO_CONFIG_GENERATION_BASE 0xfc
+#define VIRTIO_CONFIG_BASE 0x100
+#define VIRTIO_CONFIG_SIZE 0x100
 
 #define VIRTIO_NOTIFY 0x1234
 
+#define VIRTIO_ID_NET 1
+#define VIRTIO_ID_BLOCK 2
+#define VIRTIO_ID_CONSOLE 3
+#define VIRTIO_ID_9P 9
+#define VIRTIO_ID_VSOCK 19
+
+// Feature bits.
+#define VIRTIO_F_VERSION_1 32
+#define VIRTIO_F_RING_PACKED 34
+
+// Device status bits.
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_DEVICE_NEEDS_RESET 0x40
+
+#define VIRTIO_QUEUE_MAX 3
+#define VIRTIO_QUEUE_NUM_MAX 0x2000
+#define VIRTQ_CHAIN_MAX 128
+
 #define DESC_NUM 8
 #define VRING_DESC_SIZE 16
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2
+#define VRING_PACKED_DESC_F_AVAIL 7
+#define VRING_PACKED_DESC_F_USED 15
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+#define SECTOR_SIZE 512
+
+#define SHMEM_BASE 0x40000000 // Right below DRAM_BASE.
+#define SHMEM_MAX_SIZE (DRAM_BASE - SHMEM_BASE)
+#define SHMEM_REG_BASE 0x10100000
+#define SHMEM_REG_SIZE 0x100
 
 #define VIRTIO_IRQ 1
 #define UART_IRQ 10
+#define SHMEM_IRQ 11
 
 #define VALEN 39
 #define PAGESIZE 4096
@@ -137,6 +229,20 @@ enum CSR {
     MCAUSE = 0x342,
     MTVAL = 0x343,
     MIP = 0x344,
+
+    MHARTID = 0xf14,
+};
+
+enum AmoOp {
+    AmoAdd,
+    AmoSwap,
+    AmoXor,
+    AmoOr,
+    AmoAnd,
+    AmoMin,
+    AmoMax,
+    AmoMinu,
+    AmoMaxu,
 };
 
 enum PrivilegeLevel {
@@ -159,11 +265,36 @@ enum RV64Sv {
     Sv64 = 11,
 };
 
+enum ConsoleBackend {
+    ConsoleHeadless = 0,
+    ConsoleCurses = 1,
+};
+
+// Filled by the console input thread and drained by the CPU loop.
+typedef struct InputRing {
+    uint32_t head;
+    uint32_t tail;
+    uint8_t buf[INPUT_RING_SIZE];
+} InputRing;
+
+typedef struct Console {
+    uint8_t backend;
+    FILE *out;
+    // -1 if the console takes no input.
+    int in_fd;
+    // Signaled by the input thread; -1 if nobody waits for input.
+    int wake_fd;
+    // Signaled by CloseConsole to stop the input thread.
+    int stop_fd;
+    pthread_t input_thread;
+    bool has_input_thread;
+    InputRing input;
+} Console;
+
 typedef struct Uart {
-    uint8_t rbr; // addr 0
-    uint8_t thr; // addr 0
     uint8_t ier; // addr 1
-    uint8_t iir; // addr 2
+    uint8_t iir; // addr 2; read
+    uint8_t fcr; // addr 2; write
     uint8_t lcr; // addr 3
     uint8_t mcr; // addr 4
     uint8_t lsr; // addr 5
@@ -172,38 +303,216 @@ typedef struct Uart {
     uint8_t dll; // addr 0; if dlab = 1
     uint8_t dlm; // addr 1; if dlab = 1
     uint8_t uart_mem[UART_SIZE];
+
+    // Without FIFO mode (fcr bit 0) both FIFOs hold a single byte like
+    // plain rbr and thr registers.
+    uint8_t rx_fifo[UART_FIFO_SIZE];
+    uint8_t rx_head;
+    uint8_t rx_count;
+    uint64_t rx_time;
+    uint8_t tx_fifo[UART_FIFO_SIZE];
+    uint8_t tx_count;
+    // Latched when the transmitter runs empty; cleared by reading IIR or writing THR.
+    bool thre_pending;
 } Uart;
 
+enum ClintTimebase {
+    // mtime advances once every `divisor` instructions (deterministic).
+    TimebaseInstret,
+    // mtime follows the host monotonic clock at `freq` Hz.
+    TimebaseHost,
+};
+
+typedef struct State State;
+
 typedef struct Clint {
-    uint32_t msip;
-    uint64_t mtimecmp;
-    uint64_t mtime;
+    uint32_t msip[CLINT_HARTS];
+    uint64_t mtimecmp[CLINT_HARTS];
+    // mtime is derived from the time source; this is its value at time 0.
+    uint64_t mtime_offset;
+    uint8_t timebase;
+    uint64_t divisor;
+    uint64_t freq;
+    uint64_t host_start;
+    // mtime as of the start of the last load from it, so that bytes don't tear.
+    uint64_t mtime_latch;
 } Clint;
 
-typedef struct Plic {
-    uint32_t priority[1024];
-    uint32_t irq;
-    uint64_t enable_bits;
+enum EventKind {
+    // The timer of hart i is EventTimer + i.
+    EventTimer,
+    EVENT_MAX = EventTimer + CLINT_HARTS,
+};
+
+typedef struct Event {
+    uint64_t deadline;
+    int kind;
+} Event;
+
+typedef struct Scheduler {
+    Event heap[EVENT_MAX];
+    int len;
+    // Heap index of each kind, or -1 when it isn't scheduled.
+    int pos[EVENT_MAX];
+    void (*handler[EVENT_MAX])(State *state, int kind);
+    // Deadline of the earliest event, UINT64_MAX if none.
+    uint64_t next;
+    // An eventfd that host threads signal to wake a hart parked in WFI.
+    int wake_fd;
+    // Set once the user was told that a WFI waits for console input alone.
+    bool idle_warned;
+} Scheduler;
+
+typedef struct PlicContext {
+    uint64_t enable[PLIC_WORDS];
     uint32_t threshold;
-    uint32_t clain_complete;
+    // The source returned by the last claim, read out byte by byte.
+    uint32_t claim;
+    uint32_t complete;
+} PlicContext;
+
+typedef struct Plic {
+    uint8_t priority[PLIC_SOURCES];
+    // Sources by priority.
+    uint64_t bucket[PLIC_PRIORITY_MAX + 1][PLIC_WORDS];
+    // Interrupt lines of the devices.
+    uint64_t line[PLIC_WORDS];
+    // The lines of `line[0]` that PlicTick raised on its last call.
+    uint64_t ticked;
+    uint64_t claimed[PLIC_WORDS];
+    // Words of `line` with a raised line.
+    uint32_t active;
+    PlicContext context[PLIC_CONTEXTS];
 } Plic;
 
+typedef struct VirtQueue {
+    uint32_t num;
+    uint32_t ready;
+    // Legacy (version 1) layout: the rings are placed by pfn and align.
+    uint32_t align;
+    uint32_t pfn;
+    // Modern (version 2) layout: the rings are placed independently.
+    uint64_t desc_addr;
+    uint64_t driver_addr;
+    uint64_t device_addr;
+
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    // Wrap counters of the packed ring.
+    bool avail_wrap;
+    bool used_wrap;
+} VirtQueue;
+
+typedef struct VirtqDesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+} VirtqDesc;
+
+// A descriptor chain taken from the available ring.
+typedef struct VirtqChain {
+    uint16_t id;
+    int num;
+    VirtqDesc desc[VIRTQ_CHAIN_MAX];
+} VirtqChain;
+
+typedef struct Disk {
+    uint8_t *base;
+    uint64_t size;
+    // Overlay file; -1 if the disk is a plain image.
+    int overlay_fd;
+    uint32_t cluster_bits;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+    uint64_t bitmap_size;
+    uint8_t *bitmap;
+} Disk;
+
+typedef struct Shmem {
+    uint8_t *mem;
+    uint64_t size;
+    uint32_t intr_mask;
+    uint32_t intr_status;
+    uint32_t doorbell;
+    int listen_fd;
+    int peer_fd;
+    uint64_t next_poll;
+} Shmem;
+
+// Watches the innermost short loop for iterations that can't make progress
+// until time passes or an interrupt arrives.
+typedef struct LoopDetector {
+    // The loop is the range [head, branch] closed by a backward branch.
+    uint64_t head;
+    uint64_t branch;
+    // Set when an iteration stores to memory or reads MMIO other than mtime.
+    bool dirty;
+    // Set when an iteration reads mtime.
+    bool mtime;
+    uint32_t count;
+    uint64_t start_clock;
+    uint64_t skip;
+    int64_t x[32];
+} LoopDetector;
+
+// A translation cached by Translate, per access type, until satp changes or
+// sfence.vma.
+typedef struct TlbEntry {
+    // The virtual page address | 1, or 0 if the entry is empty.
+    uint64_t tag;
+    uint64_t page;
+} TlbEntry;
+
+// An instruction cached by Fetch32. It is valid while the generation of its
+// page in `code_gen` is unchanged.
+typedef struct ICacheEntry {
+    // The physical address, or 0 if the entry is empty.
+    uint64_t addr;
+    uint32_t instr;
+    uint32_t gen;
+} ICacheEntry;
+
+// The guest RAM stores of one step, kept for the lockstep checker.
+#define STORE_LOG_SIZE 64
+typedef struct StoreLog {
+    uint64_t addr[STORE_LOG_SIZE];
+    uint64_t size[STORE_LOG_SIZE];
+    // May exceed STORE_LOG_SIZE, when the stores past it aren't recorded.
+    int len;
+} StoreLog;
+
+typedef struct Virtio Virtio;
+typedef struct NetBackend NetBackend;
+typedef struct Vsock Vsock;
+typedef struct P9Server P9Server;
+
 typedef struct Virtio {
-    uint32_t host_features;
-    uint32_t guest_features;
+    uint32_t device_id;
+    uint32_t version;
+    uint64_t host_features;
+    uint64_t guest_features;
+    uint32_t host_features_sel;
+    uint32_t guest_features_sel;
     uint32_t guest_page_size;
-    uint32_t queue_num_max;
-    uint32_t queue_num;
-    uint32_t queue_align;
-    uint32_t queue_pfn;
+    uint32_t queue_sel;
     uint32_t queue_notify;
     uint32_t interrupt_status;
     uint32_t interrupt_ack;
     uint32_t status;
-    uint32_t *config;
-
-    uint32_t id;
-    uint8_t *disk;
+    uint32_t config_generation;
+    uint8_t config[VIRTIO_CONFIG_SIZE];
+    VirtQueue queue[VIRTIO_QUEUE_MAX];
+
+    // Called from VirtioTick when the driver notified `queue`.
+    void (*notify)(State *state, Virtio *virtio, uint32_t queue);
+    // Called from VirtioTick on every tick if set.
+    void (*poll)(State *state, Virtio *virtio);
+
+    Disk *disk;
+    Console *console;
+    NetBackend *net;
+    Vsock *vsock;
+    P9Server *p9;
 } Virtio;
 
 typedef struct State {
@@ -211,15 +520,67 @@ typedef struct State {
     uint64_t csr[4096];
     int64_t x[32];
     uint8_t *mem;
+    uint64_t mem_size;
     uint64_t clock;
+    // Retired instructions; unlike `clock`, idle skips don't advance it.
+    uint64_t instret;
+    // Hart 0 stops after retiring this many instructions, or never if 0.
+    uint64_t max_instret;
 
+    Console *console;
     Uart *uart;
     Clint *clint;
     Plic *plic;
+    Scheduler *scheduler;
     Virtio *virtio;
+    Virtio *virtio_slots[VIRTIO_SLOTS];
+    Shmem *shmem;
+    bool idle_skip;
+    LoopDetector loop;
+
+    // With --smp every hart is a State of its own sharing the memory and the
+    // devices of hart 0. Hart 0 ticks the devices and keeps the time.
+    uint32_t hart_id;
+    int nharts;
+    State **harts;
+    // Serializes device accesses between harts; NULL with a single hart.
+    pthread_mutex_t *device_lock;
+    // Interrupt levels driven by the devices, merged into MIP and SIP by the
+    // hart itself.
+    uint64_t irq_mip;
+    uint64_t irq_sip;
+    // Signaled to wake the hart up while it is parked in WFI.
+    int wake_fd;
+    bool parked;
+    // Set when a hart other than hart 0 halts.
+    bool halted;
+    // Instructions per turn when the harts take turns on one thread, or 0
+    // when every hart runs on a thread of its own.
+    uint64_t quantum;
+    // Set by WFI in turn-taking mode until an interrupt is pending.
+    bool waiting;
+    TlbEntry tlb[3][TLB_SIZE];
+    uint64_t tlb_satp;
+    // A generation per DRAM page, shared by the harts. It is odd while some
+    // fetch cache holds instructions of the page, and a store to such a page
+    // moves it on, which drops them.
+    uint32_t *code_gen;
+    ICacheEntry icache[ICACHE_SIZE];
+    // Run the reference engine: no fetch cache and no TLB, so that every
+    // fetch and translation goes to memory. The lockstep checker compares
+    // the fast engine against it.
+    bool reference;
+    // Stores to guest RAM are recorded here when it isn't NULL.
+    StoreLog *store_log;
+    // The LR reservation: the physical address and the value that was loaded.
+    bool reserved;
+    uint64_t reserve_addr;
+    uint64_t reserve_val;
 
     bool excepted;
     uint64_t exception_code;
+    // The trap value written to mtval or stval, e.g. the faulting address.
+    uint64_t exception_value;
     uint8_t mode;
 } State;
 
@@ -241,19 +602,70 @@ void GrowVec(Vec *v, int n);
 void PushVec(Vec *v, void *item);
 void *GetVec(Vec *v, int idx);
 void SetVec(Vec *v, int idx, void *item);
+void WriteJsonString(FILE *fp, const char *str, size_t len);
+
+Console *NewConsole(uint8_t backend, const char *out_name, int in_fd);
+uint8_t DefaultConsoleBackend();
+void ConsolePutc(Console *console, uint8_t ch);
+void SetConsoleWakeFd(Console *console, int fd);
+bool PushInput(InputRing *ring, uint8_t ch);
+int PopInput(InputRing *ring);
+int ConsoleGetc(Console *console);
+void ConsoleWrite(Console *console, const uint8_t *buf, size_t len);
+void ConsoleFlush(Console *console);
+void CloseConsole(Console *console);
 
 bool IsUartInterrupting(State *state);
-bool IsVirtioInterrupting(State *state);
+bool IsVirtioInterrupting(Virtio *virtio);
 uint64_t DescAddr(State *state);
-uint8_t ReadDisk(State *state, uint64_t addr);
-void WriteDisk(State *state, uint64_t addr, uint8_t value);
+uint8_t *GuestRam(State *state, uint64_t addr, uint64_t len);
+void DeviceWroteRam(State *state, uint64_t addr, uint64_t len);
+bool VirtqueuePop(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain);
+void VirtqueuePush(State *state, Virtio *virtio, VirtQueue *vq, VirtqChain *chain, uint32_t len);
+uint64_t ReadChain(State *state, VirtqChain *chain, uint64_t offset, void *buf, uint64_t len);
+uint64_t WriteChain(State *state, VirtqChain *chain, uint64_t offset, const void *buf, uint64_t len);
+int ChainIovec(State *state, VirtqChain *chain, bool writable, uint64_t offset,
+               struct iovec *iov, int iov_max);
+void BlockNotify(State *state, Virtio *virtio, uint32_t queue);
+Virtio *NewVirtioConsole(Console *console);
+Virtio *NewVirtioNet(const char *backend);
+Virtio *NewVirtioVsock(const char *uds_path, uint64_t guest_cid);
+Virtio *NewVirtio9p(const char *dir, const char *tag);
+Virtio *NewVirtio(uint32_t device_id);
+void ResetVirtio(Virtio *virtio);
+void SetVirtioVersion(Virtio *virtio, uint32_t version);
+void VirtioWrite(State *state, Virtio *virtio, uint64_t offset, uint8_t val);
+uint8_t VirtioRead(State *state, Virtio *virtio, uint64_t offset);
+Shmem *NewShmem(const char *spec);
+bool IsShmemInterrupting(Shmem *shmem);
+void ShmemWrite(State *state, uint64_t offset, uint8_t val);
+uint8_t ShmemRead(State *state, uint64_t offset);
+void ShmemTick(State *state);
+Disk *OpenDisk(const char *name, const char *overlay);
+void DiskRead(Disk *disk, uint64_t offset, uint8_t *buf, uint64_t len);
+void DiskWrite(Disk *disk, uint64_t offset, uint8_t *buf, uint64_t len);
+void DiskFlush(Disk *disk);
 void DiskAccess(State *state);
 
 void HandleTrap(State *state, uint64_t instr_addr);
 bool HandleInterrupt(State *state, uint64_t instr_addr);
 
 uint64_t GetRange(uint64_t v, uint64_t start, uint64_t end);
+uint64_t WriteRange8(uint64_t dest, uint8_t val, uint64_t start);
+uint8_t ReadRange8(uint64_t src, uint64_t start);
 uint64_t Translate(State *state, uint64_t v_addr, uint8_t access_type);
+void FlushTlb(State *state);
+void InvalidateCode(State *state, uint64_t addr, uint64_t len);
+void LogStore(State *state, uint64_t addr, uint64_t len);
+void FlushICache(State *state);
+void MemWrite8(State *state, uint64_t addr, uint8_t val);
+void MemWrite16(State *state, uint64_t addr, uint16_t val);
+void MemWrite32(State *state, uint64_t addr, uint32_t val);
+void MemWrite64(State *state, uint64_t addr, uint64_t val);
+uint8_t MemRead8(State *state, uint64_t addr);
+uint16_t MemRead16(State *state, uint64_t addr);
+uint32_t MemRead32(State *state, uint64_t addr);
+uint64_t MemRead64(State *state, uint64_t addr);
 void Write8(State *state, uint64_t v_addr, uint8_t val);
 void Write16(State *state, uint64_t v_addr, uint16_t val);
 void Write32(State *state, uint64_t v_addr, uint32_t val);
@@ -263,14 +675,61 @@ uint16_t Read16(State *state, uint64_t v_addr);
 uint32_t Read32(State *state, uint64_t v_addr);
 uint64_t Read64(State *state, uint64_t v_addr);
 uint32_t Fetch32(State *state, uint64_t v_addr);
-
+uint64_t LoadReserved(State *state, uint64_t v_addr, int size);
+uint64_t StoreConditional(State *state, uint64_t v_addr, uint64_t val, int size);
+int64_t Amo(State *state, uint32_t instr, int size, int op);
+
+Scheduler *NewScheduler();
+void SetEventHandler(Scheduler *scheduler, int kind, void (*handler)(State *state, int kind));
+void ScheduleEvent(Scheduler *scheduler, int kind, uint64_t deadline);
+void CancelEvent(Scheduler *scheduler, int kind);
+void RunEvents(State *state);
+uint64_t HostNanos();
+int NewWakeFd();
+void WaitForWake(int fd, int64_t timeout_ns);
+void SetTimebase(Clint *clint, const char *spec);
+uint64_t ClintTime(State *state);
+void UpdateTimer(State *state, uint32_t hart);
+void UpdateTimers(State *state);
+uint64_t ClintDeadline(State *state);
+void TimerEvent(State *state, int kind);
+
+Plic *NewPlic();
+void PlicSetLine(Plic *plic, uint32_t source, bool level);
+uint32_t PlicClaim(Plic *plic, int context);
+void PlicComplete(Plic *plic, int context, uint32_t source);
+void PlicTick(State *state, uint64_t lines);
+void PlicWrite(State *state, uint64_t offset, uint8_t val);
+uint8_t PlicRead(State *state, uint64_t offset);
+
+State *HartById(State *state, uint32_t id);
+int NumHarts(State *state);
+void LockDevices(State *state);
+void UnlockDevices(State *state);
+void WakeHart(State *hart);
+bool IsThreadedSmp(State *state);
+void SetIrq(State *hart, uint16_t csr, int bit, bool level);
+void MergeIrq(State *state);
+void InvalidateReservations(State *state, uint64_t addr);
+uint64_t MachineClock(State *state);
+
+void UartTick(State *state);
+uint64_t VirtioTick(State *state);
+void TickDevices(State *state);
+void IdleMachine(State *state, bool polled);
+bool IsInterruptPending(State *state);
+bool HasPolledDevices(State *state);
+void WaitForInterrupt(State *state);
+void LoopBackEdge(State *state, uint64_t branch_pc);
 void Tick(State *state);
 
 void LoadBinaryIntoMemory(State *state, uint8_t *bin, size_t bin_size,
                           uint64_t load_addr);
 void PrintRegisters(State *state, bool is_debug);
-uint64_t LoadElf(State *state, size_t size, uint8_t *bin);
+uint64_t LoadElf(State *state, size_t size, uint8_t *bin, bool verbose);
+uint64_t ElfSymbol(size_t size, uint8_t *bin, const char *name);
 void ExecInstruction(State *state, uint32_t instr);
+void Disassemble(uint64_t pc, uint32_t instr, char *buf, size_t size);
 int64_t SetNBits(int32_t n);
 int64_t SetOneBit(int i);
 void WriteCSR(State *state, uint16_t csr, uint8_t start_bit, uint8_t end_bit, uint64_t val);
@@ -280,5 +739,14 @@ void Error(const char *fmt, ...);
 void TakeTrap(State *state);
 State *NewState(size_t mem_size);
 void ResetState(State *state);
+void FreeState(State *state);
+size_t ReadBinaryFile(const char *name, uint8_t **buf);
+void SetDisk(State *state, Disk *disk);
+void CPUMain(State *state, uint64_t start_addr, size_t code_size, bool is_debug);
+void *RunHart(void *arg);
+State *NewHart(State *boot, uint32_t id);
+void StartHarts(State *state, int nharts);
+void RunQuanta(State *state, bool is_debug);
+void WriteStats(State *state, const char *name, const char *program, uint64_t nanos);
 
 void RunTest();
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// An ivshmem-like shared memory device.
+//
+// A host file (or an inherited memfd, "fd:N") is mapped with MAP_SHARED at
+// SHMEM_BASE, right below DRAM, so the guest and host programs see the same
+// pages without any copy. The register page at SHMEM_REG_BASE follows the
+// ivshmem BAR0 layout:
+//
+//   0x00 INTRMASK    Interrupt mask.
+//   0x04 INTRSTATUS  Pending doorbells from the host; reading clears them.
+//   0x08 IVPOSITION  Our peer id, always 0.
+//   0x0c DOORBELL    Writing sends the value to the host peer.
+//   0x10 SIZE        Size of the shared region in bytes (64-bit, read-only).
+//
+// Doorbells travel as 4-byte messages over an optional Unix seqpacket socket
+// on which rve listens. A message from the host ORs its value into
+// INTRSTATUS and raises SHMEM_IRQ while INTRSTATUS & INTRMASK is non-zero.
+
+#define SHMEM_INTRMASK 0x00
+#define SHMEM_INTRSTATUS 0x04
+#define SHMEM_IVPOSITION 0x08
+#define SHMEM_DOORBELL 0x0c
+#define SHMEM_SIZE_REG 0x10
+#define SHMEM_POLL_INTERVAL 256
+
+bool IsShmemInterrupting(Shmem *shmem) {
+    return (shmem->intr_status & shmem->intr_mask) != 0;
+}
+
+void ShmemRing(Shmem *shmem, uint32_t value) {
+    if (shmem->peer_fd < 0 && shmem->listen_fd >= 0) {
+        shmem->peer_fd = accept4(shmem->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    }
+    if (shmem->peer_fd >= 0) {
+        // A full socket means the host isn't reading; drop the doorbell like
+        // a coalesced interrupt.
+        send(shmem->peer_fd, &value, sizeof(value), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+void ShmemWrite(State *state, uint64_t offset, uint8_t val) {
+    Shmem *shmem = state->shmem;
+    if (offset >= SHMEM_INTRMASK && offset < SHMEM_INTRMASK + 4) {
+        shmem->intr_mask = WriteRange8(shmem->intr_mask, val, offset - SHMEM_INTRMASK);
+    } else if (offset >= SHMEM_DOORBELL && offset < SHMEM_DOORBELL + 4) {
+        shmem->doorbell = WriteRange8(shmem->doorbell, val, offset - SHMEM_DOORBELL);
+        // Ring once the most significant byte has been written.
+        if (offset == SHMEM_DOORBELL + 3) {
+            ShmemRing(shmem, shmem->doorbell);
+        }
+    }
+}
+
+uint8_t ShmemRead(State *state, uint64_t offset) {
+    Shmem *shmem = state->shmem;
+    if (offset >= SHMEM_INTRMASK && offset < SHMEM_INTRMASK + 4) {
+        return ReadRange8(shmem->intr_mask, offset - SHMEM_INTRMASK);
+    } else if (offset >= SHMEM_INTRSTATUS && offset < SHMEM_INTRSTATUS + 4) {
+        uint8_t val = ReadRange8(shmem->intr_status, offset - SHMEM_INTRSTATUS);
+        if (offset == SHMEM_INTRSTATUS + 3) {
+            shmem->intr_status = 0;
+        }
+        return val;
+    } else if (offset >= SHMEM_SIZE_REG && offset < SHMEM_SIZE_REG + 8) {
+        return ReadRange8(shmem->size, offset - SHMEM_SIZE_REG);
+    }
+    return 0;
+}
+
+void ShmemTick(State *state) {
+    Shmem *shmem = state->shmem;
+    if (state->clock < shmem->next_poll) {
+        return;
+    }
+    shmem->next_poll = state->clock + SHMEM_POLL_INTERVAL;
+    if (shmem->peer_fd < 0 && shmem->listen_fd >= 0) {
+        shmem->peer_fd = accept4(shmem->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    }
+    uint32_t value;
+    ssize_t n;
+    while (shmem->peer_fd >= 0 && (n = recv(shmem->peer_fd, &value, sizeof(value), 0)) != 0) {
+        if (n < 0) {
+            return;
+        }
+        if (n == sizeof(value)) {
+            shmem->intr_status |= value;
+        }
+    }
+    // The host went away; wait for the next one.
+    if (shmem->peer_fd >= 0) {
+        close(shmem->peer_fd);
+        shmem->peer_fd = -1;
+    }
+}
+
+// spec: (PATH | fd:N)[,SIZE[,SOCKET]]. A file is created and grown to SIZE
+// when needed; without SIZE the size of the file is used.
+Shmem *NewShmem(const char *spec) {
+    char *arg = strdup(spec);
+    char *size_arg = strchr(arg, ',');
+    char *socket_path = NULL;
+    if (size_arg != NULL) {
+        *size_arg++ = '\0';
+        socket_path = strchr(size_arg, ',');
+        if (socket_path != NULL) {
+            *socket_path++ = '\0';
+        }
+    }
+
+    int fd;
+    if (!strncmp(arg, "fd:", 3)) {
+        fd = atoi(arg + 3);
+    } else {
+        fd = open(arg, O_RDWR | O_CREAT, 0644);
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        Error("Can't open the shared memory %s: %s", arg, strerror(errno));
+    }
+    uint64_t size = st.st_size;
+    if (size_arg != NULL && *size_arg != '\0') {
+        char *end;
+        size = strtoull(size_arg, &end, 0);
+        if (*end == 'K' || *end == 'k') {
+            size <<= 10;
+        } else if (*end == 'M' || *end == 'm') {
+            size <<= 20;
+        } else if (*end == 'G' || *end == 'g') {
+            size <<= 30;
+        }
+        if ((uint64_t)st.st_size < size && ftruncate(fd, size) < 0) {
+            Error("Can't resize the shared memory %s: %s", arg, strerror(errno));
+        }
+    }
+    // Keep the region page aligned so that guests can map it directly.
+    size &= ~(uint64_t)(PAGESIZE - 1);
+    if (size == 0 || size > SHMEM_MAX_SIZE) {
+        Error("Invalid shared memory size: %llu", (unsigned long long)size);
+    }
+
+    Shmem *shmem = calloc(1, sizeof(Shmem));
+    shmem->size = size;
+    shmem->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shmem->mem == MAP_FAILED) {
+        Error("Can't map the shared memory %s: %s", arg, strerror(errno));
+    }
+    close(fd);
+
+    shmem->listen_fd = -1;
+    shmem->peer_fd = -1;
+    if (socket_path != NULL) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            Error("Too long socket path: %s", socket_path);
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+        shmem->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+        if (bind(shmem->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(shmem->listen_fd, 1) < 0) {
+            Error("Can't listen on %s: %s", socket_path, strerror(errno));
+        }
+    }
+    free(arg);
+    return shmem;
+}
@@ -1,4 +1,12 @@
+#define _GNU_SOURCE
 #include "rve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 void ExecMulhsu(State *state, uint32_t instr);
 
@@ -30,6 +38,1053 @@ int64_t mulhsu(int64_t a, uint64_t b)
   return negate ? ~res + (a * b == 0) : res;
 }
 
+// Put a 3-descriptor block read of sector 1 into the ring of the block device.
+void TestDiskAccess(bool packed) {
+    State *state = NewState(0x10000);
+    ResetState(state);
+    uint8_t data[SECTOR_SIZE * 2];
+    memset(data, 0xab, sizeof(data));
+    Disk disk = {.base = data, .size = sizeof(data), .overlay_fd = -1};
+    state->virtio->disk = &disk;
+    if (packed) {
+        state->virtio->guest_features |= SetOneBit(VIRTIO_F_RING_PACKED);
+    }
+
+    VirtQueue *vq = &state->virtio->queue[0];
+    vq->num = DESC_NUM;
+    vq->ready = 1;
+    vq->desc_addr = DRAM_BASE;
+    vq->driver_addr = DRAM_BASE + 0x1000;
+    vq->device_addr = DRAM_BASE + 0x2000;
+    uint64_t header = DRAM_BASE + 0x3000;
+    uint64_t buf = DRAM_BASE + 0x4000;
+    uint64_t status = DRAM_BASE + 0x5000;
+    MemWrite32(state, header, VIRTIO_BLK_T_IN);
+    MemWrite64(state, header + 8, 1);
+    MemWrite8(state, status, 0xff);
+
+    uint64_t addrs[3] = {header, buf, status};
+    uint32_t lens[3] = {16, SECTOR_SIZE, 1};
+    uint16_t flags[3] = {VRING_DESC_F_NEXT, VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, VRING_DESC_F_WRITE};
+    for (int i = 0; i < 3; i++) {
+        uint64_t desc = vq->desc_addr + VRING_DESC_SIZE * i;
+        MemWrite64(state, desc, addrs[i]);
+        MemWrite32(state, desc + 8, lens[i]);
+        if (packed) {
+            MemWrite16(state, desc + 12, 5);
+            MemWrite16(state, desc + 14, flags[i] | SetOneBit(VRING_PACKED_DESC_F_AVAIL));
+        } else {
+            MemWrite16(state, desc + 12, flags[i]);
+            MemWrite16(state, desc + 14, i + 1);
+        }
+    }
+    if (!packed) {
+        MemWrite16(state, vq->driver_addr + 4, 0);
+        MemWrite16(state, vq->driver_addr + 2, 1);
+    }
+
+    DiskAccess(state);
+    assert(MemRead8(state, buf) == 0xab);
+    assert(MemRead8(state, buf + SECTOR_SIZE - 1) == 0xab);
+    assert(MemRead8(state, status) == VIRTIO_BLK_S_OK);
+    if (packed) {
+        assert(MemRead16(state, vq->desc_addr + 12) == 5);
+        assert(MemRead32(state, vq->desc_addr + 8) == SECTOR_SIZE + 1);
+        assert(vq->used_idx == 3 && vq->last_avail_idx == 3);
+    } else {
+        assert(MemRead16(state, vq->device_addr + 2) == 1);
+        assert(MemRead32(state, vq->device_addr + 8) == SECTOR_SIZE + 1);
+
+        // A sector whose byte offset wraps around fails the request.
+        MemWrite64(state, header + 8, 1ULL << 55);
+        MemWrite16(state, vq->driver_addr + 6, 0);
+        MemWrite16(state, vq->driver_addr + 2, 2);
+        DiskAccess(state);
+        assert(MemRead8(state, status) == VIRTIO_BLK_S_IOERR);
+        assert(MemRead16(state, vq->device_addr + 2) == 2);
+
+        // A queue that isn't ready is left alone.
+        vq->ready = 0;
+        MemWrite16(state, vq->driver_addr + 2, 3);
+        DiskAccess(state);
+        assert(MemRead16(state, vq->device_addr + 2) == 2);
+    }
+
+    free(state->mem);
+    free(state);
+}
+
+void TestOverlayDisk() {
+    char base_name[] = "/tmp/rve-base-XXXXXX";
+    char overlay_name[] = "/tmp/rve-overlay-XXXXXX";
+    int base_fd = mkstemp(base_name);
+    int overlay_fd = mkstemp(overlay_name);
+    uint8_t data[0x30000];
+    memset(data, 0x11, sizeof(data));
+    assert(write(base_fd, data, sizeof(data)) == sizeof(data));
+    close(base_fd);
+    close(overlay_fd);
+
+    Disk *disk = OpenDisk(base_name, overlay_name);
+    uint8_t buf[4] = {1, 2, 3, 4};
+    DiskWrite(disk, 0x10000 - 2, buf, sizeof(buf));
+    memset(buf, 0, sizeof(buf));
+    DiskRead(disk, 0x10000 - 2, buf, sizeof(buf));
+    assert(buf[0] == 1 && buf[3] == 4);
+    assert(disk->base[0x10000] == 0x11);
+
+    // The written clusters persist in the overlay and the rest still comes from the base.
+    Disk *reopened = OpenDisk(base_name, overlay_name);
+    DiskRead(reopened, 0x10000 - 3, buf, sizeof(buf));
+    assert(buf[0] == 0x11 && buf[1] == 1 && buf[3] == 3);
+    DiskRead(reopened, 0x20000, buf, 1);
+    assert(buf[0] == 0x11);
+
+    unlink(base_name);
+    unlink(overlay_name);
+}
+
+void TestHeadlessConsole() {
+    char name[] = "/tmp/rve-console-XXXXXX";
+    close(mkstemp(name));
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->console = NewConsole(ConsoleHeadless, name, -1);
+
+    const char *msg = "hi\n";
+    for (int i = 0; msg[i]; i++) {
+        Write8(state, UART_BASE + UART_THR, msg[i]);
+        UartTick(state);
+    }
+    char buf[8] = {0};
+    FILE *fp = fopen(name, "rb");
+    assert(fread(buf, 1, sizeof(buf), fp) == 3 && !strcmp(buf, msg));
+    fclose(fp);
+
+    assert(PushInput(&state->console->input, 'a'));
+    UartTick(state);
+    assert(Read8(state, UART_BASE + UART_LSR) & 0x01);
+    assert(Read8(state, UART_BASE + UART_RBR) == 'a');
+    assert(ConsoleGetc(state->console) == -1);
+
+    // FIFO mode with a receive trigger level of 4 bytes.
+    Write8(state, UART_BASE + UART_FCR, 0x41);
+    Write8(state, UART_BASE + UART_IER, 0x01);
+    for (int i = 0; i < 3; i++) {
+        PushInput(&state->console->input, '0' + i);
+    }
+    UartTick(state);
+    assert(!IsUartInterrupting(state));
+    state->clock += UART_RX_TIMEOUT;
+    assert(IsUartInterrupting(state) && Read8(state, UART_BASE + UART_IIR) == 0xcc);
+    PushInput(&state->console->input, '3');
+    UartTick(state);
+    assert(IsUartInterrupting(state) && Read8(state, UART_BASE + UART_IIR) == 0xc4);
+    for (int i = 0; i < 4; i++) {
+        assert(Read8(state, UART_BASE + UART_RBR) == '0' + i);
+    }
+    assert(!IsUartInterrupting(state));
+
+    // One THRE interrupt for a whole burst of output.
+    Write8(state, UART_BASE + UART_IER, 0x02);
+    assert(Read8(state, UART_BASE + UART_IIR) == 0xc2);
+    for (int i = 0; i < UART_FIFO_SIZE; i++) {
+        Write8(state, UART_BASE + UART_THR, 'x');
+    }
+    assert(!IsUartInterrupting(state));
+    UartTick(state);
+    assert(IsUartInterrupting(state) && Read8(state, UART_BASE + UART_IIR) == 0xc2);
+    assert(!IsUartInterrupting(state));
+
+    CloseConsole(state->console);
+
+    // Input from a file descriptor comes in through the input thread, which
+    // CloseConsole stops.
+    int fds[2];
+    assert(pipe(fds) == 0);
+    Console *console = NewConsole(ConsoleHeadless, name, fds[0]);
+    assert(write(fds[1], "ok", 2) == 2);
+    for (int i = 0; i < 2; i++) {
+        int ch;
+        while ((ch = ConsoleGetc(console)) < 0) {
+            sched_yield();
+        }
+        assert(ch == "ok"[i]);
+    }
+    CloseConsole(console);
+    close(fds[0]);
+    close(fds[1]);
+    unlink(name);
+}
+
+#ifdef RVE_CURSES
+// UART output has to reach the terminal without anything else refreshing the
+// curses screen.
+void TestCursesConsole() {
+    char name[] = "/tmp/rve-curses-XXXXXX";
+    close(mkstemp(name));
+    setenv("TERM", "vt100", 1);
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->console = NewConsole(ConsoleCurses, name, -1);
+
+    const char *msg = "hi\n";
+    for (int i = 0; msg[i]; i++) {
+        Write8(state, UART_BASE + UART_THR, msg[i]);
+        UartTick(state);
+    }
+    char buf[512] = {0};
+    FILE *fp = fopen(name, "rb");
+    assert(fread(buf, 1, sizeof(buf) - 1, fp) > 0 && strstr(buf, "hi") != NULL);
+    fclose(fp);
+
+    CloseConsole(state->console);
+    unlink(name);
+}
+#endif
+
+// Queue one buffer on each queue of a split-ring virtio-console.
+void TestVirtioConsole() {
+    char name[] = "/tmp/rve-vconsole-XXXXXX";
+    close(mkstemp(name));
+    State *state = NewState(0x10000);
+    ResetState(state);
+    state->console = NewConsole(ConsoleHeadless, name, -1);
+    Virtio *virtio = NewVirtioConsole(state->console);
+    state->virtio_slots[VIRTIO_CONSOLE_SLOT] = virtio;
+    virtio->status = VIRTIO_STATUS_DRIVER_OK;
+
+    for (int q = 0; q < 2; q++) {
+        VirtQueue *vq = &virtio->queue[q];
+        uint64_t base = DRAM_BASE + 0x4000 * q;
+        vq->num = DESC_NUM;
+        vq->ready = 1;
+        vq->desc_addr = base;
+        vq->driver_addr = base + 0x1000;
+        vq->device_addr = base + 0x2000;
+        MemWrite64(state, base, base + 0x3000);
+        MemWrite32(state, base + 8, 3);
+        MemWrite16(state, base + 12, q == 0 ? VRING_DESC_F_WRITE : 0);
+        MemWrite16(state, base + 0x1000 + 2, 1);
+    }
+    memcpy(GuestRam(state, DRAM_BASE + 0x7000, 3), "abc", 3);
+
+    Write32(state, VIRTIO_BASE + VIRTIO_SIZE * VIRTIO_CONSOLE_SLOT + VIRTIO_QUEUE_NOTIFY_BASE, 1);
+    PushInput(&state->console->input, 'z');
+    UartTick(state);
+    assert((Read8(state, UART_BASE + UART_LSR) & 0x01) == 0);
+    StoreLog log = {0};
+    state->store_log = &log;
+    VirtioTick(state);
+    state->store_log = NULL;
+    assert(MemRead8(state, DRAM_BASE + 0x3000) == 'z');
+    // The input went into guest memory like a store of the CPU.
+    bool logged = false;
+    for (int i = 0; i < log.len; i++) {
+        logged |= log.addr[i] == DRAM_BASE + 0x3000 && log.size[i] == 1;
+    }
+    assert(logged);
+    assert(MemRead32(state, DRAM_BASE + 0x2000 + 8) == 1);
+    assert(IsVirtioInterrupting(virtio));
+
+    char buf[4] = {0};
+    FILE *fp = fopen(name, "rb");
+    assert(fread(buf, 1, sizeof(buf), fp) == 3 && !strcmp(buf, "abc"));
+    fclose(fp);
+
+    CloseConsole(state->console);
+    unlink(name);
+}
+
+// A queue_sel past the last queue doesn't alias an existing queue.
+void TestVirtioQueueSel() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    Virtio *virtio = NewVirtio(VIRTIO_ID_NET);
+    assert(VirtioRead(state, virtio, VIRTIO_QUEUE_NUM_MAX_BASE + 1) == VIRTIO_QUEUE_NUM_MAX >> 8);
+    VirtioWrite(state, virtio, VIRTIO_QUEUE_SEL_BASE, VIRTIO_QUEUE_MAX);
+    for (int i = 0; i < 4; i++) {
+        assert(VirtioRead(state, virtio, VIRTIO_QUEUE_NUM_MAX_BASE + i) == 0);
+    }
+    VirtioWrite(state, virtio, VIRTIO_QUEUE_DESC_BASE, 0x12);
+    VirtioWrite(state, virtio, VIRTIO_QUEUE_READY_BASE, 1);
+    assert(VirtioRead(state, virtio, VIRTIO_QUEUE_DESC_BASE) == 0);
+    assert(virtio->queue[0].desc_addr == 0 && virtio->queue[0].ready == 0);
+}
+
+// Send a frame into a pcap capture and replay the capture into a second device.
+void TestVirtioNet() {
+    char name[] = "/tmp/rve-net-XXXXXX";
+    close(mkstemp(name));
+    char spec[64];
+    State *state = NewState(0x20000);
+    ResetState(state);
+    sprintf(spec, "pcap:%s", name);
+    Virtio *tx = NewVirtioNet(spec);
+    sprintf(spec, "pcap:/dev/null,%s", name);
+
+    VirtQueue *vq = &tx->queue[1];
+    vq->num = DESC_NUM;
+    vq->ready = 1;
+    vq->desc_addr = DRAM_BASE;
+    vq->driver_addr = DRAM_BASE + 0x1000;
+    vq->device_addr = DRAM_BASE + 0x2000;
+    MemWrite64(state, DRAM_BASE, DRAM_BASE + 0x3000);
+    MemWrite32(state, DRAM_BASE + 8, 10 + 4);
+    MemWrite16(state, DRAM_BASE + 0x1000 + 2, 1);
+    memcpy(GuestRam(state, DRAM_BASE + 0x3000 + 10, 4), "ping", 4);
+    tx->notify(state, tx, 1);
+    assert(IsVirtioInterrupting(tx));
+    // A frame longer than 65550 bytes is dropped rather than sent truncated.
+    struct stat st;
+    assert(stat(name, &st) == 0 && st.st_size == 24 + 16 + 4);
+    MemWrite32(state, DRAM_BASE + 8, 10 + 0x10010);
+    MemWrite16(state, DRAM_BASE + 0x1000 + 2, 2);
+    tx->notify(state, tx, 1);
+    assert(MemRead16(state, DRAM_BASE + 0x2000 + 2) == 2);
+    assert(stat(name, &st) == 0 && st.st_size == 24 + 16 + 4);
+
+    Virtio *rx = NewVirtioNet(spec);
+    rx->status = 0x04;
+    vq = &rx->queue[0];
+    vq->num = DESC_NUM;
+    vq->ready = 1;
+    vq->desc_addr = DRAM_BASE + 0x4000;
+    vq->driver_addr = DRAM_BASE + 0x5000;
+    vq->device_addr = DRAM_BASE + 0x6000;
+    MemWrite64(state, DRAM_BASE + 0x4000, DRAM_BASE + 0x7000);
+    MemWrite32(state, DRAM_BASE + 0x4000 + 8, 1514);
+    MemWrite16(state, DRAM_BASE + 0x4000 + 12, VRING_DESC_F_WRITE);
+    MemWrite16(state, DRAM_BASE + 0x5000 + 2, 1);
+    rx->poll(state, rx);
+    assert(MemRead32(state, DRAM_BASE + 0x6000 + 8) == 10 + 4);
+    assert(!memcmp(GuestRam(state, DRAM_BASE + 0x7000 + 10, 4), "ping", 4));
+
+    // The MAC is made of the pid unless the spec gives one.
+    pid_t pid = getpid();
+    uint8_t mac[6] = {0x52, 0x54, 0x00, pid >> 16, pid >> 8, pid};
+    assert(!memcmp(rx->config, mac, sizeof(mac)));
+    Virtio *other = NewVirtioNet("pcap:/dev/null,mac=02:00:5e:10:00:0a");
+    assert(!memcmp(other->config, "\x02\x00\x5e\x10\x00\x0a", 6));
+
+    unlink(name);
+}
+
+void TestVirtioVsock() {
+    char dir[] = "/tmp/rve-vsock-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[64], port_path[80];
+    sprintf(path, "%s/v", dir);
+    sprintf(port_path, "%s_1234", path);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, port_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, 1) == 0);
+
+    State *state = NewState(0x10000);
+    ResetState(state);
+    Virtio *virtio = NewVirtioVsock(path, 3);
+    assert(virtio->config[0] == 3);
+    VirtQueue *rx = &virtio->queue[0];
+    rx->num = DESC_NUM;
+    rx->ready = 1;
+    rx->desc_addr = DRAM_BASE;
+    rx->driver_addr = DRAM_BASE + 0x1000;
+    rx->device_addr = DRAM_BASE + 0x2000;
+    MemWrite64(state, DRAM_BASE, DRAM_BASE + 0x3000);
+    MemWrite32(state, DRAM_BASE + 8, 0x1000);
+    MemWrite16(state, DRAM_BASE + 12, VRING_DESC_F_WRITE);
+    MemWrite16(state, DRAM_BASE + 0x1000 + 2, 2);
+    VirtQueue *tx = &virtio->queue[1];
+    tx->num = DESC_NUM;
+    tx->ready = 1;
+    tx->desc_addr = DRAM_BASE + 0x4000;
+    tx->driver_addr = DRAM_BASE + 0x5000;
+    tx->device_addr = DRAM_BASE + 0x6000;
+    MemWrite64(state, DRAM_BASE + 0x4000, DRAM_BASE + 0x7000);
+    MemWrite32(state, DRAM_BASE + 0x4000 + 8, 44);
+
+    // The guest connects from port 5000 to host port 1234.
+    uint64_t header = DRAM_BASE + 0x7000;
+    MemWrite64(state, header, 3);
+    MemWrite64(state, header + 8, 2);
+    MemWrite32(state, header + 16, 5000);
+    MemWrite32(state, header + 20, 1234);
+    MemWrite16(state, header + 28, 1);
+    MemWrite16(state, header + 30, 1);
+    MemWrite32(state, header + 36, 0x1000);
+    MemWrite16(state, DRAM_BASE + 0x5000 + 2, 1);
+    virtio->notify(state, virtio, 1);
+    assert(MemRead16(state, DRAM_BASE + 0x2000 + 2) == 1);
+    assert(MemRead16(state, DRAM_BASE + 0x3000 + 30) == 2);
+    assert(MemRead32(state, DRAM_BASE + 0x3000 + 16) == 1234);
+
+    // Stream data from the host lands in the next receive buffer.
+    int fd = accept(listener, NULL, NULL);
+    assert(write(fd, "pong", 4) == 4);
+    virtio->notify(state, virtio, 0);
+    assert(MemRead16(state, DRAM_BASE + 0x2000 + 2) == 2);
+    assert(MemRead32(state, DRAM_BASE + 0x2000 + 4 + 8 + 4) == 44 + 4);
+    assert(MemRead16(state, DRAM_BASE + 0x3000 + 30) == 5);
+    assert(!memcmp(GuestRam(state, DRAM_BASE + 0x3000 + 44, 4), "pong", 4));
+
+    // The guest sends a whole buffer's worth of credit while the host doesn't
+    // read: what the socket can't take is queued instead of blocking.
+    MemWrite32(state, DRAM_BASE + 0x4000 + 8, 44 + 0x1000);
+    MemWrite16(state, header + 30, 5);
+    MemWrite32(state, header + 24, 0x1000);
+    for (int i = 0; i < 64; i++) {
+        MemWrite16(state, DRAM_BASE + 0x5000 + 2, 2 + i);
+        virtio->notify(state, virtio, 1);
+    }
+    // The guest shuts its side down right away; the host still gets all of
+    // the queued data before the end of the stream.
+    MemWrite32(state, DRAM_BASE + 0x4000 + 8, 44);
+    MemWrite16(state, header + 30, 4);
+    MemWrite32(state, header + 24, 0);
+    MemWrite32(state, header + 32, 2);
+    MemWrite16(state, DRAM_BASE + 0x5000 + 2, 66);
+    virtio->notify(state, virtio, 1);
+    static uint8_t data[64 * 0x1000];
+    size_t received = 0;
+    for (int i = 0; i < 1000 && received < sizeof(data); i++) {
+        ssize_t n = recv(fd, data + received, sizeof(data) - received, MSG_DONTWAIT);
+        received += n > 0 ? n : 0;
+        virtio->notify(state, virtio, 0);
+    }
+    assert(received == sizeof(data));
+    virtio->notify(state, virtio, 0);
+    assert(recv(fd, data, 1, MSG_DONTWAIT) == 0);
+
+    // The end of the host's stream reaches the guest as a SHUTDOWN that only
+    // says the host won't send.
+    // Credit updates queued meanwhile go first.
+    assert(shutdown(fd, SHUT_WR) == 0);
+    for (int i = 3; i < 16 && MemRead16(state, DRAM_BASE + 0x3000 + 30) != 4; i++) {
+        MemWrite16(state, DRAM_BASE + 0x1000 + 2, i);
+        virtio->notify(state, virtio, 0);
+        assert(MemRead16(state, DRAM_BASE + 0x2000 + 2) == i);
+    }
+    assert(MemRead16(state, DRAM_BASE + 0x3000 + 30) == 4);
+    assert(MemRead32(state, DRAM_BASE + 0x3000 + 32) == 2);
+
+    close(fd);
+    close(listener);
+    unlink(port_path);
+    unlink(path);
+    rmdir(dir);
+}
+
+void TestShmem() {
+    char dir[] = "/tmp/rve-shmem-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char file[64], path[64], spec[160];
+    sprintf(file, "%s/mem", dir);
+    sprintf(path, "%s/sock", dir);
+    sprintf(spec, "%s,64K,%s", file, path);
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->shmem = NewShmem(spec);
+    assert(MemRead32(state, SHMEM_REG_BASE + 0x10) == 0x10000);
+
+    // Guest stores are visible in the host file right away.
+    MemWrite32(state, SHMEM_BASE + 0x100, 0xdeadbeef);
+    assert(GuestRam(state, SHMEM_BASE + 0x100, 4) == state->shmem->mem + 0x100);
+    int fd = open(file, O_RDONLY);
+    uint32_t word = 0;
+    assert(pread(fd, &word, 4, 0x100) == 4 && word == 0xdeadbeef);
+    close(fd);
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path);
+    int peer = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    assert(connect(peer, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    word = 5;
+    assert(send(peer, &word, 4, 0) == 4);
+    MemWrite32(state, SHMEM_REG_BASE, 1);
+    ShmemTick(state);
+    assert(IsShmemInterrupting(state->shmem));
+    assert(MemRead32(state, SHMEM_REG_BASE + 0x04) == 5);
+    assert(!IsShmemInterrupting(state->shmem));
+
+    MemWrite32(state, SHMEM_REG_BASE + 0x0c, 7);
+    assert(recv(peer, &word, 4, 0) == 4 && word == 7);
+
+    close(peer);
+    unlink(file);
+    unlink(path);
+    rmdir(dir);
+}
+
+// Send the 9P message `msg` to `virtio` and return the reply in guest memory.
+uint8_t *Call9p(State *state, Virtio *virtio, uint8_t *msg, uint32_t len) {
+    uint16_t idx = MemRead16(state, DRAM_BASE + 0x1000 + 2);
+    memcpy(msg, &len, 4);
+    memcpy(GuestRam(state, DRAM_BASE + 0x3000, len), msg, len);
+    MemWrite32(state, DRAM_BASE + 8, len);
+    MemWrite16(state, DRAM_BASE + 0x1000 + 4 + 2 * (idx % DESC_NUM), 0);
+    MemWrite16(state, DRAM_BASE + 0x1000 + 2, ++idx);
+    virtio->notify(state, virtio, 0);
+    assert(MemRead16(state, DRAM_BASE + 0x2000 + 2) == idx);
+    return GuestRam(state, DRAM_BASE + 0x4000, 0x1000);
+}
+
+void TestVirtio9p() {
+    char dir[] = "/tmp/rve-9p-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char file[64];
+    sprintf(file, "%s/hello.txt", dir);
+    FILE *fp = fopen(file, "w");
+    fputs("hello, 9p", fp);
+    fclose(fp);
+
+    State *state = NewState(0x10000);
+    ResetState(state);
+    Virtio *virtio = NewVirtio9p(dir, "share");
+    assert(virtio->config[0] == 5 && !memcmp(virtio->config + 2, "share", 5));
+    VirtQueue *vq = &virtio->queue[0];
+    vq->num = DESC_NUM;
+    vq->ready = 1;
+    vq->desc_addr = DRAM_BASE;
+    vq->driver_addr = DRAM_BASE + 0x1000;
+    vq->device_addr = DRAM_BASE + 0x2000;
+    MemWrite64(state, DRAM_BASE, DRAM_BASE + 0x3000);
+    MemWrite16(state, DRAM_BASE + 12, VRING_DESC_F_NEXT);
+    MemWrite16(state, DRAM_BASE + 14, 1);
+    MemWrite64(state, DRAM_BASE + 16, DRAM_BASE + 0x4000);
+    MemWrite32(state, DRAM_BASE + 16 + 8, 0x1000);
+    MemWrite16(state, DRAM_BASE + 16 + 12, VRING_DESC_F_WRITE);
+
+    // Tversion: msize[4] version[s]
+    uint8_t version[] = {0, 0, 0, 0, 100, 0xff, 0xff, 0, 0x20, 0, 0, 8, 0, '9', 'P', '2', '0', '0', '0', '.', 'L'};
+    uint8_t *reply = Call9p(state, virtio, version, sizeof(version));
+    assert(reply[4] == 101 && reply[8] == 0x20);
+    // Tattach: fid[4] afid[4] uname[s] aname[s] n_uname[4]
+    uint8_t attach[] = {0, 0, 0, 0, 104, 1, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0, 0, 0, 0, 0};
+    reply = Call9p(state, virtio, attach, sizeof(attach));
+    assert(reply[4] == 105 && reply[7] == 0x80);
+    // Twalk: fid[4] newfid[4] nwname[2] name[s]
+    uint8_t walk[] = {0, 0, 0, 0, 110, 1, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0,
+                      9, 0, 'h', 'e', 'l', 'l', 'o', '.', 't', 'x', 't'};
+    reply = Call9p(state, virtio, walk, sizeof(walk));
+    assert(reply[4] == 111 && reply[7] == 1);
+    walk[sizeof(walk) - 1] = 'x';
+    reply = Call9p(state, virtio, walk, sizeof(walk));
+    assert(reply[4] == 7 && reply[7] == ENOENT);
+    // Tlopen: fid[4] flags[4]
+    uint8_t lopen[] = {0, 0, 0, 0, 12, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0};
+    reply = Call9p(state, virtio, lopen, sizeof(lopen));
+    assert(reply[4] == 13);
+    // Tread: fid[4] offset[8] count[4]
+    uint8_t read[] = {0, 0, 0, 0, 116, 1, 0, 1, 0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 100, 0, 0, 0};
+    reply = Call9p(state, virtio, read, sizeof(read));
+    assert(reply[4] == 117 && reply[7] == 2 && !memcmp(reply + 11, "9p", 2));
+    assert(MemRead32(state, DRAM_BASE + 0x2000 + 4 + 8 * 5 + 4) == 11 + 2);
+    // An open fid can't be opened again.
+    reply = Call9p(state, virtio, lopen, sizeof(lopen));
+    assert(reply[4] == 7 && reply[7] == EBADF);
+
+    // A walk through a link to outside the share stops at the link.
+    char link[64];
+    sprintf(link, "%s/out", dir);
+    assert(symlink("/", link) == 0);
+    uint8_t walk_out[] = {0, 0, 0, 0, 110, 1, 0, 0, 0, 0, 0, 2, 0, 0, 0, 2, 0,
+                          3, 0, 'o', 'u', 't', 3, 0, 't', 'm', 'p'};
+    reply = Call9p(state, virtio, walk_out, sizeof(walk_out));
+    assert(reply[4] == 111 && reply[7] == 1 && reply[9] == 0x02);
+
+    // A walk of several long names.
+    char sub[300];
+    char name[201];
+    memset(name, 'a', 200);
+    name[200] = '\0';
+    sprintf(sub, "%s/%s", dir, name);
+    assert(mkdir(sub, 0700) == 0);
+    uint8_t long_walk[17 + 3 * 202 + 2 * 4] = {0, 0, 0, 0, 110, 1, 0, 0, 0, 0, 0, 3, 0, 0, 0, 5, 0};
+    uint8_t *p = long_walk + 17;
+    for (int i = 0; i < 5; i++) {
+        uint16_t len = i % 2 ? 2 : 200;
+        memcpy(p, &len, 2);
+        memcpy(p + 2, i % 2 ? ".." : name, len);
+        p += 2 + len;
+    }
+    reply = Call9p(state, virtio, long_walk, sizeof(long_walk));
+    assert(reply[4] == 111 && reply[7] == 5);
+
+    rmdir(sub);
+    unlink(link);
+    unlink(file);
+    rmdir(dir);
+}
+
+void TestClintTimer() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->clock = 100;
+    assert(MemRead64(state, CLINT_BASE + CLINT_MTIME_BASE) == 100);
+    // A load at any offset of mtime reads the current time.
+    state->clock = 0x50000;
+    assert(MemRead16(state, CLINT_BASE + CLINT_MTIME_BASE + 2) == 5);
+    state->clock = 100;
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, 150);
+    MergeIrq(state);
+    assert(ReadCSR(state, MIP, 7, 7) == 0);
+    assert(state->scheduler->next == 150);
+    state->clock = 149;
+    RunEvents(state);
+    MergeIrq(state);
+    assert(ReadCSR(state, MIP, 7, 7) == 0);
+    state->clock = 150;
+    RunEvents(state);
+    MergeIrq(state);
+    assert(ReadCSR(state, MIP, 7, 7) == 1);
+    assert(state->scheduler->next == UINT64_MAX);
+    // Moving mtimecmp ahead lowers MTIP again.
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, 300);
+    MergeIrq(state);
+    assert(ReadCSR(state, MIP, 7, 7) == 0);
+
+    SetTimebase(state->clint, "instret:10");
+    assert(ClintTime(state) == 15);
+    UpdateTimer(state, 0);
+    assert(state->scheduler->next == 3000);
+}
+
+void TestWfi() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    WriteCSR(state, MIE, 7, 7, 1);
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, 100000);
+    // The idle instructions are skipped with the instret timebase.
+    WaitForInterrupt(state);
+    assert(state->clock == 100000);
+    assert(ReadCSR(state, MIP, 7, 7) == 1);
+
+    // With the host timebase the thread sleeps until the deadline.
+    SetTimebase(state->clint, "host:1000");
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, ClintTime(state) + 2);
+    uint64_t start = HostNanos();
+    WaitForInterrupt(state);
+    assert(HostNanos() - start >= 1000000);
+    assert(ReadCSR(state, MIP, 7, 7) == 1);
+
+    // Without a timer event or any input nothing can end the wait.
+    state = NewState(0x1000);
+    ResetState(state);
+    WriteCSR(state, MIE, 9, 9, 1);
+    WaitForInterrupt(state);
+    assert(state->halted);
+}
+
+void TestIdleLoop() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, 1000000);
+
+    // A loop spinning on an unchanged flag jumps to the timer deadline.
+    for (int i = 0; i <= IDLE_LOOP_THRESHOLD; i++) {
+        state->clock += 3;
+        MemRead32(state, DRAM_BASE + 0x100);
+        state->pc = DRAM_BASE;
+        LoopBackEdge(state, DRAM_BASE + 8);
+    }
+    assert(state->clock == 1000000 - 1);
+
+    // A loop that stores is left alone.
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, 2000000);
+    uint64_t clock = state->clock;
+    for (int i = 0; i <= IDLE_LOOP_THRESHOLD; i++) {
+        state->clock += 3;
+        MemWrite32(state, DRAM_BASE + 0x100, i);
+        LoopBackEdge(state, DRAM_BASE + 8);
+    }
+    assert(state->clock == clock + 3 * (IDLE_LOOP_THRESHOLD + 1));
+
+    // A loop polling mtime moves time ahead in growing steps.
+    for (int i = 0; i <= IDLE_LOOP_THRESHOLD + 2; i++) {
+        state->clock += 3;
+        state->x[5] = MemRead64(state, CLINT_BASE + CLINT_MTIME_BASE);
+        LoopBackEdge(state, DRAM_BASE + 8);
+    }
+    assert(state->clock > clock + 100 && state->clock < 2000000);
+}
+
+void TestPlic() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    uint64_t s_context = PLIC_BASE + PLIC_CONTEXT_BASE + PLIC_CONTEXT_STRIDE;
+    MemWrite32(state, PLIC_BASE + 4 * 3, 2);
+    MemWrite32(state, PLIC_BASE + 4 * 700, 5);
+    MemWrite32(state, PLIC_BASE + 4 * 5, 5);
+    assert(MemRead32(state, PLIC_BASE + 4 * 700) == 5);
+    MemWrite32(state, PLIC_BASE + PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE, 0x28);
+    MemWrite32(state, PLIC_BASE + PLIC_ENABLE_BASE + PLIC_ENABLE_STRIDE + 700 / 8, 1 << 700 % 8);
+
+    PlicSetLine(state->plic, 700, true);
+    PlicSetLine(state->plic, 40, true);
+    PlicTick(state, SetOneBit(3) | SetOneBit(5));
+    MergeIrq(state);
+    assert(ReadCSR(state, SIP, 9, 9) == 1);
+    assert(ReadCSR(state, MIP, 11, 11) == 0);
+    assert(MemRead32(state, PLIC_BASE + PLIC_PENDING_BASE) == 0x28);
+    // A line below 64 raised with PlicSetLine survives the tick.
+    assert(MemRead32(state, PLIC_BASE + PLIC_PENDING_BASE + 4) == SetOneBit(40 - 32));
+    PlicSetLine(state->plic, 40, false);
+
+    // Equal priorities go to the lowest id, then lower priorities.
+    assert(MemRead32(state, s_context + 4) == 5);
+    assert(MemRead32(state, s_context + 4) == 700);
+    assert(MemRead32(state, PLIC_BASE + PLIC_PENDING_BASE) == 0x08);
+    MemWrite32(state, s_context, 2);
+    assert(MemRead32(state, s_context + 4) == 0);
+    MemWrite32(state, s_context, 0);
+    assert(MemRead32(state, s_context + 4) == 3);
+    PlicTick(state, SetOneBit(3) | SetOneBit(5));
+    MergeIrq(state);
+    assert(ReadCSR(state, SIP, 9, 9) == 0);
+
+    // A completed source that is still raised becomes pending again.
+    MemWrite32(state, s_context + 4, 5);
+    PlicTick(state, SetOneBit(3) | SetOneBit(5));
+    MergeIrq(state);
+    assert(ReadCSR(state, SIP, 9, 9) == 1);
+    assert(MemRead32(state, s_context + 4) == 5);
+
+    // A line that the devices dropped is lowered on the next tick.
+    PlicTick(state, SetOneBit(5));
+    MemWrite32(state, s_context + 4, 3);
+    assert(MemRead32(state, PLIC_BASE + PLIC_PENDING_BASE) == 0);
+}
+
+void TestSmp() {
+    State *state = NewState(0x10000);
+    ResetState(state);
+    StartHarts(state, 2);
+    State *hart = state->harts[1];
+    assert(hart->mem == state->mem && hart->plic == state->plic);
+    assert(hart->csr[MHARTID] == 1 && state->csr[MHARTID] == 0);
+
+    // Device interrupts reach only the hart they are routed to.
+    uint64_t s_context = PLIC_BASE + PLIC_CONTEXT_BASE + 3 * PLIC_CONTEXT_STRIDE;
+    MemWrite32(state, PLIC_BASE + 4 * UART_IRQ, 1);
+    MemWrite32(hart, PLIC_BASE + PLIC_ENABLE_BASE + 3 * PLIC_ENABLE_STRIDE, SetOneBit(UART_IRQ));
+    PlicTick(state, SetOneBit(UART_IRQ));
+    MergeIrq(state);
+    MergeIrq(hart);
+    assert(ReadCSR(hart, SIP, 9, 9) == 1);
+    assert(ReadCSR(state, SIP, 9, 9) == 0);
+    assert(MemRead32(hart, s_context + 4) == UART_IRQ);
+
+    // A parked hart is woken up by its interrupt.
+    WriteCSR(hart, MIE, 7, 7, 1);
+    hart->parked = true;
+    SetIrq(hart, MIP, 7, true);
+    uint64_t start = HostNanos();
+    WaitForWake(hart->wake_fd, 1000000000);
+    assert(HostNanos() - start < 500000000);
+    hart->parked = false;
+    WaitForInterrupt(hart);
+    assert(ReadCSR(hart, MIP, 7, 7) == 1);
+    assert(ReadCSR(state, MIP, 7, 7) == 0);
+
+    // Translations are cached until sfence.vma. The root table maps the
+    // gigapage at 0x80000000 to DRAM, then to 0x40000000.
+    uint64_t root = DRAM_BASE + 0x1000;
+    MemWrite64(hart, root + 8 * 2, (DRAM_BASE >> 12) << 10 | 0xcf);
+    hart->csr[SATP] = (uint64_t)Sv39 << 60 | root >> 12;
+    hart->mode = SUPERVISOR;
+    assert(Translate(hart, 0x80000123, AccessLoad) == 0x80000123);
+    MemWrite64(hart, root + 8 * 2, (0x40000000 >> 12) << 10 | 0xcf);
+    assert(Translate(hart, 0x80000123, AccessLoad) == 0x80000123);
+    FlushTlb(hart);
+    assert(Translate(hart, 0x80000123, AccessLoad) == 0x40000123);
+}
+
+void TestLrsc() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    StartHarts(state, 2);
+    State *hart = state->harts[1];
+    uint64_t addr = DRAM_BASE + 0x100;
+    MemWrite64(state, addr, 5);
+
+    assert(StoreConditional(state, addr, 6, 8) == 1);
+    assert(LoadReserved(state, addr, 8) == 5);
+    assert(StoreConditional(state, addr + 8, 6, 8) == 1);
+    assert(LoadReserved(state, addr, 8) == 5);
+    assert(StoreConditional(state, addr, 6, 8) == 0);
+    assert(MemRead64(state, addr) == 6);
+    assert(StoreConditional(state, addr, 7, 8) == 1);
+
+    // A store by another hart ends the reservation even if the value is the same.
+    LoadReserved(state, addr, 4);
+    MemWrite32(hart, addr + 4, 0);
+    assert(StoreConditional(state, addr, 7, 4) == 1);
+
+    // A change that slipped past the reservation makes the CAS fail.
+    LoadReserved(state, addr, 4);
+    state->mem[0x100] = 9;
+    assert(StoreConditional(state, addr, 7, 4) == 1);
+    assert(MemRead32(state, addr) == 9);
+
+    // So does a trap.
+    LoadReserved(state, addr, 4);
+    HandleTrap(state, DRAM_BASE);
+    assert(StoreConditional(state, addr, 7, 4) == 1);
+}
+
+// amoadd.d with rs1 = a0 and rs2 = a1, run 100000 times.
+void *AmoAddLoop(void *arg) {
+    State *hart = arg;
+    for (int i = 0; i < 100000; i++) {
+        Amo(hart, 11 << 20 | 10 << 15, 8, AmoAdd);
+    }
+    return NULL;
+}
+
+void TestAmo() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    StartHarts(state, 2);
+    uint64_t addr = DRAM_BASE + 0x100;
+    uint32_t instr = 11 << 20 | 10 << 15;
+    for (int i = 0; i < 2; i++) {
+        state->harts[i]->x[10] = addr;
+        state->harts[i]->x[11] = 1;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, AmoAddLoop, state->harts[1]);
+    AmoAddLoop(state);
+    pthread_join(thread, NULL);
+    assert(MemRead64(state, addr) == 200000);
+
+    // Word AMOs compare and return 32-bit values.
+    MemWrite64(state, addr, 0x1fffffffe);
+    state->x[11] = 1;
+    assert(Amo(state, instr, 4, AmoMin) == -2);
+    assert(MemRead64(state, addr) == 0x1fffffffe);
+    assert(Amo(state, instr, 4, AmoMaxu) == -2);
+    assert(MemRead64(state, addr) == 0x1fffffffe);
+    state->x[11] = 0x100000005;
+    assert(Amo(state, instr, 4, AmoMinu) == -2);
+    assert(MemRead64(state, addr) == 0x100000005);
+
+    state->x[10] = addr + 2;
+    Amo(state, instr, 4, AmoAdd);
+    assert(state->excepted && state->exception_code == StoreAMOAddressMisaligned);
+}
+
+void *WaitForIpi(void *arg) {
+    State *hart = arg;
+    WaitForInterrupt(hart);
+    return NULL;
+}
+
+void TestClintHarts() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    StartHarts(state, 2);
+    State *hart = state->harts[1];
+
+    // Each hart has its own mtimecmp and timer event.
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE + 8, 50);
+    assert(MemRead64(state, CLINT_BASE + CLINT_MTIMECMP_BASE) == UINT64_MAX);
+    assert(state->scheduler->next == 50);
+    state->clock = 50;
+    RunEvents(state);
+    MergeIrq(state);
+    MergeIrq(hart);
+    assert(ReadCSR(hart, MIP, 7, 7) == 1);
+    assert(ReadCSR(state, MIP, 7, 7) == 0);
+    MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE + 8, UINT64_MAX);
+
+    // An IPI wakes the parked hart up.
+    WriteCSR(hart, MIE, 3, 3, 1);
+    pthread_t thread;
+    pthread_create(&thread, NULL, WaitForIpi, hart);
+    while (!__atomic_load_n(&hart->parked, __ATOMIC_SEQ_CST)) {
+        usleep(100);
+    }
+    MemWrite32(state, CLINT_BASE + CLINT_MSIP_BASE + 4, 1);
+    pthread_join(thread, NULL);
+    assert(ReadCSR(hart, MIP, 3, 3) == 1);
+    assert(MemRead32(hart, CLINT_BASE + CLINT_MSIP_BASE + 4) == 1);
+    MemWrite32(hart, CLINT_BASE + CLINT_MSIP_BASE + 4, 0);
+    MergeIrq(hart);
+    assert(ReadCSR(hart, MIP, 3, 3) == 0);
+
+    // MMIO writes of the other harts wake hart 0 up, which runs the devices.
+    state->parked = true;
+    MemWrite32(hart, PLIC_BASE + 4 * UART_IRQ, 1);
+    uint64_t start = HostNanos();
+    WaitForWake(state->wake_fd, 1000000000);
+    assert(HostNanos() - start < 500000000);
+    state->parked = false;
+    assert(IsThreadedSmp(state));
+}
+
+// Run two harts that increment a shared counter without atomics in turns of
+// `quantum` instructions and return the counter.
+uint32_t RunCounterHarts(uint64_t quantum) {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->quantum = quantum;
+    StartHarts(state, 2);
+    // loop: lw t0, 0(a0); addi t0, t0, 1; sw t0, 0(a0); j loop
+    uint32_t code[] = {0x00052283, 0x00128293, 0x00552023, 0xff5ff06f};
+    memcpy(state->mem, code, sizeof(code));
+    for (int i = 0; i < 2; i++) {
+        state->harts[i]->pc = DRAM_BASE;
+        state->harts[i]->x[10] = DRAM_BASE + 0x100;
+    }
+    RunQuanta(state, true);
+    return MemRead32(state, DRAM_BASE + 0x100);
+}
+
+void TestQuanta() {
+    // Lockstep loses every other increment; whole iterations lose none. Hart
+    // 0 stops after 10000 instructions, before the last turn of hart 1.
+    assert(RunCounterHarts(1) == 2500);
+    assert(RunCounterHarts(1) == 2500);
+    assert(RunCounterHarts(4) == 4999);
+    uint32_t count = RunCounterHarts(3);
+    assert(RunCounterHarts(3) == count);
+}
+
+void TestSelfModifyingCode() {
+    State *state = NewState(0x4000);
+    ResetState(state);
+    StartHarts(state, 2);
+    State *hart = state->harts[1];
+    MemWrite32(state, DRAM_BASE + 0x10, 0x00150513);
+    assert(Fetch32(state, DRAM_BASE + 0x10) == 0x00150513);
+    assert(Fetch32(hart, DRAM_BASE + 0x10) == 0x00150513);
+    assert(state->code_gen[0] & 1);
+
+    // A store to the page drops the instruction on every hart.
+    MemWrite32(hart, DRAM_BASE + 0x10, 0x00250513);
+    assert((state->code_gen[0] & 1) == 0);
+    assert(Fetch32(state, DRAM_BASE + 0x10) == 0x00250513);
+    assert(Fetch32(hart, DRAM_BASE + 0x10) == 0x00250513);
+
+    // Stores to pages without code leave the generations alone.
+    uint32_t gen = state->code_gen[0];
+    MemWrite32(state, DRAM_BASE + 0x1000, 0);
+    assert(state->code_gen[0] == gen && state->code_gen[1] == 0);
+
+    // Memory changed behind the back of the cache needs fence.i.
+    memcpy(state->mem + 0x10, "\x13\x05\x35\x00", 4);
+    assert(Fetch32(state, DRAM_BASE + 0x10) == 0x00250513);
+    FlushICache(state);
+    assert(Fetch32(state, DRAM_BASE + 0x10) == 0x00350513);
+}
+
+// Page faults report the address in stval and leave rd as it was, so that
+// a handler can map the page and run the instruction again.
+void TestPageFault() {
+    State *state = NewState(0x4000);
+    ResetState(state);
+    uint64_t root = DRAM_BASE + 0x1000;
+    MemWrite64(state, root + 8 * 2, (DRAM_BASE >> 12) << 10 | 0xcf);
+    state->csr[SATP] = (uint64_t)Sv39 << 60 | root >> 12;
+    state->csr[MEDELEG] = SetOneBit(InstructionPageFault) | SetOneBit(LoadPageFault);
+    state->csr[STVEC] = DRAM_BASE + 0x100;
+    state->mode = SUPERVISOR;
+
+    // ld a0, 0(a1)
+    MemWrite32(state, DRAM_BASE + 0x10, 0x0005b503);
+    state->pc = DRAM_BASE + 0x10;
+    state->x[10] = 42;
+    state->x[11] = 0x1000;
+    Tick(state);
+    assert(state->pc == DRAM_BASE + 0x100);
+    assert(state->csr[SCAUSE] == LoadPageFault && state->csr[STVAL] == 0x1000);
+    assert(state->x[10] == 42);
+
+    state->pc = 0x2000;
+    Tick(state);
+    assert(state->csr[SCAUSE] == InstructionPageFault && state->csr[STVAL] == 0x2000);
+    assert(state->csr[SEPC] == 0x2000);
+    // Neither instruction retired.
+    assert(state->instret == 0);
+}
+
+void TestDisassemble() {
+    uint32_t instrs[] = {0x007302b3, 0x00130293, 0x00033283, 0x00001463,
+                         0x340022f3, 0x007332af, 0x0285, 0xffffffff};
+    const char *texts[] = {"add t0,t1,t2", "addi t0,t1,1", "ld t0,0(t1)",
+                           "bne zero,zero,0x80000008", "csrrs t0,0x340,zero",
+                           "amoadd.d t0,t2,(t1)", "c.addi t0,1", "unknown 0xffffffff"};
+    for (size_t i = 0; i < sizeof(instrs) / sizeof(instrs[0]); i++) {
+        char buf[64];
+        Disassemble(DRAM_BASE, instrs[i], buf, sizeof(buf));
+        assert(!strcmp(buf, texts[i]));
+    }
+}
+
+void TestIllegalInstruction() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    state->csr[MTVEC] = DRAM_BASE + 0x100;
+    // An unknown opcode, c.fldsp, uret, OP/OP-32 with an unknown funct7 and an
+    // AMO with a width other than W or D trap instead of ending the process.
+    uint32_t instrs[] = {0x0000007b, 0x2002, 0x00200073, 0x04b50533, 0x20b5053b, 0x00b5052f};
+    for (size_t i = 0; i < sizeof(instrs) / sizeof(instrs[0]); i++) {
+        MemWrite32(state, DRAM_BASE, instrs[i]);
+        state->pc = DRAM_BASE;
+        Tick(state);
+        assert(state->pc == DRAM_BASE + 0x100);
+        assert(state->csr[MCAUSE] == IllegalInstruction && state->csr[MEPC] == DRAM_BASE);
+        assert(state->csr[MTVAL] == instrs[i]);
+    }
+    // satp ignores a write of Sv48.
+    state->x[5] = 9ULL << 60;
+    ExecInstruction(state, 0x18029073); // csrw satp, t0
+    assert(state->csr[SATP] == 0);
+}
+
+// The program path is escaped in the stats JSON.
+void TestStats() {
+    char name[] = "/tmp/rve-stats-XXXXXX";
+    close(mkstemp(name));
+    State *state = NewState(0x1000);
+    ResetState(state);
+    WriteStats(state, name, "dir\\a \"b\"\n", 0);
+    char buf[256] = {0};
+    FILE *fp = fopen(name, "rb");
+    assert(fread(buf, 1, sizeof(buf) - 1, fp) > 0);
+    fclose(fp);
+    const char *want = "{\"program\": \"dir\\\\a \\\"b\\\"\\u000a\", ";
+    assert(!strncmp(buf, want, strlen(want)));
+    unlink(name);
+}
+
+// Run `instr` (a0 = a1 op t0) and return a0.
+int64_t ExecOp32(State *state, uint32_t instr, int64_t a1, int64_t t0) {
+    state->x[11] = a1;
+    state->x[5] = t0;
+    ExecInstruction(state, instr);
+    return state->x[10];
+}
+
+void TestDivw() {
+    State *state = NewState(0x1000);
+    ResetState(state);
+    uint32_t divw = 0x0255c53b, divuw = 0x0255d53b, remw = 0x0255e53b, remuw = 0x0255f53b;
+    // The divisor is the low word of t0, which is 0 here.
+    assert(ExecOp32(state, divw, 7, 1LL << 32) == -1);
+    assert(ExecOp32(state, divuw, 7, 1LL << 32) == -1);
+    assert(ExecOp32(state, remw, 7, 1LL << 32) == 7);
+    assert(ExecOp32(state, remuw, 7, 1LL << 32) == 7);
+    assert(ExecOp32(state, divw, INT32_MIN, -1) == INT32_MIN);
+    assert(ExecOp32(state, remw, INT32_MIN, -1) == 0);
+    assert(ExecOp32(state, remw, 0x100000007, 0x100000003) == 1);
+    assert(ExecOp32(state, divuw, 0xfffffffe, 1) == -2);
+    assert(ExecOp32(state, remuw, 0x1fffffffe, 0xffffffff) == -2);
+    FreeState(state);
+}
+
 void RunTest() {
     State *state = NewState(1000);
     ResetState(state);
@@ -51,6 +1106,35 @@ void RunTest() {
 
     assert(GetRange(10, 2, 3) == 2);
 
+    TestDiskAccess(false);
+    TestDiskAccess(true);
+    TestOverlayDisk();
+    TestHeadlessConsole();
+#ifdef RVE_CURSES
+    TestCursesConsole();
+#endif
+    TestVirtioConsole();
+    TestVirtioQueueSel();
+    TestVirtioNet();
+    TestVirtioVsock();
+    TestShmem();
+    TestVirtio9p();
+    TestClintTimer();
+    TestWfi();
+    TestIdleLoop();
+    TestPlic();
+    TestSmp();
+    TestLrsc();
+    TestAmo();
+    TestClintHarts();
+    TestQuanta();
+    TestSelfModifyingCode();
+    TestPageFault();
+    TestDisassemble();
+    TestIllegalInstruction();
+    TestDivw();
+    TestStats();
+
     state->x[1] = 0xffffffff80000000;
     state->x[2] = 0xffffffffffff8000;
     printf("a: %lld\n", mulhsu(state->x[1], state->x[2]));
@@ -0,0 +1,755 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+// virtio-9p sharing a host directory with the guest (9P2000.L).
+//
+// Linux mounts it with
+//   mount -t 9p -o trans=virtio,version=9p2000.L,msize=1048576 <tag> /mnt
+//
+// The server implements the subset that v9fs needs for ordinary file work:
+// version, attach, walk, getattr, setattr, lopen, lcreate, read, write,
+// readdir, mkdir, unlinkat, renameat, fsync, statfs and clunk. Everything
+// else fails with EOPNOTSUPP, which v9fs handles (e.g. no xattrs). Read and
+// write payloads go straight between the file and guest memory with
+// preadv/pwritev on the request's descriptors.
+//
+// Guest names are resolved lexically below the shared directory; ".." never
+// leaves it. The host opens the result one component at a time and never
+// follows a symbolic link, so a link in the directory can't lead out of it.
+
+#define P9_MSIZE (1024 * 1024)
+#define P9_MAX_FIDS 65536
+#define P9_NAME_MAX 256
+// Most names in a Twalk, as in the kernel client.
+#define P9_MAX_WALK 16
+// Biggest request other than Twrite: a Twalk of P9_MAX_WALK names.
+#define P9_IN_SIZE (P9_HEADER_SIZE + 10 + P9_MAX_WALK * (2 + P9_NAME_MAX))
+#define P9_MOUNT_TAG 0 // VIRTIO_9P_MOUNT_TAG feature bit.
+// Header of every message: size[4] type[1] tag[2].
+#define P9_HEADER_SIZE 7
+
+enum P9Type {
+    P9Rlerror = 7,
+    P9Tstatfs = 8,
+    P9Tlopen = 12,
+    P9Tlcreate = 14,
+    P9Tgetattr = 24,
+    P9Tsetattr = 26,
+    P9Treaddir = 40,
+    P9Tfsync = 50,
+    P9Tmkdir = 72,
+    P9Trenameat = 74,
+    P9Tunlinkat = 76,
+    P9Tversion = 100,
+    P9Tattach = 104,
+    P9Tflush = 108,
+    P9Twalk = 110,
+    P9Tread = 116,
+    P9Twrite = 118,
+    P9Tclunk = 120,
+};
+
+typedef struct P9Fid {
+    bool used;
+    char *path;
+    int fd;
+    DIR *dir;
+    // Index of the next entry readdir returns; guests pass it back as offset.
+    uint64_t dir_pos;
+} P9Fid;
+
+typedef struct P9Server {
+    char *root;
+    P9Fid *fids;
+    uint32_t fids_len;
+    uint32_t msize;
+    uint8_t *in;
+    uint8_t *out;
+} P9Server;
+
+// Cursor over a message. Reads past the end set `error` and return zeros.
+typedef struct P9Msg {
+    uint8_t *buf;
+    uint32_t pos;
+    uint32_t len;
+    // Size of the whole message, which may be longer than `buf` for Twrite.
+    uint32_t size;
+    bool error;
+} P9Msg;
+
+uint64_t P9Get(P9Msg *msg, int size) {
+    if (msg->pos + size > msg->len) {
+        msg->error = true;
+        return 0;
+    }
+    uint64_t val = 0;
+    for (int i = 0; i < size; i++) {
+        val |= (uint64_t)msg->buf[msg->pos++] << (i * 8);
+    }
+    return val;
+}
+
+// Copy a string into `name`, which must hold P9_NAME_MAX bytes.
+void P9GetString(P9Msg *msg, char *name) {
+    uint32_t len = P9Get(msg, 2);
+    if (len >= P9_NAME_MAX || msg->pos + len > msg->len) {
+        msg->error = true;
+        name[0] = '\0';
+        return;
+    }
+    memcpy(name, msg->buf + msg->pos, len);
+    name[len] = '\0';
+    msg->pos += len;
+}
+
+void P9Put(P9Msg *msg, int size, uint64_t val) {
+    if (msg->pos + size > msg->len) {
+        msg->error = true;
+        return;
+    }
+    for (int i = 0; i < size; i++) {
+        msg->buf[msg->pos++] = val >> (i * 8);
+    }
+}
+
+void P9PutString(P9Msg *msg, const char *str) {
+    uint32_t len = strlen(str);
+    P9Put(msg, 2, len);
+    if (msg->pos + len > msg->len) {
+        msg->error = true;
+        return;
+    }
+    memcpy(msg->buf + msg->pos, str, len);
+    msg->pos += len;
+}
+
+void P9PutQid(P9Msg *msg, struct stat *st) {
+    uint8_t type = 0;
+    if (S_ISDIR(st->st_mode)) {
+        type = 0x80;
+    } else if (S_ISLNK(st->st_mode)) {
+        type = 0x02;
+    }
+    P9Put(msg, 1, type);
+    P9Put(msg, 4, st->st_mtime);
+    P9Put(msg, 8, st->st_ino);
+}
+
+P9Fid *GetFid(P9Server *server, uint32_t fid) {
+    if (fid >= server->fids_len || !server->fids[fid].used) {
+        return NULL;
+    }
+    return &server->fids[fid];
+}
+
+void ClunkFid(P9Fid *fid) {
+    if (fid->dir != NULL) {
+        closedir(fid->dir);
+    } else if (fid->fd >= 0) {
+        close(fid->fd);
+    }
+    free(fid->path);
+    memset(fid, 0, sizeof(P9Fid));
+    fid->fd = -1;
+}
+
+// Bind `fid` to `path`, which it takes ownership of.
+P9Fid *NewFid(P9Server *server, uint32_t fid, char *path) {
+    if (fid >= P9_MAX_FIDS) {
+        free(path);
+        return NULL;
+    }
+    if (fid >= server->fids_len) {
+        uint32_t len = server->fids_len ? server->fids_len : 64;
+        while (len <= fid) {
+            len *= 2;
+        }
+        server->fids = realloc(server->fids, len * sizeof(P9Fid));
+        for (uint32_t i = server->fids_len; i < len; i++) {
+            memset(&server->fids[i], 0, sizeof(P9Fid));
+            server->fids[i].fd = -1;
+        }
+        server->fids_len = len;
+    }
+    if (server->fids[fid].used) {
+        ClunkFid(&server->fids[fid]);
+    }
+    server->fids[fid].used = true;
+    server->fids[fid].path = path;
+    return &server->fids[fid];
+}
+
+// Resolve `name` relative to the directory `dir`; "." and ".." are handled
+// lexically and can't escape the shared root.
+char *JoinPath(P9Server *server, const char *dir, const char *name) {
+    if (strchr(name, '/') != NULL || name[0] == '\0') {
+        return NULL;
+    }
+    if (!strcmp(name, ".")) {
+        return strdup(dir);
+    }
+    if (!strcmp(name, "..")) {
+        if (!strcmp(dir, server->root)) {
+            return strdup(dir);
+        }
+        char *path = strdup(dir);
+        *strrchr(path, '/') = '\0';
+        return path;
+    }
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// Open the directory containing `path`, a path below the shared root, and
+// point `*name` at its last component ("." for the root itself). Every
+// directory on the way is opened without following symbolic links.
+int OpenParent(P9Server *server, const char *path, const char **name) {
+    const char *rest = path + strlen(server->root);
+    int dir = open(server->root, O_PATH | O_DIRECTORY);
+    *name = ".";
+    while (dir >= 0 && *rest == '/') {
+        rest++;
+        const char *end = strchrnul(rest, '/');
+        if (*end == '\0') {
+            *name = rest;
+            break;
+        }
+        char *part = strndup(rest, end - rest);
+        int next = openat(dir, part, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+        free(part);
+        close(dir);
+        dir = next;
+        rest = end;
+    }
+    return dir;
+}
+
+// open() for a path below the shared root. A symbolic link as the last
+// component fails with ELOOP, or is opened itself with O_PATH.
+int OpenBeneath(P9Server *server, const char *path, int flags, mode_t mode) {
+    const char *name;
+    int dir = OpenParent(server, path, &name);
+    if (dir < 0) {
+        return -1;
+    }
+    int fd = openat(dir, name, flags | O_NOFOLLOW, mode);
+    int err = errno;
+    close(dir);
+    errno = err;
+    return fd;
+}
+
+// lstat() for a path below the shared root.
+int StatBeneath(P9Server *server, const char *path, struct stat *st) {
+    const char *name;
+    int dir = OpenParent(server, path, &name);
+    if (dir < 0) {
+        return -1;
+    }
+    int ret = fstatat(dir, name, st, AT_SYMLINK_NOFOLLOW);
+    int err = errno;
+    close(dir);
+    errno = err;
+    return ret;
+}
+
+// Convert Linux open flags of the guest to the host. Both use the generic
+// values, but don't let the guest pass anything exotic (O_PATH, O_TMPFILE...).
+int OpenFlags(uint32_t flags) {
+    return flags & (O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND | O_NONBLOCK |
+                    O_DSYNC | O_DIRECTORY | O_NOFOLLOW | O_SYNC);
+}
+
+// Handle one T-message in `in` and build the R-message in `out`. Returns the
+// errno to send as Rlerror, or 0. Tread/Twrite move their payloads through
+// the chain directly and report the count in `*data_len`.
+int P9Handle(State *state, P9Server *server, VirtqChain *chain, P9Msg *in, P9Msg *out,
+             uint8_t type, uint32_t *data_len) {
+    char name[P9_NAME_MAX];
+    char name2[P9_NAME_MAX];
+    struct stat st;
+
+    switch (type) {
+    case P9Tversion: {
+        uint32_t msize = P9Get(in, 4);
+        P9GetString(in, name);
+        server->msize = msize < P9_MSIZE ? msize : P9_MSIZE;
+        // A new session implicitly clunks every fid.
+        for (uint32_t i = 0; i < server->fids_len; i++) {
+            if (server->fids[i].used) {
+                ClunkFid(&server->fids[i]);
+            }
+        }
+        P9Put(out, 4, server->msize);
+        P9PutString(out, strcmp(name, "9P2000.L") ? "unknown" : "9P2000.L");
+        return 0;
+    }
+    case P9Tattach: {
+        uint32_t fid = P9Get(in, 4);
+        if (stat(server->root, &st) < 0) {
+            return errno;
+        }
+        if (NewFid(server, fid, strdup(server->root)) == NULL) {
+            return EMFILE;
+        }
+        P9PutQid(out, &st);
+        return 0;
+    }
+    case P9Twalk: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        uint32_t newfid = P9Get(in, 4);
+        uint16_t nwname = P9Get(in, 2);
+        if (fid == NULL) {
+            return EBADF;
+        }
+        if (nwname > P9_MAX_WALK) {
+            return EINVAL;
+        }
+        char *path = strdup(fid->path);
+        uint32_t count_pos = out->pos;
+        P9Put(out, 2, 0);
+        uint16_t nwqid = 0;
+        for (; nwqid < nwname; nwqid++) {
+            P9GetString(in, name);
+            char *next = in->error ? NULL : JoinPath(server, path, name);
+            if (next == NULL || StatBeneath(server, next, &st) < 0) {
+                int err = next == NULL ? EINVAL : errno;
+                free(next);
+                if (nwqid == 0) {
+                    free(path);
+                    return err;
+                }
+                break;
+            }
+            free(path);
+            path = next;
+            P9PutQid(out, &st);
+        }
+        out->buf[count_pos] = nwqid;
+        out->buf[count_pos + 1] = nwqid >> 8;
+        // Only a complete walk creates newfid.
+        if (nwqid < nwname) {
+            free(path);
+        } else if (NewFid(server, newfid, path) == NULL) {
+            return EMFILE;
+        }
+        return 0;
+    }
+    case P9Tgetattr: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        if (fid == NULL) {
+            return EBADF;
+        }
+        if (StatBeneath(server, fid->path, &st) < 0) {
+            return errno;
+        }
+        // P9_GETATTR_BASIC: everything but btime, gen and data_version.
+        P9Put(out, 8, 0x7ff);
+        P9PutQid(out, &st);
+        P9Put(out, 4, st.st_mode);
+        P9Put(out, 4, st.st_uid);
+        P9Put(out, 4, st.st_gid);
+        P9Put(out, 8, st.st_nlink);
+        P9Put(out, 8, st.st_rdev);
+        P9Put(out, 8, st.st_size);
+        P9Put(out, 8, st.st_blksize);
+        P9Put(out, 8, st.st_blocks);
+        P9Put(out, 8, st.st_atim.tv_sec);
+        P9Put(out, 8, st.st_atim.tv_nsec);
+        P9Put(out, 8, st.st_mtim.tv_sec);
+        P9Put(out, 8, st.st_mtim.tv_nsec);
+        P9Put(out, 8, st.st_ctim.tv_sec);
+        P9Put(out, 8, st.st_ctim.tv_nsec);
+        for (int i = 0; i < 4; i++) {
+            P9Put(out, 8, 0);
+        }
+        return 0;
+    }
+    case P9Tsetattr: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        uint32_t valid = P9Get(in, 4);
+        uint32_t mode = P9Get(in, 4);
+        P9Get(in, 8); // uid and gid
+        uint64_t size = P9Get(in, 8);
+        if (fid == NULL) {
+            return EBADF;
+        }
+        if (valid & 0x01) {
+            // fchmodat() can't be told not to follow a link, so refuse links.
+            const char *name;
+            int dir = OpenParent(server, fid->path, &name);
+            if (dir < 0) {
+                return errno;
+            }
+            int err = 0;
+            if (fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                err = errno;
+            } else if (S_ISLNK(st.st_mode)) {
+                err = ELOOP;
+            } else if (fchmodat(dir, name, mode & 07777, 0) < 0) {
+                err = errno;
+            }
+            close(dir);
+            if (err != 0) {
+                return err;
+            }
+        }
+        if (valid & 0x08) {
+            int fd = OpenBeneath(server, fid->path, O_WRONLY, 0);
+            if (fd < 0) {
+                return errno;
+            }
+            int err = ftruncate(fd, size) < 0 ? errno : 0;
+            close(fd);
+            if (err != 0) {
+                return err;
+            }
+        }
+        // Time updates are accepted and ignored.
+        return 0;
+    }
+    case P9Tlopen: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        uint32_t flags = P9Get(in, 4);
+        // Opening an open fid again is an error, as in the kernel's server.
+        if (fid == NULL || fid->fd >= 0 || fid->dir != NULL) {
+            return EBADF;
+        }
+        if (StatBeneath(server, fid->path, &st) < 0) {
+            return errno;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int fd = OpenBeneath(server, fid->path, O_RDONLY | O_DIRECTORY, 0);
+            fid->dir = fd < 0 ? NULL : fdopendir(fd);
+            if (fid->dir == NULL) {
+                int err = errno;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return err;
+            }
+            fid->dir_pos = 0;
+        } else {
+            fid->fd = OpenBeneath(server, fid->path, OpenFlags(flags) & ~O_CREAT, 0);
+            if (fid->fd < 0) {
+                return errno;
+            }
+        }
+        P9PutQid(out, &st);
+        P9Put(out, 4, 0);
+        return 0;
+    }
+    case P9Tlcreate: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        P9GetString(in, name);
+        uint32_t flags = P9Get(in, 4);
+        uint32_t mode = P9Get(in, 4);
+        if (fid == NULL || fid->fd >= 0 || fid->dir != NULL) {
+            return EBADF;
+        }
+        char *path = in->error ? NULL : JoinPath(server, fid->path, name);
+        if (path == NULL) {
+            return EINVAL;
+        }
+        int fd = OpenBeneath(server, path, OpenFlags(flags) | O_CREAT, mode & 07777);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            int err = errno;
+            if (fd >= 0) {
+                close(fd);
+            }
+            free(path);
+            return err;
+        }
+        // The fid now stands for the new, opened file.
+        free(fid->path);
+        fid->path = path;
+        fid->fd = fd;
+        P9PutQid(out, &st);
+        P9Put(out, 4, 0);
+        return 0;
+    }
+    case P9Tread:
+    case P9Twrite: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        uint64_t offset = P9Get(in, 8);
+        uint32_t count = P9Get(in, 4);
+        if (fid == NULL || fid->fd < 0) {
+            return EBADF;
+        }
+        uint32_t limit = type == P9Tread ? server->msize - P9_HEADER_SIZE - 4 : in->size - in->pos;
+        if (count > limit) {
+            count = limit;
+        }
+        // Read into the response buffers after size[4] type[1] tag[2]
+        // count[4]; write from the request buffers after its header.
+        struct iovec iov[VIRTQ_CHAIN_MAX];
+        int iovcnt = type == P9Tread
+            ? ChainIovec(state, chain, true, P9_HEADER_SIZE + 4, iov, VIRTQ_CHAIN_MAX)
+            : ChainIovec(state, chain, false, in->pos, iov, VIRTQ_CHAIN_MAX);
+        uint32_t room = count;
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len > room) {
+                iov[i].iov_len = room;
+            }
+            room -= iov[i].iov_len;
+        }
+        ssize_t n = type == P9Tread ? preadv(fid->fd, iov, iovcnt, offset)
+                                    : pwritev(fid->fd, iov, iovcnt, offset);
+        if (n < 0) {
+            return errno;
+        }
+        P9Put(out, 4, n);
+        if (type == P9Tread) {
+            *data_len = n;
+        }
+        return 0;
+    }
+    case P9Treaddir: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        uint64_t offset = P9Get(in, 8);
+        uint32_t count = P9Get(in, 4);
+        if (fid == NULL || fid->dir == NULL) {
+            return EBADF;
+        }
+        if (offset != fid->dir_pos) {
+            rewinddir(fid->dir);
+            fid->dir_pos = 0;
+            while (fid->dir_pos < offset && readdir(fid->dir) != NULL) {
+                fid->dir_pos++;
+            }
+        }
+        uint32_t count_pos = out->pos;
+        P9Put(out, 4, 0);
+        if (count > out->len - out->pos) {
+            count = out->len - out->pos;
+        }
+        uint32_t start = out->pos;
+        for (;;) {
+            long cookie = telldir(fid->dir);
+            struct dirent *entry = readdir(fid->dir);
+            if (entry == NULL) {
+                break;
+            }
+            // qid[13] offset[8] type[1] name[s]
+            uint32_t size = 13 + 8 + 1 + 2 + strlen(entry->d_name);
+            if (out->pos - start + size > count) {
+                seekdir(fid->dir, cookie);
+                break;
+            }
+            fid->dir_pos++;
+            P9Put(out, 1, entry->d_type == DT_DIR ? 0x80 : entry->d_type == DT_LNK ? 0x02 : 0);
+            P9Put(out, 4, 0);
+            P9Put(out, 8, entry->d_ino);
+            P9Put(out, 8, fid->dir_pos);
+            P9Put(out, 1, entry->d_type);
+            P9PutString(out, entry->d_name);
+        }
+        uint32_t len = out->pos - start;
+        memcpy(out->buf + count_pos, &len, 4);
+        return 0;
+    }
+    case P9Tmkdir: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        P9GetString(in, name);
+        uint32_t mode = P9Get(in, 4);
+        if (fid == NULL) {
+            return EBADF;
+        }
+        char *path = in->error ? NULL : JoinPath(server, fid->path, name);
+        if (path == NULL) {
+            return EINVAL;
+        }
+        const char *base;
+        int dir = OpenParent(server, path, &base);
+        int err = 0;
+        if (dir < 0 || mkdirat(dir, base, mode & 07777) < 0 ||
+            fstatat(dir, base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            err = errno;
+        } else {
+            P9PutQid(out, &st);
+        }
+        if (dir >= 0) {
+            close(dir);
+        }
+        free(path);
+        return err;
+    }
+    case P9Tunlinkat: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        P9GetString(in, name);
+        uint32_t flags = P9Get(in, 4);
+        if (fid == NULL) {
+            return EBADF;
+        }
+        char *path = in->error ? NULL : JoinPath(server, fid->path, name);
+        if (path == NULL || !strcmp(path, server->root)) {
+            free(path);
+            return EINVAL;
+        }
+        const char *base;
+        int dir = OpenParent(server, path, &base);
+        // The guest's flags are the generic values too; keep AT_REMOVEDIR.
+        int err = dir < 0 || unlinkat(dir, base, flags & AT_REMOVEDIR) < 0 ? errno : 0;
+        if (dir >= 0) {
+            close(dir);
+        }
+        free(path);
+        return err;
+    }
+    case P9Trenameat: {
+        P9Fid *old_dir = GetFid(server, P9Get(in, 4));
+        P9GetString(in, name);
+        P9Fid *new_dir = GetFid(server, P9Get(in, 4));
+        P9GetString(in, name2);
+        if (old_dir == NULL || new_dir == NULL) {
+            return EBADF;
+        }
+        char *old_path = in->error ? NULL : JoinPath(server, old_dir->path, name);
+        char *new_path = in->error ? NULL : JoinPath(server, new_dir->path, name2);
+        int err = EINVAL;
+        if (old_path != NULL && new_path != NULL) {
+            const char *old_base;
+            const char *new_base;
+            int old_fd = OpenParent(server, old_path, &old_base);
+            int new_fd = old_fd < 0 ? -1 : OpenParent(server, new_path, &new_base);
+            if (new_fd < 0) {
+                err = errno;
+            } else {
+                err = renameat(old_fd, old_base, new_fd, new_base) < 0 ? errno : 0;
+            }
+            if (old_fd >= 0) {
+                close(old_fd);
+            }
+            if (new_fd >= 0) {
+                close(new_fd);
+            }
+        }
+        free(old_path);
+        free(new_path);
+        return err;
+    }
+    case P9Tfsync: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        if (fid == NULL || fid->fd < 0) {
+            return EBADF;
+        }
+        return fsync(fid->fd) < 0 ? errno : 0;
+    }
+    case P9Tstatfs: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        struct statfs sfs;
+        if (fid == NULL) {
+            return EBADF;
+        }
+        int fd = OpenBeneath(server, fid->path, O_PATH, 0);
+        int err = fd < 0 || fstatfs(fd, &sfs) < 0 ? errno : 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (err != 0) {
+            return err;
+        }
+        P9Put(out, 4, 0x01021997); // V9FS_MAGIC
+        P9Put(out, 4, sfs.f_bsize);
+        P9Put(out, 8, sfs.f_blocks);
+        P9Put(out, 8, sfs.f_bfree);
+        P9Put(out, 8, sfs.f_bavail);
+        P9Put(out, 8, sfs.f_files);
+        P9Put(out, 8, sfs.f_ffree);
+        P9Put(out, 8, 0);
+        P9Put(out, 4, sfs.f_namelen);
+        return 0;
+    }
+    case P9Tclunk: {
+        P9Fid *fid = GetFid(server, P9Get(in, 4));
+        if (fid == NULL) {
+            return EBADF;
+        }
+        ClunkFid(fid);
+        return 0;
+    }
+    case P9Tflush:
+        // Requests complete synchronously, so there is never anything to flush.
+        return 0;
+    default:
+        return EOPNOTSUPP;
+    }
+}
+
+void P9Request(State *state, Virtio *virtio, VirtqChain *chain) {
+    P9Server *server = virtio->p9;
+    // Twrite payloads stay in guest memory, so only the first part of a
+    // request needs to be copied; every other request fits in P9_IN_SIZE.
+    P9Msg in = {.buf = server->in};
+    in.len = ReadChain(state, chain, 0, server->in, P9_IN_SIZE);
+    in.size = P9Get(&in, 4);
+    if (in.size < in.len) {
+        in.len = in.size;
+    }
+    P9Msg out = {.buf = server->out, .len = server->msize, .pos = P9_HEADER_SIZE};
+    uint8_t type = P9Get(&in, 1);
+    uint16_t tag = P9Get(&in, 2);
+
+    uint32_t data_len = 0;
+    int err = in.error ? EINVAL : P9Handle(state, server, chain, &in, &out, type, &data_len);
+    if (err == 0 && (in.error || out.error)) {
+        err = in.error ? EINVAL : ENOBUFS;
+    }
+    // Every R-message type is its T-message type + 1.
+    uint8_t reply = type + 1;
+    if (err != 0) {
+        out.pos = P9_HEADER_SIZE;
+        out.error = false;
+        P9Put(&out, 4, err);
+        reply = P9Rlerror;
+        data_len = 0;
+    }
+
+    uint32_t size = out.pos + data_len;
+    out.pos = 0;
+    P9Put(&out, 4, size);
+    P9Put(&out, 1, reply);
+    P9Put(&out, 2, tag);
+    // Write the header and fixed fields; Rread data is already in place.
+    WriteChain(state, chain, 0, server->out, size - data_len);
+    VirtqueuePush(state, virtio, &virtio->queue[0], chain, size);
+}
+
+void P9Notify(State *state, Virtio *virtio, uint32_t queue) {
+    VirtqChain chain;
+    while (VirtqueuePop(state, virtio, &virtio->queue[0], &chain)) {
+        P9Request(state, virtio, &chain);
+    }
+}
+
+Virtio *NewVirtio9p(const char *dir, const char *tag) {
+    Virtio *virtio = NewVirtio(VIRTIO_ID_9P);
+    P9Server *server = calloc(1, sizeof(P9Server));
+    server->root = realpath(dir, NULL);
+    struct stat st;
+    if (server->root == NULL || stat(server->root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        Error("Can't share the directory: %s", dir);
+    }
+    server->msize = P9_MSIZE;
+    server->in = malloc(P9_IN_SIZE);
+    server->out = malloc(P9_MSIZE);
+
+    // The config space is the mount tag: tag_len[2] tag[tag_len].
+    uint16_t len = strlen(tag);
+    if (len > VIRTIO_CONFIG_SIZE - 2) {
+        Error("Too long mount tag: %s", tag);
+    }
+    memcpy(virtio->config, &len, 2);
+    memcpy(virtio->config + 2, tag, len);
+    virtio->host_features |= SetOneBit(P9_MOUNT_TAG);
+    virtio->p9 = server;
+    virtio->notify = P9Notify;
+    return virtio;
+}
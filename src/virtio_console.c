@@ -0,0 +1,89 @@
+#include "rve.h"
+
+// virtio-console with a single port.
+//
+// Queue 0 (receiveq) is filled from the console input ring whenever input
+// is waiting, and queue 1 (transmitq) is written to the host one descriptor
+// per system call straight out of guest memory.
+
+#define VIRTIO_CONSOLE_RX 0
+#define VIRTIO_CONSOLE_TX 1
+
+void VirtioConsoleTransmit(State *state, Virtio *virtio) {
+    VirtQueue *vq = &virtio->queue[VIRTIO_CONSOLE_TX];
+    VirtqChain chain;
+    while (VirtqueuePop(state, virtio, vq, &chain)) {
+        for (int i = 0; i < chain.num; i++) {
+            VirtqDesc *desc = &chain.desc[i];
+            if (desc->flags & VRING_DESC_F_WRITE) {
+                continue;
+            }
+            uint8_t *buf = GuestRam(state, desc->addr, desc->len);
+            if (buf != NULL) {
+                ConsoleWrite(virtio->console, buf, desc->len);
+                continue;
+            }
+            for (uint32_t j = 0; j < desc->len; j++) {
+                ConsolePutc(virtio->console, MemRead8(state, desc->addr + j));
+            }
+        }
+        VirtqueuePush(state, virtio, vq, &chain, 0);
+    }
+}
+
+void VirtioConsoleReceive(State *state, Virtio *virtio) {
+    VirtQueue *vq = &virtio->queue[VIRTIO_CONSOLE_RX];
+    InputRing *input = &virtio->console->input;
+    VirtqChain chain;
+    // Only take a buffer from the guest once there's something to put in it.
+    while (__atomic_load_n(&input->tail, __ATOMIC_ACQUIRE) != input->head &&
+           VirtqueuePop(state, virtio, vq, &chain)) {
+        uint32_t written = 0;
+        for (int i = 0; i < chain.num; i++) {
+            VirtqDesc *desc = &chain.desc[i];
+            if ((desc->flags & VRING_DESC_F_WRITE) == 0) {
+                continue;
+            }
+            uint8_t *buf = GuestRam(state, desc->addr, desc->len);
+            uint32_t j = 0;
+            int ch;
+            while (j < desc->len && (ch = PopInput(input)) >= 0) {
+                if (buf != NULL) {
+                    buf[j++] = ch;
+                } else {
+                    MemWrite8(state, desc->addr + j++, ch);
+                }
+            }
+            if (buf != NULL) {
+                DeviceWroteRam(state, desc->addr, j);
+            }
+            written += j;
+            if (j < desc->len) {
+                break;
+            }
+        }
+        VirtqueuePush(state, virtio, vq, &chain, written);
+    }
+}
+
+void VirtioConsoleNotify(State *state, Virtio *virtio, uint32_t queue) {
+    if (queue == VIRTIO_CONSOLE_TX) {
+        VirtioConsoleTransmit(state, virtio);
+    }
+}
+
+void VirtioConsolePoll(State *state, Virtio *virtio) {
+    if ((virtio->status & VIRTIO_STATUS_DRIVER_OK) == 0) {
+        // The driver isn't ready (DRIVER_OK) yet.
+        return;
+    }
+    VirtioConsoleReceive(state, virtio);
+}
+
+Virtio *NewVirtioConsole(Console *console) {
+    Virtio *virtio = NewVirtio(VIRTIO_ID_CONSOLE);
+    virtio->console = console;
+    virtio->notify = VirtioConsoleNotify;
+    virtio->poll = VirtioConsolePoll;
+    return virtio;
+}
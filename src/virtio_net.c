@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+// virtio-net with local packet backends.
+//
+//   socket:PATH     A Unix seqpacket socket. The first instance listens on
+//                   PATH and the second one connects to it.
+//   tap:NAME        The TAP interface NAME.
+//   pcap:OUT[,IN]   Capture transmitted frames into the pcap file OUT and
+//                   replay the frames of IN to the guest as fast as it posts
+//                   receive buffers.
+//
+// Any of them takes a ",mac=XX:XX:XX:XX:XX:XX" suffix. Without it the MAC is
+// the locally administered 52:54:00 prefix followed by the low bytes of the
+// pid, so that two instances on one link don't collide.
+//
+// Frames are moved in batches: a notify sends every queued transmit chain
+// and a poll fills as many receive chains as there are pending frames.
+
+#define VIRTIO_NET_RX 0
+#define VIRTIO_NET_TX 1
+#define VIRTIO_NET_F_MAC 5
+#define VIRTIO_NET_HDR_SIZE 12
+#define VIRTIO_NET_LEGACY_HDR_SIZE 10
+#define NET_FRAME_MAX 65550
+// Ticks between two looks at the backend for received frames.
+#define NET_POLL_INTERVAL 256
+
+enum NetBackendType {
+    NetSocket,
+    NetTap,
+    NetPcap,
+};
+
+typedef struct PcapHeader {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} PcapHeader;
+
+typedef struct PcapRecord {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} PcapRecord;
+
+typedef struct NetBackend {
+    uint8_t type;
+    int fd;
+    int listen_fd;
+    FILE *capture;
+    FILE *replay;
+    uint64_t next_poll;
+    // A received frame waiting for a receive buffer.
+    uint8_t frame[NET_FRAME_MAX];
+    int64_t frame_len;
+    // Transmit data outside of RAM is gathered here.
+    uint8_t bounce[NET_FRAME_MAX];
+    // Transmitted frames that were dropped for being too long.
+    uint64_t tx_errors;
+} NetBackend;
+
+void OpenNetSocket(NetBackend *net, const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        Error("Too long socket path: %s", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    net->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (connect(net->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        return;
+    }
+    // Nobody is listening yet: become the listening side.
+    close(net->fd);
+    net->fd = -1;
+    unlink(path);
+    net->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (bind(net->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(net->listen_fd, 1) < 0) {
+        Error("Can't listen on %s: %s", path, strerror(errno));
+    }
+}
+
+void OpenNetTap(NetBackend *net, const char *name) {
+    net->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (net->fd < 0) {
+        Error("Can't open /dev/net/tun: %s", strerror(errno));
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(net->fd, TUNSETIFF, &ifr) < 0) {
+        Error("Can't attach to the TAP device %s: %s", name, strerror(errno));
+    }
+}
+
+void OpenNetPcap(NetBackend *net, char *files) {
+    char *replay = strchr(files, ',');
+    if (replay != NULL) {
+        *replay++ = '\0';
+        net->replay = fopen(replay, "rb");
+        PcapHeader header;
+        if (net->replay == NULL || fread(&header, sizeof(header), 1, net->replay) != 1 ||
+            header.magic != 0xa1b2c3d4) {
+            Error("Can't replay the pcap file: %s", replay);
+        }
+    }
+    net->capture = fopen(files, "wb");
+    if (net->capture == NULL) {
+        Error("Can't open the pcap file: %s", files);
+    }
+    PcapHeader header = {
+        .magic = 0xa1b2c3d4,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = NET_FRAME_MAX,
+        .network = 1, // Ethernet.
+    };
+    fwrite(&header, sizeof(header), 1, net->capture);
+}
+
+NetBackend *OpenNetBackend(const char *spec) {
+    NetBackend *net = calloc(1, sizeof(NetBackend));
+    net->fd = -1;
+    net->listen_fd = -1;
+    net->frame_len = -1;
+    char *arg = strdup(spec);
+    if (!strncmp(arg, "socket:", 7)) {
+        net->type = NetSocket;
+        OpenNetSocket(net, arg + 7);
+    } else if (!strncmp(arg, "tap:", 4)) {
+        net->type = NetTap;
+        OpenNetTap(net, arg + 4);
+    } else if (!strncmp(arg, "pcap:", 5)) {
+        net->type = NetPcap;
+        OpenNetPcap(net, arg + 5);
+    } else {
+        Error("Unknown network backend: %s", spec);
+    }
+    free(arg);
+    return net;
+}
+
+// Send a frame gathered from `iov`.
+void NetSend(NetBackend *net, struct iovec *iov, int iovcnt) {
+    if (net->type == NetPcap) {
+        PcapRecord record = {0};
+        for (int i = 0; i < iovcnt; i++) {
+            record.incl_len += iov[i].iov_len;
+        }
+        record.orig_len = record.incl_len;
+        fwrite(&record, sizeof(record), 1, net->capture);
+        for (int i = 0; i < iovcnt; i++) {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, net->capture);
+        }
+        return;
+    }
+    if (net->fd >= 0) {
+        // Frames are dropped when the peer is missing or can't keep up, like on a wire.
+        writev(net->fd, iov, iovcnt);
+    }
+}
+
+// Receive the next frame into net->frame. Return false if there's none.
+bool NetRecv(NetBackend *net) {
+    if (net->frame_len >= 0) {
+        return true;
+    }
+    if (net->type == NetPcap) {
+        PcapRecord record;
+        if (net->replay == NULL || fread(&record, sizeof(record), 1, net->replay) != 1 ||
+            record.incl_len > NET_FRAME_MAX ||
+            fread(net->frame, 1, record.incl_len, net->replay) != record.incl_len) {
+            return false;
+        }
+        net->frame_len = record.incl_len;
+        return true;
+    }
+    if (net->fd < 0 && net->listen_fd >= 0) {
+        net->fd = accept4(net->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (net->fd < 0) {
+            return false;
+        }
+    }
+    ssize_t n = read(net->fd, net->frame, sizeof(net->frame));
+    if (n == 0 && net->type == NetSocket) {
+        // The peer went away; wait for the next one.
+        close(net->fd);
+        net->fd = -1;
+        return false;
+    }
+    if (n <= 0) {
+        return false;
+    }
+    net->frame_len = n;
+    return true;
+}
+
+uint32_t NetHeaderSize(Virtio *virtio) {
+    if (virtio->guest_features >> VIRTIO_F_VERSION_1 & 1) {
+        return VIRTIO_NET_HDR_SIZE;
+    }
+    return VIRTIO_NET_LEGACY_HDR_SIZE;
+}
+
+void VirtioNetTransmit(State *state, Virtio *virtio) {
+    VirtQueue *vq = &virtio->queue[VIRTIO_NET_TX];
+    uint32_t skip_size = NetHeaderSize(virtio);
+    uint8_t *bounce = virtio->net->bounce;
+    VirtqChain chain;
+    while (VirtqueuePop(state, virtio, vq, &chain)) {
+        struct iovec iov[VIRTQ_CHAIN_MAX];
+        int iovcnt = 0;
+        uint32_t skip = skip_size;
+        size_t bounce_len = 0;
+        uint64_t frame_len = 0;
+        for (int i = 0; i < chain.num; i++) {
+            VirtqDesc *desc = &chain.desc[i];
+            uint64_t addr = desc->addr;
+            uint32_t len = desc->len;
+            // Drop the virtio-net header in front of the frame.
+            uint32_t n = skip < len ? skip : len;
+            skip -= n;
+            addr += n;
+            len -= n;
+            if (len == 0 || (desc->flags & VRING_DESC_F_WRITE)) {
+                continue;
+            }
+            frame_len += len;
+            if (frame_len > NET_FRAME_MAX) {
+                break;
+            }
+            uint8_t *buf = GuestRam(state, addr, len);
+            if (buf == NULL) {
+                // Not in RAM: copy it out through the bounce buffer.
+                buf = bounce + bounce_len;
+                for (uint32_t j = 0; j < len; j++) {
+                    buf[j] = MemRead8(state, addr + j);
+                }
+                bounce_len += len;
+            }
+            iov[iovcnt].iov_base = buf;
+            iov[iovcnt].iov_len = len;
+            iovcnt++;
+        }
+        // A frame longer than any the backends take is dropped, not truncated.
+        if (frame_len > NET_FRAME_MAX) {
+            virtio->net->tx_errors++;
+        } else {
+            NetSend(virtio->net, iov, iovcnt);
+        }
+        VirtqueuePush(state, virtio, vq, &chain, 0);
+    }
+    if (virtio->net->capture != NULL) {
+        fflush(virtio->net->capture);
+    }
+}
+
+void VirtioNetReceive(State *state, Virtio *virtio) {
+    VirtQueue *vq = &virtio->queue[VIRTIO_NET_RX];
+    NetBackend *net = virtio->net;
+    uint32_t header_size = NetHeaderSize(virtio);
+    VirtqChain chain;
+    while (NetRecv(net) && VirtqueuePop(state, virtio, vq, &chain)) {
+        // An all-zero header with num_buffers = 1: no offloads, one buffer per frame.
+        uint8_t header[VIRTIO_NET_HDR_SIZE] = {[10] = 1};
+        uint8_t *src[2] = {header, net->frame};
+        uint64_t left[2] = {header_size, net->frame_len};
+        uint32_t written = 0;
+        int part = 0;
+        for (int i = 0; i < chain.num && part < 2; i++) {
+            VirtqDesc *desc = &chain.desc[i];
+            if ((desc->flags & VRING_DESC_F_WRITE) == 0) {
+                continue;
+            }
+            uint32_t off = 0;
+            while (off < desc->len && part < 2) {
+                uint64_t n = desc->len - off < left[part] ? desc->len - off : left[part];
+                uint8_t *buf = GuestRam(state, desc->addr + off, n);
+                for (uint64_t j = 0; buf == NULL && j < n; j++) {
+                    MemWrite8(state, desc->addr + off + j, src[part][j]);
+                }
+                if (buf != NULL) {
+                    memcpy(buf, src[part], n);
+                    DeviceWroteRam(state, desc->addr + off, n);
+                }
+                src[part] += n;
+                left[part] -= n;
+                off += n;
+                written += n;
+                if (left[part] == 0) {
+                    part++;
+                }
+            }
+        }
+        // A frame that doesn't fit is truncated, as the guest asked for small buffers.
+        net->frame_len = -1;
+        VirtqueuePush(state, virtio, vq, &chain, written);
+    }
+}
+
+void VirtioNetNotify(State *state, Virtio *virtio, uint32_t queue) {
+    if (queue == VIRTIO_NET_TX) {
+        VirtioNetTransmit(state, virtio);
+    } else if (queue == VIRTIO_NET_RX) {
+        VirtioNetReceive(state, virtio);
+    }
+}
+
+void VirtioNetPoll(State *state, Virtio *virtio) {
+    if ((virtio->status & VIRTIO_STATUS_DRIVER_OK) == 0 || state->clock < virtio->net->next_poll) {
+        return;
+    }
+    virtio->net->next_poll = state->clock + NET_POLL_INTERVAL;
+    VirtioNetReceive(state, virtio);
+}
+
+// Parse a unicast MAC address written as XX:XX:XX:XX:XX:XX.
+bool ParseMac(const char *str, uint8_t mac[6]) {
+    int len = 0;
+    if (sscanf(str, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n", &mac[0], &mac[1], &mac[2], &mac[3],
+               &mac[4], &mac[5], &len) != 6) {
+        return false;
+    }
+    return str[len] == '\0' && (mac[0] & 1) == 0;
+}
+
+Virtio *NewVirtioNet(const char *spec) {
+    pid_t pid = getpid();
+    uint8_t mac[6] = {0x52, 0x54, 0x00, pid >> 16, pid >> 8, pid};
+    char *backend = strdup(spec);
+    char *mac_opt = strstr(backend, ",mac=");
+    if (mac_opt != NULL) {
+        *mac_opt = '\0';
+        if (!ParseMac(mac_opt + 5, mac)) {
+            Error("Invalid MAC address: %s", mac_opt + 5);
+        }
+    }
+
+    Virtio *virtio = NewVirtio(VIRTIO_ID_NET);
+    virtio->net = OpenNetBackend(backend);
+    virtio->notify = VirtioNetNotify;
+    virtio->poll = VirtioNetPoll;
+    virtio->host_features |= SetOneBit(VIRTIO_NET_F_MAC);
+    memcpy(virtio->config, mac, sizeof(mac));
+    free(backend);
+    return virtio;
+}
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// virtio-vsock bridged to host Unix domain sockets.
+//
+// The host is CID 2 and the guest gets the configured CID. The mapping
+// follows the convention of other hypervisors:
+//
+// - A guest connection to host port P is forwarded to the Unix socket
+//   "<path>_<P>".
+// - Host programs connect to the Unix socket "<path>" and send
+//   "CONNECT <port>\n" to reach a guest port; rve answers "OK <port>\n" with
+//   the host side port once the guest accepts.
+//
+// Stream data is moved between the virtqueues and the sockets with
+// readv/writev straight from guest memory, and every poll fills as many
+// receive buffers as there is data and credit for. Guest data that a host
+// socket doesn't take right away waits in a per-connection buffer; the
+// credit we give the guest counts only the bytes the socket took, so the
+// buffer never holds more than VSOCK_BUF_ALLOC.
+
+#define VSOCK_RX 0
+#define VSOCK_TX 1
+#define VSOCK_HOST_CID 2
+#define VSOCK_CONN_MAX 64
+#define VSOCK_CTRL_MAX 128
+#define VSOCK_BUF_ALLOC (256 * 1024)
+#define VSOCK_POLL_INTERVAL 256
+// Host side ports of host initiated connections start here.
+#define VSOCK_EPHEMERAL_PORT 0x40000000
+
+#define VSOCK_TYPE_STREAM 1
+
+enum VsockOp {
+    VsockOpInvalid = 0,
+    VsockOpRequest = 1,
+    VsockOpResponse = 2,
+    VsockOpRst = 3,
+    VsockOpShutdown = 4,
+    VsockOpRw = 5,
+    VsockOpCreditUpdate = 6,
+    VsockOpCreditRequest = 7,
+};
+
+enum VsockConnState {
+    VsockFree = 0,
+    // A host program connected and hasn't sent its CONNECT line yet.
+    VsockHandshake,
+    // Waiting for the guest to answer our request.
+    VsockConnecting,
+    VsockConnected,
+};
+
+typedef struct __attribute__((packed)) VsockHeader {
+    uint64_t src_cid;
+    uint64_t dst_cid;
+    uint32_t src_port;
+    uint32_t dst_port;
+    uint32_t len;
+    uint16_t type;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t buf_alloc;
+    uint32_t fwd_cnt;
+} VsockHeader;
+
+typedef struct VsockConn {
+    uint8_t state;
+    int fd;
+    uint32_t host_port;
+    uint32_t guest_port;
+    // Credit of the guest: we may have peer_buf_alloc bytes in flight.
+    uint32_t peer_buf_alloc;
+    uint32_t peer_fwd_cnt;
+    uint32_t tx_cnt;
+    // Bytes of the guest written to the host socket.
+    uint32_t fwd_cnt;
+    uint32_t last_fwd_cnt;
+    bool host_eof;
+    // SHUTDOWN flags the guest sent; they take effect once `pending` drains.
+    uint32_t guest_shutdown;
+    bool shut_wr;
+    // Guest data the host socket hasn't taken yet, of VSOCK_BUF_ALLOC bytes.
+    uint8_t *pending;
+    uint32_t pending_len;
+    char line[32];
+    int line_len;
+} VsockConn;
+
+typedef struct Vsock {
+    char *uds_path;
+    int listen_fd;
+    uint64_t guest_cid;
+    uint32_t next_port;
+    uint64_t next_poll;
+    VsockConn conn[VSOCK_CONN_MAX];
+    // Control packets waiting for a receive buffer.
+    VsockHeader ctrl[VSOCK_CTRL_MAX];
+    int ctrl_len;
+} Vsock;
+
+VsockConn *FindConn(Vsock *vsock, uint32_t host_port, uint32_t guest_port) {
+    for (int i = 0; i < VSOCK_CONN_MAX; i++) {
+        VsockConn *conn = &vsock->conn[i];
+        if (conn->state != VsockFree && conn->state != VsockHandshake &&
+            conn->host_port == host_port && conn->guest_port == guest_port) {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+VsockConn *AllocConn(Vsock *vsock) {
+    for (int i = 0; i < VSOCK_CONN_MAX; i++) {
+        if (vsock->conn[i].state == VsockFree) {
+            memset(&vsock->conn[i], 0, sizeof(VsockConn));
+            vsock->conn[i].fd = -1;
+            return &vsock->conn[i];
+        }
+    }
+    return NULL;
+}
+
+void CloseConn(VsockConn *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    free(conn->pending);
+    conn->pending = NULL;
+    conn->pending_len = 0;
+    conn->state = VsockFree;
+}
+
+VsockHeader ConnHeader(Vsock *vsock, VsockConn *conn, uint16_t op) {
+    VsockHeader header = {
+        .src_cid = VSOCK_HOST_CID,
+        .dst_cid = vsock->guest_cid,
+        .src_port = conn->host_port,
+        .dst_port = conn->guest_port,
+        .type = VSOCK_TYPE_STREAM,
+        .op = op,
+        .buf_alloc = VSOCK_BUF_ALLOC,
+        .fwd_cnt = conn->fwd_cnt,
+    };
+    return header;
+}
+
+void QueueCtrl(Vsock *vsock, VsockHeader header) {
+    if (vsock->ctrl_len == VSOCK_CTRL_MAX) {
+        // The guest stopped posting receive buffers; it'll time out.
+        return;
+    }
+    vsock->ctrl[vsock->ctrl_len++] = header;
+}
+
+void QueueConnCtrl(Vsock *vsock, VsockConn *conn, uint16_t op, uint32_t flags) {
+    VsockHeader header = ConnHeader(vsock, conn, op);
+    header.flags = flags;
+    if (op == VsockOpCreditUpdate || op == VsockOpRw) {
+        conn->last_fwd_cnt = conn->fwd_cnt;
+    }
+    QueueCtrl(vsock, header);
+}
+
+void QueueRst(Vsock *vsock, VsockHeader *request) {
+    VsockHeader header = {
+        .src_cid = VSOCK_HOST_CID,
+        .dst_cid = vsock->guest_cid,
+        .src_port = request->dst_port,
+        .dst_port = request->src_port,
+        .type = VSOCK_TYPE_STREAM,
+        .op = VsockOpRst,
+    };
+    QueueCtrl(vsock, header);
+}
+
+// Write as much of `buf` to the host socket as it takes without blocking.
+// Return the number of bytes written, or -1 if the connection failed.
+ssize_t ConnSend(VsockConn *conn, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(conn->fd, (const uint8_t *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Return credit once half of the buffer has been consumed.
+void ConnReturnCredit(Vsock *vsock, VsockConn *conn) {
+    if (conn->fwd_cnt - conn->last_fwd_cnt >= VSOCK_BUF_ALLOC / 2) {
+        QueueConnCtrl(vsock, conn, VsockOpCreditUpdate, 0);
+    }
+}
+
+// Pass guest data to the host socket, queueing what it doesn't take. Return
+// false if the connection failed or the guest sent past its credit.
+bool ConnWrite(VsockConn *conn, const void *buf, size_t len) {
+    ssize_t n = 0;
+    if (conn->pending_len == 0) {
+        n = ConnSend(conn, buf, len);
+        if (n < 0) {
+            return false;
+        }
+        conn->fwd_cnt += n;
+    }
+    if ((size_t)n == len) {
+        return true;
+    }
+    if (conn->pending_len + (len - n) > VSOCK_BUF_ALLOC) {
+        return false;
+    }
+    if (conn->pending == NULL) {
+        conn->pending = malloc(VSOCK_BUF_ALLOC);
+    }
+    memcpy(conn->pending + conn->pending_len, (const uint8_t *)buf + n, len - n);
+    conn->pending_len += len - n;
+    return true;
+}
+
+// Carry out the shutdown of the guest. Flag 1: the guest won't receive,
+// flag 2: the guest won't send. The connection is gone once neither side
+// sends any more.
+void ConnShutdown(Vsock *vsock, VsockConn *conn) {
+    if ((conn->guest_shutdown & 2) && !conn->shut_wr) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->shut_wr = true;
+    }
+    if ((conn->guest_shutdown & 3) == 3 || (conn->shut_wr && conn->host_eof)) {
+        QueueConnCtrl(vsock, conn, VsockOpRst, 0);
+        CloseConn(conn);
+    }
+}
+
+// Retry the queued guest data of every connection, and shut the host socket
+// down once the data the guest sent before its SHUTDOWN is out.
+void VsockFlush(Vsock *vsock) {
+    for (int i = 0; i < VSOCK_CONN_MAX; i++) {
+        VsockConn *conn = &vsock->conn[i];
+        if (conn->state != VsockConnected) {
+            continue;
+        }
+        if (conn->pending_len > 0) {
+            ssize_t n = ConnSend(conn, conn->pending, conn->pending_len);
+            if (n < 0) {
+                QueueConnCtrl(vsock, conn, VsockOpRst, 0);
+                CloseConn(conn);
+                continue;
+            }
+            memmove(conn->pending, conn->pending + n, conn->pending_len - n);
+            conn->pending_len -= n;
+            conn->fwd_cnt += n;
+            ConnReturnCredit(vsock, conn);
+        }
+        if (conn->pending_len == 0 && conn->guest_shutdown != 0) {
+            ConnShutdown(vsock, conn);
+        }
+    }
+}
+
+// Connect a guest request to its host socket. A Unix socket connects right
+// away or not at all: when the listener's backlog is full (EAGAIN) the guest
+// is refused rather than the whole machine blocked.
+void ConnectToHost(Vsock *vsock, VsockHeader *header) {
+    VsockConn *conn = AllocConn(vsock);
+    if (conn == NULL) {
+        QueueRst(vsock, header);
+        return;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", vsock->uds_path, header->dst_port);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        QueueRst(vsock, header);
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){VSOCK_BUF_ALLOC}, sizeof(int));
+    conn->fd = fd;
+    conn->state = VsockConnected;
+    conn->host_port = header->dst_port;
+    conn->guest_port = header->src_port;
+    conn->peer_buf_alloc = header->buf_alloc;
+    conn->peer_fwd_cnt = header->fwd_cnt;
+    QueueConnCtrl(vsock, conn, VsockOpResponse, 0);
+}
+
+// Handle a packet sent by the guest.
+void VsockHandlePacket(State *state, Virtio *virtio, VirtqChain *chain) {
+    Vsock *vsock = virtio->vsock;
+    VsockHeader header;
+    if (ReadChain(state, chain, 0, &header, sizeof(header)) != sizeof(header) ||
+        header.type != VSOCK_TYPE_STREAM || header.dst_cid != VSOCK_HOST_CID) {
+        return;
+    }
+
+    VsockConn *conn = FindConn(vsock, header.dst_port, header.src_port);
+    if (conn == NULL) {
+        if (header.op == VsockOpRequest) {
+            ConnectToHost(vsock, &header);
+        } else if (header.op != VsockOpRst) {
+            QueueRst(vsock, &header);
+        }
+        return;
+    }
+    conn->peer_buf_alloc = header.buf_alloc;
+    conn->peer_fwd_cnt = header.fwd_cnt;
+
+    switch (header.op) {
+    case VsockOpResponse:
+        if (conn->state == VsockConnecting) {
+            char reply[32];
+            int n = snprintf(reply, sizeof(reply), "OK %u\n", conn->host_port);
+            // The host program hasn't been sent anything before, so the
+            // socket always has room for the line.
+            if (ConnSend(conn, reply, n) != n) {
+                QueueConnCtrl(vsock, conn, VsockOpRst, 0);
+                CloseConn(conn);
+                break;
+            }
+            conn->state = VsockConnected;
+        }
+        break;
+    case VsockOpRw: {
+        struct iovec iov[VIRTQ_CHAIN_MAX];
+        int iovcnt = ChainIovec(state, chain, false, sizeof(header), iov, VIRTQ_CHAIN_MAX);
+        uint32_t left = header.len;
+        for (int i = 0; i < iovcnt && left > 0; i++) {
+            size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+            if (!ConnWrite(conn, iov[i].iov_base, n)) {
+                QueueConnCtrl(vsock, conn, VsockOpRst, 0);
+                CloseConn(conn);
+                return;
+            }
+            left -= n;
+        }
+        ConnReturnCredit(vsock, conn);
+    } break;
+    case VsockOpShutdown:
+        // VsockFlush carries it out after the data queued before it.
+        conn->guest_shutdown |= header.flags & 3;
+        break;
+    case VsockOpRst:
+        CloseConn(conn);
+        break;
+    case VsockOpCreditRequest:
+        QueueConnCtrl(vsock, conn, VsockOpCreditUpdate, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+void VsockTransmit(State *state, Virtio *virtio) {
+    VirtQueue *vq = &virtio->queue[VSOCK_TX];
+    VirtqChain chain;
+    while (VirtqueuePop(state, virtio, vq, &chain)) {
+        VsockHandlePacket(state, virtio, &chain);
+        VirtqueuePush(state, virtio, vq, &chain, 0);
+    }
+}
+
+// Accept host programs and read their CONNECT lines.
+void VsockAccept(Vsock *vsock) {
+    int fd;
+    while (vsock->listen_fd >= 0 && (fd = accept4(vsock->listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        VsockConn *conn = AllocConn(vsock);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->state = VsockHandshake;
+    }
+
+    for (int i = 0; i < VSOCK_CONN_MAX; i++) {
+        VsockConn *conn = &vsock->conn[i];
+        if (conn->state != VsockHandshake) {
+            continue;
+        }
+        // Read byte by byte so that no stream data after the line is consumed.
+        char ch;
+        ssize_t n;
+        while ((n = read(conn->fd, &ch, 1)) == 1 && ch != '\n' && conn->line_len < (int)sizeof(conn->line) - 1) {
+            conn->line[conn->line_len++] = ch;
+        }
+        if (n == 0 || (n == 1 && ch != '\n')) {
+            CloseConn(conn);
+            continue;
+        }
+        if (n < 0) {
+            continue;
+        }
+        conn->line[conn->line_len] = '\0';
+        unsigned int port;
+        if (sscanf(conn->line, "CONNECT %u", &port) != 1) {
+            CloseConn(conn);
+            continue;
+        }
+        conn->state = VsockConnecting;
+        conn->guest_port = port;
+        conn->host_port = vsock->next_port++;
+        QueueConnCtrl(vsock, conn, VsockOpRequest, 0);
+    }
+}
+
+// Fill receive buffers with control packets first and then stream data.
+void VsockReceive(State *state, Virtio *virtio) {
+    Vsock *vsock = virtio->vsock;
+    VirtQueue *vq = &virtio->queue[VSOCK_RX];
+    VirtqChain chain;
+
+    int sent = 0;
+    while (sent < vsock->ctrl_len && VirtqueuePop(state, virtio, vq, &chain)) {
+        WriteChain(state, &chain, 0, &vsock->ctrl[sent], sizeof(VsockHeader));
+        VirtqueuePush(state, virtio, vq, &chain, sizeof(VsockHeader));
+        sent++;
+    }
+    memmove(vsock->ctrl, vsock->ctrl + sent, (vsock->ctrl_len - sent) * sizeof(VsockHeader));
+    vsock->ctrl_len -= sent;
+    if (vsock->ctrl_len > 0) {
+        return;
+    }
+
+    for (int i = 0; i < VSOCK_CONN_MAX; i++) {
+        VsockConn *conn = &vsock->conn[i];
+        while (conn->state == VsockConnected && !conn->host_eof) {
+            uint32_t credit = conn->peer_buf_alloc - (conn->tx_cnt - conn->peer_fwd_cnt);
+            if (credit == 0) {
+                break;
+            }
+            struct pollfd pfd = {.fd = conn->fd, .events = POLLIN};
+            if (poll(&pfd, 1, 0) <= 0) {
+                break;
+            }
+            if (!VirtqueuePop(state, virtio, vq, &chain)) {
+                return;
+            }
+            struct iovec iov[VIRTQ_CHAIN_MAX];
+            int iovcnt = ChainIovec(state, &chain, true, sizeof(VsockHeader), iov, VIRTQ_CHAIN_MAX);
+            // Never send more than the guest has room for.
+            uint32_t room = credit;
+            for (int j = 0; j < iovcnt; j++) {
+                if (iov[j].iov_len > room) {
+                    iov[j].iov_len = room;
+                }
+                room -= iov[j].iov_len;
+            }
+            ssize_t n;
+            do {
+                n = readv(conn->fd, iov, iovcnt);
+            } while (n < 0 && errno == EINTR);
+            VsockHeader header = ConnHeader(vsock, conn, VsockOpRw);
+            bool again = n < 0 && errno == EAGAIN;
+            bool failed = n < 0 && !again;
+            if (again) {
+                // Nothing to read after all; the buffer carries a credit update.
+                header.op = VsockOpCreditUpdate;
+            } else if (failed) {
+                header.op = VsockOpRst;
+            } else if (n == 0) {
+                // The host closed its side for writing: tell the guest nothing
+                // more will come. The host may still read what the guest sends.
+                conn->host_eof = true;
+                header.op = VsockOpShutdown;
+                header.flags = 2;
+            }
+            n = n < 0 ? 0 : n;
+            header.len = n;
+            conn->tx_cnt += n;
+            conn->last_fwd_cnt = conn->fwd_cnt;
+            WriteChain(state, &chain, 0, &header, sizeof(header));
+            VirtqueuePush(state, virtio, vq, &chain, sizeof(header) + n);
+            if (failed) {
+                CloseConn(conn);
+            }
+            if (again) {
+                break;
+            }
+        }
+    }
+}
+
+void VsockNotify(State *state, Virtio *virtio, uint32_t queue) {
+    if (queue == VSOCK_TX) {
+        VsockTransmit(state, virtio);
+    }
+    VsockFlush(virtio->vsock);
+    VsockReceive(state, virtio);
+}
+
+void VsockPoll(State *state, Virtio *virtio) {
+    Vsock *vsock = virtio->vsock;
+    if ((virtio->status & VIRTIO_STATUS_DRIVER_OK) == 0 || state->clock < vsock->next_poll) {
+        return;
+    }
+    vsock->next_poll = state->clock + VSOCK_POLL_INTERVAL;
+    VsockAccept(vsock);
+    VsockFlush(vsock);
+    VsockReceive(state, virtio);
+}
+
+Virtio *NewVirtioVsock(const char *uds_path, uint64_t guest_cid) {
+    Virtio *virtio = NewVirtio(VIRTIO_ID_VSOCK);
+    Vsock *vsock = calloc(1, sizeof(Vsock));
+    vsock->uds_path = strdup(uds_path);
+    vsock->guest_cid = guest_cid;
+    vsock->next_port = VSOCK_EPHEMERAL_PORT;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(uds_path) >= sizeof(addr.sun_path) - 12) {
+        Error("Too long socket path: %s.", uds_path);
+    }
+    strcpy(addr.sun_path, uds_path);
+    unlink(uds_path);
+    vsock->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (bind(vsock->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(vsock->listen_fd, 16) < 0) {
+        Error("Can't listen on %s: %s.", uds_path, strerror(errno));
+    }
+
+    virtio->vsock = vsock;
+    virtio->notify = VsockNotify;
+    virtio->poll = VsockPoll;
+    memcpy(virtio->config, &guest_cid, sizeof(guest_cid));
+    return virtio;
+}
@@ -20,34 +20,8 @@ run_test() {
     fi
 }
 
-run_test_isa() {
-    files=${1}
-    failed=()
-    for file in $files ; do
-        ./bin/rve --debug "$file" &> /dev/null
-        if [ "$?" != "0" ]; then
-            echo "$file: fail"
-            failed+=($file)
-        else
-            echo "$file: pass"
-        fi
-    done
-
-    # for f in ${failed[@]}; do
-    #     echo "${f}"
-    # done
-
-    if [ "${#failed[*]}" = "0" ]; then
-        echo "All tests passed! :)"
-    else
-        echo "${#failed[*]} test(s) failed... :("
-    fi
-}
-
-run_test_isa "`find ./test/riscv-tests -not -name "*.dump" | grep rv64ui-p-`"
-run_test_isa "`find ./test/riscv-tests -not -name "*.dump" | grep rv64um-p-`"
-run_test_isa "`find ./test/riscv-tests -not -name "*.dump" | grep rv64ua-p-`"
-run_test_isa "`find ./test/riscv-tests -not -name "*.dump" | grep rv64uc-p-`"
+# The user-level suites, both bare (-p) and under virtual memory (-v).
+./bin/rve-test `find ./test/riscv-tests -name "rv64u[aicm]-[pv]-*" -not -name "*.dump"`
 
 cd test
 make clean &> /dev/null
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <math.h>
+
+// Microbenchmarks of the emulator hot paths.
+//
+// Every benchmark runs an isolated operation on a State of its own. The
+// number of operations per sample grows until a sample takes long enough to
+// time, then the samples give the mean, the standard deviation and the
+// minimum time per operation.
+
+#define BENCH_SAMPLE_NANOS 20000000
+#define BENCH_SAMPLES 10
+#define BENCH_MEM_SIZE 0x200000
+#define BENCH_DISK_SIZE 0x100000
+// Bytes per block request in the disk benchmark.
+#define BENCH_DISK_REQUEST 0x10000
+
+typedef struct Bench {
+    const char *name;
+    // Run the operation `n` times.
+    void (*run)(State *state, uint64_t n);
+    // Operations per call of `run` per unit of `n`, e.g. KiB per request.
+    uint64_t scale;
+    uint32_t instr;
+} Bench;
+
+// The instruction that the exec/ benchmarks run, set before each run.
+uint32_t bench_instr;
+
+State *NewBenchState() {
+    State *state = NewState(BENCH_MEM_SIZE);
+    ResetState(state);
+    state->x[6] = DRAM_BASE + 0x1000;
+    state->x[7] = 3;
+    return state;
+}
+
+// Map the gigapage at DRAM_BASE to itself and switch to S-mode.
+void EnablePaging(State *state) {
+    uint64_t root = DRAM_BASE + 0x2000;
+    MemWrite64(state, root + 8 * 2, (DRAM_BASE >> 12) << 10 | 0xcf);
+    state->csr[SATP] = (uint64_t)Sv39 << 60 | root >> 12;
+    state->mode = SUPERVISOR;
+}
+
+void RunExec(State *state, uint64_t n) {
+    uint32_t instr = bench_instr;
+    for (uint64_t i = 0; i < n; i++) {
+        state->pc = DRAM_BASE;
+        ExecInstruction(state, instr);
+    }
+}
+
+void RunTick(State *state, uint64_t n) {
+    MemWrite32(state, DRAM_BASE, bench_instr);
+    for (uint64_t i = 0; i < n; i++) {
+        state->pc = DRAM_BASE;
+        Tick(state);
+    }
+}
+
+void RunTranslateBare(State *state, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        Translate(state, DRAM_BASE + 0x123, AccessLoad);
+    }
+}
+
+void RunTranslateHit(State *state, uint64_t n) {
+    EnablePaging(state);
+    for (uint64_t i = 0; i < n; i++) {
+        Translate(state, DRAM_BASE + 0x123, AccessLoad);
+    }
+}
+
+void RunTranslateWalk(State *state, uint64_t n) {
+    EnablePaging(state);
+    // Page i and page i + TLB_SIZE share an entry, so every access misses.
+    for (uint64_t i = 0; i < n; i++) {
+        Translate(state, DRAM_BASE + (i % (2 * TLB_SIZE)) * PAGESIZE, AccessLoad);
+    }
+}
+
+void RunReadRam(State *state, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        MemRead64(state, DRAM_BASE + 0x1000);
+    }
+}
+
+void RunWriteRam(State *state, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        MemWrite64(state, DRAM_BASE + 0x1000, i);
+    }
+}
+
+void RunReadMmio(State *state, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        MemRead64(state, CLINT_BASE + CLINT_MTIMECMP_BASE);
+    }
+}
+
+void RunWriteMmio(State *state, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        MemWrite64(state, CLINT_BASE + CLINT_MTIMECMP_BASE, UINT64_MAX - i);
+    }
+}
+
+// Serve `n` block reads of BENCH_DISK_REQUEST bytes from a split ring.
+void RunDisk(State *state, uint64_t n) {
+    uint8_t *data = calloc(1, BENCH_DISK_SIZE);
+    Disk disk = {.base = data, .size = BENCH_DISK_SIZE, .overlay_fd = -1};
+    state->virtio->disk = &disk;
+    VirtQueue *vq = &state->virtio->queue[0];
+    vq->num = DESC_NUM;
+    vq->ready = 1;
+    vq->desc_addr = DRAM_BASE;
+    vq->driver_addr = DRAM_BASE + 0x1000;
+    vq->device_addr = DRAM_BASE + 0x2000;
+    uint64_t header = DRAM_BASE + 0x3000;
+    uint64_t buf = DRAM_BASE + 0x10000;
+    uint64_t status = DRAM_BASE + 0x4000;
+    MemWrite32(state, header, VIRTIO_BLK_T_IN);
+    MemWrite64(state, header + 8, 0);
+    uint64_t addrs[3] = {header, buf, status};
+    uint32_t lens[3] = {16, BENCH_DISK_REQUEST, 1};
+    uint16_t flags[3] = {VRING_DESC_F_NEXT, VRING_DESC_F_NEXT | VRING_DESC_F_WRITE, VRING_DESC_F_WRITE};
+    for (int i = 0; i < 3; i++) {
+        uint64_t desc = vq->desc_addr + VRING_DESC_SIZE * i;
+        MemWrite64(state, desc, addrs[i]);
+        MemWrite32(state, desc + 8, lens[i]);
+        MemWrite16(state, desc + 12, flags[i]);
+        MemWrite16(state, desc + 14, i + 1);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        uint16_t idx = MemRead16(state, vq->driver_addr + 2);
+        MemWrite16(state, vq->driver_addr + 4 + 2 * (idx % DESC_NUM), 0);
+        MemWrite16(state, vq->driver_addr + 2, idx + 1);
+        DiskAccess(state);
+    }
+    state->virtio->disk = NULL;
+    free(data);
+}
+
+void RunInterruptNone(State *state, uint64_t n) {
+    state->mode = USER;
+    for (uint64_t i = 0; i < n; i++) {
+        HandleInterrupt(state, DRAM_BASE);
+    }
+}
+
+Bench benches[] = {
+    {.name = "exec/add", .run = RunExec, .scale = 1, .instr = 0x007302b3},
+    {.name = "exec/addi", .run = RunExec, .scale = 1, .instr = 0x00130293},
+    {.name = "exec/mul", .run = RunExec, .scale = 1, .instr = 0x027302b3},
+    {.name = "exec/ld", .run = RunExec, .scale = 1, .instr = 0x00033283},
+    {.name = "exec/sd", .run = RunExec, .scale = 1, .instr = 0x00733023},
+    {.name = "exec/bne", .run = RunExec, .scale = 1, .instr = 0x00001463},
+    {.name = "exec/csrr", .run = RunExec, .scale = 1, .instr = 0x340022f3},
+    {.name = "exec/c.addi", .run = RunExec, .scale = 1, .instr = 0x0285},
+    {.name = "exec/amoadd.d", .run = RunExec, .scale = 1, .instr = 0x007332af},
+    {.name = "tick/add", .run = RunTick, .scale = 1, .instr = 0x007302b3},
+    {.name = "translate/bare", .run = RunTranslateBare, .scale = 1},
+    {.name = "translate/sv39-hit", .run = RunTranslateHit, .scale = 1},
+    {.name = "translate/sv39-walk", .run = RunTranslateWalk, .scale = 1},
+    {.name = "mem/read64-ram", .run = RunReadRam, .scale = 1},
+    {.name = "mem/write64-ram", .run = RunWriteRam, .scale = 1},
+    {.name = "mem/read64-mmio", .run = RunReadMmio, .scale = 1},
+    {.name = "mem/write64-mmio", .run = RunWriteMmio, .scale = 1},
+    {.name = "disk/read-per-kib", .run = RunDisk, .scale = BENCH_DISK_REQUEST / 1024},
+    {.name = "interrupt/none-pending", .run = RunInterruptNone, .scale = 1},
+};
+
+// The mean, standard deviation and minimum of `samples` times per operation.
+void RunBench(Bench *bench, int samples) {
+    bench_instr = bench->instr;
+    State *state = NewBenchState();
+    uint64_t n = 1000;
+    for (;;) {
+        uint64_t start = HostNanos();
+        bench->run(state, n);
+        if (HostNanos() - start >= BENCH_SAMPLE_NANOS / 10 || n >= (1ULL << 32)) {
+            break;
+        }
+        n *= 2;
+    }
+    double *ns = calloc(samples, sizeof(double));
+    double sum = 0;
+    double min = INFINITY;
+    for (int i = 0; i < samples; i++) {
+        uint64_t start = HostNanos();
+        bench->run(state, n * 10);
+        ns[i] = (double)(HostNanos() - start) / (n * 10 * bench->scale);
+        sum += ns[i];
+        min = ns[i] < min ? ns[i] : min;
+    }
+    double mean = sum / samples;
+    double var = 0;
+    for (int i = 0; i < samples; i++) {
+        var += (ns[i] - mean) * (ns[i] - mean);
+    }
+    double stddev = samples > 1 ? sqrt(var / (samples - 1)) : 0;
+    printf("%-24s %10.2f ns/op  +- %6.2f  (min %.2f)\n", bench->name, mean, stddev, min);
+    free(ns);
+    FreeState(state);
+}
+
+int main(int argc, char **argv) {
+    int samples = BENCH_SAMPLES;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        samples = atoi(argv[2]);
+        first = 3;
+    }
+    if (samples < 1) {
+        Error("Usage: rve-bench [-n samples] [name-prefix]...");
+    }
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        bool selected = first == argc;
+        for (int j = first; j < argc; j++) {
+            selected |= !strncmp(benches[i].name, argv[j], strlen(argv[j]));
+        }
+        if (selected) {
+            RunBench(&benches[i], samples);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "rve.h"
+
+// Lockstep differential checker.
+//
+// The program runs on two States: one with the fast engine and one with the
+// reference engine, which fetches and translates everything from memory.
+// After every instruction the checker compares the registers, the pc, the
+// privilege mode, the trap CSRs and the RAM that either of them stored to,
+// and stops at the first difference. Like rve-test, a run ends when the
+// program writes a result to `tohost`.
+
+#define DIFF_MEM_SIZE 0x9000000
+#define DIFF_MAX_INSTRET 100000000
+// Recent instructions printed with a divergence.
+#define DIFF_HISTORY 8
+
+const uint16_t diff_csrs[] = {
+    SSTATUS, SIE, STVEC, SEPC, SCAUSE, STVAL, SIP, SATP,
+    MSTATUS, MEDELEG, MIDELEG, MIE, MTVEC, MEPC, MCAUSE, MTVAL, MIP,
+};
+
+typedef struct DiffStep {
+    uint64_t pc;
+    uint32_t instr;
+} DiffStep;
+
+State *NewDiffState(size_t size, uint8_t *bin, bool reference) {
+    State *state = NewState(DIFF_MEM_SIZE);
+    ResetState(state);
+    state->pc = LoadElf(state, size, bin, false);
+    state->idle_skip = false;
+    state->reference = reference;
+    state->store_log = calloc(1, sizeof(StoreLog));
+    return state;
+}
+
+// The instruction at the pc, read without leaving a trap behind.
+uint32_t PeekInstruction(State *state) {
+    bool excepted = state->excepted;
+    uint64_t code = state->exception_code;
+    uint64_t value = state->exception_value;
+    uint32_t instr = Fetch32(state, state->pc);
+    state->excepted = excepted;
+    state->exception_code = code;
+    state->exception_value = value;
+    return instr;
+}
+
+void PrintStep(const char *prefix, DiffStep *step) {
+    char text[64];
+    Disassemble(step->pc, step->instr, text, sizeof(text));
+    printf("%s0x%016llx: %0*x  %s\n", prefix, (unsigned long long)step->pc,
+           (step->instr & 3) == 3 ? 8 : 4, step->instr, text);
+}
+
+int CompareReg(const char *name, uint64_t fast, uint64_t ref, bool verbose) {
+    if (fast == ref) {
+        return 0;
+    }
+    if (verbose) {
+        printf("  %-8s fast 0x%016llx  reference 0x%016llx\n", name, (unsigned long long)fast,
+               (unsigned long long)ref);
+    }
+    return 1;
+}
+
+// Compare the RAM stored to by the last instruction, or all of it when a log
+// overflowed.
+int CompareStores(State *fast, State *ref, bool verbose) {
+    StoreLog *logs[2] = {fast->store_log, ref->store_log};
+    if (logs[0]->len > STORE_LOG_SIZE || logs[1]->len > STORE_LOG_SIZE) {
+        if (memcmp(fast->mem, ref->mem, DIFF_MEM_SIZE) == 0) {
+            return 0;
+        }
+        for (uint64_t i = 0; i < DIFF_MEM_SIZE && verbose; i++) {
+            if (fast->mem[i] != ref->mem[i]) {
+                printf("  mem      first difference at 0x%llx: fast 0x%02x  reference 0x%02x\n",
+                       (unsigned long long)(DRAM_BASE + i), fast->mem[i], ref->mem[i]);
+                break;
+            }
+        }
+        return 1;
+    }
+    int diffs = 0;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < logs[i]->len; j++) {
+            uint64_t offset = logs[i]->addr[j] - DRAM_BASE;
+            uint64_t len = logs[i]->size[j];
+            if (offset >= DIFF_MEM_SIZE || len > DIFF_MEM_SIZE - offset ||
+                memcmp(fast->mem + offset, ref->mem + offset, len) == 0) {
+                continue;
+            }
+            for (uint64_t k = offset; k < offset + len && verbose; k++) {
+                if (fast->mem[k] != ref->mem[k]) {
+                    printf("  mem      0x%llx: fast 0x%02x  reference 0x%02x\n",
+                           (unsigned long long)(DRAM_BASE + k), fast->mem[k], ref->mem[k]);
+                    break;
+                }
+            }
+            diffs++;
+        }
+    }
+    return diffs;
+}
+
+// The number of differences, which are printed if `verbose` is set.
+int CompareStates(State *fast, State *ref, bool verbose) {
+    int diffs = 0;
+    diffs += CompareReg("pc", fast->pc, ref->pc, verbose);
+    diffs += CompareReg("mode", fast->mode, ref->mode, verbose);
+    for (int i = 0; i < 32; i++) {
+        char name[8];
+        snprintf(name, sizeof(name), "x%d", i);
+        diffs += CompareReg(name, fast->x[i], ref->x[i], verbose);
+    }
+    for (size_t i = 0; i < sizeof(diff_csrs) / sizeof(diff_csrs[0]); i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "csr 0x%03x", diff_csrs[i]);
+        diffs += CompareReg(name, fast->csr[diff_csrs[i]], ref->csr[diff_csrs[i]], verbose);
+    }
+    diffs += CompareStores(fast, ref, verbose);
+    return diffs;
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_instret = DIFF_MAX_INSTRET;
+    char *name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--max-instret") && i + 1 < argc) {
+            max_instret = strtoull(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-' || name != NULL) {
+            Error("Usage: rve-diff [--max-instret n] file");
+        } else {
+            name = argv[i];
+        }
+    }
+    if (name == NULL) {
+        Error("Usage: rve-diff [--max-instret n] file");
+    }
+
+    uint8_t *bin;
+    size_t size = ReadBinaryFile(name, &bin);
+    uint64_t tohost = ElfSymbol(size, bin, "tohost");
+    if (tohost != 0 && (tohost < DRAM_BASE || tohost - DRAM_BASE + 8 > DIFF_MEM_SIZE)) {
+        tohost = 0;
+    }
+    State *fast = NewDiffState(size, bin, false);
+    State *ref = NewDiffState(size, bin, true);
+    free(bin);
+
+    DiffStep history[DIFF_HISTORY] = {0};
+    uint64_t steps = 0;
+    for (; steps < max_instret; steps++) {
+        DiffStep *step = &history[steps % DIFF_HISTORY];
+        step->pc = ref->pc;
+        step->instr = PeekInstruction(ref);
+        fast->store_log->len = 0;
+        ref->store_log->len = 0;
+        Tick(fast);
+        Tick(ref);
+        if (CompareStates(fast, ref, false) != 0) {
+            printf("divergence after instruction %llu:\n", (unsigned long long)steps + 1);
+            uint64_t first = steps + 1 > DIFF_HISTORY ? steps + 1 - DIFF_HISTORY : 0;
+            for (uint64_t i = first; i < steps; i++) {
+                PrintStep("    ", &history[i % DIFF_HISTORY]);
+            }
+            PrintStep("  > ", step);
+            CompareStates(fast, ref, true);
+            return 1;
+        }
+        if (fast->halted) {
+            printf("halted by wfi at 0x%llx\n", (unsigned long long)fast->pc);
+            steps++;
+            break;
+        }
+        if (tohost == 0) {
+            continue;
+        }
+        uint64_t *fast_result = (uint64_t *)(fast->mem + (tohost - DRAM_BASE));
+        uint64_t *ref_result = (uint64_t *)(ref->mem + (tohost - DRAM_BASE));
+        if (*fast_result >> 48 != 0) {
+            // A console request of the v environment.
+            *fast_result = 0;
+            *ref_result = 0;
+        } else if (*fast_result != 0) {
+            printf("tohost 0x%llx\n", (unsigned long long)*fast_result);
+            steps++;
+            break;
+        }
+    }
+    printf("no divergence in %llu instructions\n", (unsigned long long)steps);
+    return 0;
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <signal.h>
+#include <unistd.h>
+
+// Fuzzing harness for the decoder and the executor.
+//
+// An input is a raw instruction stream. It is loaded at DRAM_BASE of a fresh
+// State and run for a bounded number of instructions, with the registers
+// pointing into RAM so that loads and stores get past translation. A trapping
+// instruction is skipped, so that the rest of the stream runs too. After
+// every instruction the harness checks that x0 is still 0, that an
+// instruction which isn't a jump or a branch moved the pc past itself and
+// that a trap went to the trap vector. A crash, an Error() or a step that
+// doesn't return within FUZZ_TIMEOUT seconds is also a finding.
+//
+// Built with -DRVE_LIBFUZZER, this file is a libFuzzer target. Otherwise
+// rve-fuzz runs the given files (e.g. from AFL with @@) or random streams.
+
+#define FUZZ_MEM_SIZE 0x10000
+#define FUZZ_MAX_INPUT 0x1000
+#define FUZZ_MAX_STEPS 4096
+#define FUZZ_TIMEOUT 10
+#define FUZZ_RUNS 100000
+
+// The input being run, saved when the process dies on it.
+const uint8_t *fuzz_data;
+size_t fuzz_size;
+
+void SaveInput(const char *reason) {
+    if (fuzz_data == NULL) {
+        return;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "crash-%d.bin", getpid());
+    FILE *fp = fopen(name, "wb");
+    if (fp != NULL) {
+        fwrite(fuzz_data, 1, fuzz_size, fp);
+        fclose(fp);
+    }
+    fprintf(stderr, "rve-fuzz: %s, input saved to %s\n", reason, name);
+    fuzz_data = NULL;
+}
+
+void Finding(State *state, uint64_t pc, uint32_t instr, const char *fmt, ...) {
+    char text[64];
+    Disassemble(pc, instr, text, sizeof(text));
+    fprintf(stderr, "rve-fuzz: 0x%llx: %s: ", (unsigned long long)pc, text);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    SaveInput("mismatch");
+    abort();
+}
+
+// Jumps, branches and xRET may go anywhere.
+bool IsControlTransfer(uint32_t instr) {
+    if ((instr & 3) != 3) {
+        uint32_t funct3 = instr >> 13 & 7;
+        if ((instr & 3) == 1) {
+            return funct3 == 5 || funct3 == 6 || funct3 == 7;
+        }
+        // c.jr and c.jalr.
+        return (instr & 3) == 2 && funct3 == 4 && (instr >> 2 & 31) == 0;
+    }
+    uint32_t opcode = instr & 0x7f;
+    return opcode == 0x63 || opcode == 0x67 || opcode == 0x6f || (opcode == 0x73 && (instr >> 12 & 7) == 0);
+}
+
+// Where the last trap into the mode went, given xtvec and xcause.
+uint64_t TrapTarget(State *state, uint16_t tvec, uint16_t cause) {
+    uint64_t base = state->csr[tvec] & ~1ULL;
+    if (state->csr[tvec] & 1) {
+        base += 4 * (state->csr[cause] & SetNBits(63));
+    }
+    return base;
+}
+
+void RunInput(const uint8_t *data, size_t size) {
+    if (size > FUZZ_MAX_INPUT) {
+        size = FUZZ_MAX_INPUT;
+    }
+    State *state = NewState(FUZZ_MEM_SIZE);
+    ResetState(state);
+    state->idle_skip = false;
+    memcpy(state->mem, data, size);
+    state->pc = DRAM_BASE;
+    for (int i = 1; i < 32; i++) {
+        state->x[i] = DRAM_BASE + FUZZ_MAX_INPUT + i * 0x100;
+    }
+
+    for (int step = 0; step < FUZZ_MAX_STEPS; step++) {
+        uint64_t pc = state->pc;
+        if (pc < DRAM_BASE || pc >= DRAM_BASE + size) {
+            break;
+        }
+        uint32_t instr = Fetch32(state, pc);
+        if (state->excepted) {
+            break;
+        }
+        uint64_t len = (instr & 3) == 3 ? 4 : 2;
+        uint64_t instret = state->instret;
+        uint64_t mcause = state->csr[MCAUSE];
+        uint64_t scause = state->csr[SCAUSE];
+
+        alarm(FUZZ_TIMEOUT);
+        Tick(state);
+        alarm(0);
+
+        if (state->x[0] != 0) {
+            Finding(state, pc, instr, "x0 is 0x%llx", (unsigned long long)state->x[0]);
+        }
+        if (state->halted) {
+            break;
+        }
+        bool trapped = state->instret == instret;
+        bool to_vector = state->pc == TrapTarget(state, MTVEC, MCAUSE) ||
+                         state->pc == TrapTarget(state, STVEC, SCAUSE);
+        if (trapped && !to_vector) {
+            Finding(state, pc, instr, "trapped to 0x%llx, not to the trap vector",
+                    (unsigned long long)state->pc);
+        }
+        // A retired instruction may still be followed by an interrupt.
+        bool interrupted = to_vector && (state->csr[MCAUSE] != mcause || state->csr[SCAUSE] != scause);
+        if (!trapped && !interrupted && !IsControlTransfer(instr) && state->pc != pc + len) {
+            Finding(state, pc, instr, "the pc moved to 0x%llx", (unsigned long long)state->pc);
+        }
+        if (trapped) {
+            state->pc = pc + len;
+        }
+    }
+    FreeState(state);
+}
+
+void OnSignal(int sig) {
+    SaveInput(sig == SIGALRM ? "timeout" : strsignal(sig));
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void OnExit() {
+    // Error() exits the process in the middle of an input.
+    SaveInput("exited");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_data = data;
+    fuzz_size = size;
+    RunInput(data, size);
+    fuzz_data = NULL;
+    return 0;
+}
+
+#ifndef RVE_LIBFUZZER
+// A random stream: random words, half of them with the opcode of a 32-bit
+// instruction class, so that most of them decode further than the opcode.
+size_t RandomInput(uint8_t *buf, unsigned int *seed) {
+    const uint8_t opcodes[] = {0x03, 0x0f, 0x13, 0x17, 0x1b, 0x23, 0x2f, 0x33, 0x37, 0x3b, 0x63, 0x67, 0x6f, 0x73};
+    size_t words = 1 + rand_r(seed) % 64;
+    for (size_t i = 0; i < words; i++) {
+        uint32_t word = (uint32_t)rand_r(seed) << 16 ^ (uint32_t)rand_r(seed);
+        if (rand_r(seed) % 2) {
+            word = (word & ~0x7fU) | opcodes[rand_r(seed) % sizeof(opcodes)];
+        }
+        memcpy(buf + 4 * i, &word, 4);
+    }
+    return 4 * words;
+}
+
+int main(int argc, char **argv) {
+    uint64_t runs = FUZZ_RUNS;
+    unsigned int seed = time(NULL);
+    int first = argc;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            runs = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-') {
+            Error("Usage: rve-fuzz [-n runs] [-s seed] [file]...");
+        } else {
+            first = i;
+            break;
+        }
+    }
+    signal(SIGSEGV, OnSignal);
+    signal(SIGBUS, OnSignal);
+    signal(SIGFPE, OnSignal);
+    signal(SIGILL, OnSignal);
+    signal(SIGABRT, OnSignal);
+    signal(SIGALRM, OnSignal);
+    atexit(OnExit);
+
+    if (first < argc) {
+        for (int i = first; i < argc; i++) {
+            uint8_t *bin;
+            size_t size = ReadBinaryFile(argv[i], &bin);
+            LLVMFuzzerTestOneInput(bin, size);
+            free(bin);
+        }
+        printf("%d inputs ok\n", argc - first);
+        return 0;
+    }
+    printf("seed %u\n", seed);
+    uint8_t buf[4 * 64];
+    for (uint64_t i = 0; i < runs; i++) {
+        size_t size = RandomInput(buf, &seed);
+        LLVMFuzzerTestOneInput(buf, size);
+    }
+    printf("%llu inputs ok\n", (unsigned long long)runs);
+    return 0;
+}
+#endif
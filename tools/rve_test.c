@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include "rve.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// In-process riscv-tests runner.
+//
+// Every test runs on a State of its own, so the tests are spread over a pool
+// of threads without forking. A test ends when it writes its result to the
+// `tohost` symbol: 1 for a pass and (n << 1) | 1 when test case n fails.
+// Writes with a device in the upper bits are console requests of the v
+// environment, which are acknowledged by clearing `tohost`.
+
+#define TEST_MEM_SIZE 0x9000000
+#define TEST_MAX_INSTRET 10000000
+#define TEST_MESSAGE_SIZE 256
+
+enum TestStatus {
+    TestPass,
+    TestFail,
+    TestError,
+};
+
+typedef struct TestCase {
+    char *path;
+    uint8_t status;
+    char message[TEST_MESSAGE_SIZE];
+    uint64_t instret;
+    uint64_t nanos;
+} TestCase;
+
+typedef struct TestRun {
+    TestCase *tests;
+    int len;
+    // The next test to pick up, shared by the workers.
+    int next;
+    uint64_t max_instret;
+} TestRun;
+
+void RunTestCase(TestCase *test, uint64_t max_instret) {
+    uint64_t start = HostNanos();
+    uint8_t *bin;
+    size_t size = ReadBinaryFile(test->path, &bin);
+    uint64_t tohost = ElfSymbol(size, bin, "tohost");
+    if (tohost < DRAM_BASE || tohost - DRAM_BASE + 8 > TEST_MEM_SIZE) {
+        test->status = TestError;
+        snprintf(test->message, sizeof(test->message), "no tohost symbol");
+        free(bin);
+        test->nanos = HostNanos() - start;
+        return;
+    }
+
+    State *state = NewState(TEST_MEM_SIZE);
+    ResetState(state);
+    state->pc = LoadElf(state, size, bin, false);
+    free(bin);
+    uint64_t *result = (uint64_t *)(state->mem + (tohost - DRAM_BASE));
+    test->status = TestError;
+    snprintf(test->message, sizeof(test->message), "no result after %llu instructions",
+             (unsigned long long)max_instret);
+    for (uint64_t i = 0; i < max_instret; i++) {
+        Tick(state);
+        if (state->halted) {
+            snprintf(test->message, sizeof(test->message), "halted by wfi at 0x%llx",
+                     (unsigned long long)state->pc);
+            break;
+        }
+        uint64_t val = *result;
+        if (val == 0) {
+            continue;
+        } else if (val >> 48 != 0) {
+            *result = 0;
+            continue;
+        }
+        if (val == 1) {
+            test->status = TestPass;
+            test->message[0] = '\0';
+        } else {
+            test->status = TestFail;
+            snprintf(test->message, sizeof(test->message), "test case %llu failed",
+                     (unsigned long long)(val >> 1));
+        }
+        break;
+    }
+    test->instret = state->clock;
+    FreeState(state);
+    test->nanos = HostNanos() - start;
+}
+
+void *TestWorker(void *arg) {
+    TestRun *run = arg;
+    for (;;) {
+        int i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (i >= run->len) {
+            return NULL;
+        }
+        RunTestCase(&run->tests[i], run->max_instret);
+    }
+}
+
+// rve is RV64 without F and D, so only those suites are collected.
+bool IsSupportedTest(const char *name) {
+    if (strncmp(name, "rv64", 4) != 0 || strchr(name, '.') != NULL) {
+        return false;
+    }
+    return strncmp(name, "rv64uf-", 7) != 0 && strncmp(name, "rv64ud-", 7) != 0;
+}
+
+const char *TestName(const TestCase *test) {
+    const char *slash = strrchr(test->path, '/');
+    return slash != NULL ? slash + 1 : test->path;
+}
+
+int CompareTests(const void *a, const void *b) {
+    return strcmp(TestName(a), TestName(b));
+}
+
+void AddTest(Vec *tests, const char *path) {
+    TestCase *test = calloc(1, sizeof(TestCase));
+    test->path = strdup(path);
+    PushVec(tests, test);
+}
+
+void CollectTests(Vec *tests, const char *dir_name) {
+    DIR *dir = opendir(dir_name);
+    if (dir == NULL) {
+        Error("Can't open the directory: %s", dir_name);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (IsSupportedTest(entry->d_name)) {
+            char *path = malloc(strlen(dir_name) + strlen(entry->d_name) + 2);
+            sprintf(path, "%s/%s", dir_name, entry->d_name);
+            AddTest(tests, path);
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+const char *StatusName(uint8_t status) {
+    return status == TestPass ? "pass" : status == TestFail ? "fail" : "error";
+}
+
+// Write the `len` bytes of `str` as the contents of an XML attribute.
+void WriteXmlString(FILE *fp, const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t ch = str[i];
+        if (ch == '&') {
+            fputs("&amp;", fp);
+        } else if (ch == '<') {
+            fputs("&lt;", fp);
+        } else if (ch == '>') {
+            fputs("&gt;", fp);
+        } else if (ch == '"') {
+            fputs("&quot;", fp);
+        } else if (ch < 0x20) {
+            fprintf(fp, "&#%d;", ch);
+        } else {
+            putc(ch, fp);
+        }
+    }
+}
+
+void WriteJson(TestRun *run, const char *name, int failed, uint64_t nanos) {
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL) {
+        Error("Can't open the file: %s.", name);
+    }
+    fprintf(fp, "{\n  \"passed\": %d,\n  \"failed\": %d,\n  \"time_ms\": %.3f,\n  \"tests\": [\n",
+            run->len - failed, failed, nanos / 1e6);
+    for (int i = 0; i < run->len; i++) {
+        TestCase *test = &run->tests[i];
+        const char *name = TestName(test);
+        fprintf(fp, "    {\"name\": \"");
+        WriteJsonString(fp, name, strlen(name));
+        fprintf(fp, "\", \"status\": \"%s\", \"message\": \"", StatusName(test->status));
+        WriteJsonString(fp, test->message, strlen(test->message));
+        fprintf(fp, "\", \"instret\": %llu, \"time_ms\": %.3f}%s\n",
+                (unsigned long long)test->instret, test->nanos / 1e6, i + 1 < run->len ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+void WriteJunit(TestRun *run, const char *name, int failed, uint64_t nanos) {
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL) {
+        Error("Can't open the file: %s.", name);
+    }
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(fp, "<testsuite name=\"riscv-tests\" tests=\"%d\" failures=\"%d\" time=\"%.6f\">\n",
+            run->len, failed, nanos / 1e9);
+    for (int i = 0; i < run->len; i++) {
+        TestCase *test = &run->tests[i];
+        // rv64ui-p-add is the case add of the class rv64ui-p.
+        const char *name = TestName(test);
+        const char *dash = strrchr(name, '-');
+        size_t class_len = dash != NULL ? dash - name : 0;
+        const char *case_name = dash != NULL ? dash + 1 : name;
+        fprintf(fp, "  <testcase classname=\"");
+        WriteXmlString(fp, name, class_len);
+        fprintf(fp, "\" name=\"");
+        WriteXmlString(fp, case_name, strlen(case_name));
+        fprintf(fp, "\" time=\"%.6f\"", test->nanos / 1e9);
+        if (test->status == TestPass) {
+            fprintf(fp, "/>\n");
+        } else {
+            fprintf(fp, ">\n    <failure message=\"");
+            WriteXmlString(fp, test->message, strlen(test->message));
+            fprintf(fp, "\"/>\n  </testcase>\n");
+        }
+    }
+    fprintf(fp, "</testsuite>\n");
+    fclose(fp);
+}
+
+void Usage() {
+    Error("Usage: rve-test [-j jobs] [--json file] [--junit file] [--max-instret n] [dir|test]...");
+}
+
+int main(int argc, char **argv) {
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *json_name = NULL;
+    char *junit_name = NULL;
+    TestRun run = {.max_instret = TEST_MAX_INSTRET};
+    Vec *tests = CreateVec();
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            json_name = argv[++i];
+        } else if (!strcmp(argv[i], "--junit") && i + 1 < argc) {
+            junit_name = argv[++i];
+        } else if (!strcmp(argv[i], "--max-instret") && i + 1 < argc) {
+            run.max_instret = strtoull(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-') {
+            Usage();
+        } else {
+            DIR *dir = opendir(argv[i]);
+            if (dir != NULL) {
+                closedir(dir);
+                CollectTests(tests, argv[i]);
+            } else {
+                AddTest(tests, argv[i]);
+            }
+        }
+    }
+    if (tests->len == 0) {
+        CollectTests(tests, "test/riscv-tests");
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    run.len = tests->len;
+    run.tests = calloc(run.len, sizeof(TestCase));
+    for (int i = 0; i < run.len; i++) {
+        TestCase *test = GetVec(tests, i);
+        run.tests[i] = *test;
+        free(test);
+    }
+    qsort(run.tests, run.len, sizeof(TestCase), CompareTests);
+
+    uint64_t start = HostNanos();
+    pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, TestWorker, &run) != 0) {
+            Error("Can't start a worker thread");
+        }
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t nanos = HostNanos() - start;
+
+    int failed = 0;
+    for (int i = 0; i < run.len; i++) {
+        TestCase *test = &run.tests[i];
+        if (test->status != TestPass) {
+            printf("%s: %s: %s\n", TestName(test), StatusName(test->status), test->message);
+            failed++;
+        }
+    }
+    printf("%d passed, %d failed in %.1f ms\n", run.len - failed, failed, nanos / 1e6);
+    if (json_name != NULL) {
+        WriteJson(&run, json_name, failed, nanos);
+    }
+    if (junit_name != NULL) {
+        WriteJunit(&run, junit_name, failed, nanos);
+    }
+    return failed != 0;
+}